@@ -2,14 +2,61 @@
 #include <iostream>
 #include <sqlite3.h>
 #include <string>
+#ifdef _WIN32
 #include <windows.h>
+#endif
 #include <algorithm>
+#include <iterator>
+#include <tuple>
 #include <openssl/sha.h>
 #include <sstream>
 #include <iomanip>
-
-
-
+#include <unordered_map>
+#include <mutex>
+#include <fstream>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <condition_variable>
+#include <future>
+#include <chrono>
+#include <memory>
+#include <atomic>
+#include <functional>
+#include <shared_mutex>
+#include <random>
+#include <limits>
+#include <ctime>
+#include <cstdint>
+#include <cstring>
+#include <charconv>
+#ifdef _WIN32
+#include <conio.h>
+#include <io.h>
+#else
+#include <termios.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <csignal>
+#include <cerrno>
+#endif
+
+
+
+
+// Денежные суммы хранятся целым числом копеек
+typedef long long Money;
 
 void menu(sqlite3* db);
 void admin_menu(sqlite3* db);
@@ -17,844 +64,7676 @@ void register_user(sqlite3* db, bool money);
 void input_user(sqlite3* db);
 void create_status(sqlite3* db);
 void login_user(sqlite3* db);
-void user_menu(sqlite3* db, int user_id);
-void show_balance(sqlite3* db, int user_id);
-void deposit_balance(sqlite3* db, int user_id);
+struct Session;
+void user_menu(sqlite3* db, Session& session);
+void show_balance(sqlite3* db, Session& session);
+void deposit_balance(sqlite3* db, Session& session);
 void increase_balance(sqlite3* db);
-void transfer_to_user(sqlite3* db, int user_id);
-void display_user_transactions(sqlite3* db, int user_id);
+void transfer_to_user(sqlite3* db, Session& session);
+enum class TransferResult { Ok, InsufficientFunds, RecipientNotFound, RecipientDeleted, RecipientBanned, Error };
+TransferResult perform_transfer(sqlite3* db, const Session& sender, const std::string& recipient_first_name,
+    const std::string& recipient_last_name, Money amount);
+// Код статуса в users.status; Active хранится как 0 (раньше - NULL)
+enum class AccountStatus : int { Active = 0, Deleted = 1, Banned = 2, Credited = 3 };
+const char* status_name(AccountStatus status);
+bool parse_status(const std::string& text, AccountStatus& status);
+enum class LoginResult { Ok, WrongCredentials, Deleted, Banned, Error };
+LoginResult authenticate_user(sqlite3* db, const std::string& first_name, const std::string& last_name,
+    const std::string& password, int& user_id);
+bool open_session(sqlite3* db, int user_id, Session& session);
+bool get_balance(sqlite3* db, int user_id, Money& balance);
+bool perform_deposit(sqlite3* db, int user_id, Money amount);
+enum class TransferEligibility { Allowed, Blocked, NotFound };
+TransferEligibility transfer_eligibility(sqlite3* db, int user_id);
+enum class AdminResult { Ok, NotFound, Deleted, Banned, Error };
+AdminResult admin_increase_balance(sqlite3* db, int user_id, Money amount);
+AdminResult set_user_status(sqlite3* db, int user_id, AccountStatus status);
+bool create_user(sqlite3* db, const std::string& first_name, const std::string& last_name,
+    const std::string& password, Money cash);
+void display_user_transactions(sqlite3* db, const Session& session);
+void show_statement_cache_stats(sqlite3* db);
+void show_account_cache_stats(sqlite3* db);
+struct ReconcileReport;
+bool reconcile_ledger(sqlite3* db, unsigned threads, ReconcileReport& report);
+void print_reconcile_report(const ReconcileReport& report);
 std::string normalize_name(const std::string& input);
 std::string hash_password(const std::string& password);
+bool verify_lookup_plans(sqlite3* db);
+bool migrate_schema(sqlite3* db);
+bool init_schema(sqlite3* db);
+bool parse_money(const std::string& text, Money& amount, bool allow_zero = false);
+bool parse_int(const std::string& text, int& value, int min, int max);
+std::string format_money(Money amount);
+
+const char* const DB_PATH = "bankdb.db";
+const char* const ADMIN_PASSWORD_HASH = "8174a05d4e26d063122d119197d3d157b486fb810746504acead103820e36e61";
+
+// Поиск по имени и фамилии; оба запроса должны идти по индексу idx_users_name
+const char* const LOGIN_SQL = "SELECT id, status FROM users WHERE first_name = ? AND last_name = ? AND password = ?;";
+const char* const FIND_RECIPIENT_SQL = "SELECT id, status FROM users WHERE first_name = ? AND last_name = ?;";
+
+const int PAGE_SIZE = 20;
+
+const Money KOPECKS_PER_RUBLE = 100;
+// Верхняя граница одной суммы: с запасом до переполнения int64 при сложении балансов
+const Money MAX_MONEY = 1000000000000000LL;
+
+const char* status_name(AccountStatus status) {
+    switch (status) {
+    case AccountStatus::Deleted: return "deleted";
+    case AccountStatus::Banned: return "banned";
+    case AccountStatus::Credited: return "credited";
+    default: return "NULL";
+    }
+}
 
+// "none" снимает статус
+bool parse_status(const std::string& text, AccountStatus& status) {
+    for (AccountStatus value : { AccountStatus::Deleted, AccountStatus::Banned, AccountStatus::Credited }) {
+        if (text == status_name(value)) {
+            status = value;
+            return true;
+        }
+    }
+    if (text == "none") {
+        status = AccountStatus::Active;
+        return true;
+    }
+    return false;
+}
 
+AccountStatus column_status(sqlite3_stmt* stmt, int column) {
+    int code = sqlite3_column_int(stmt, column);
+    return (code >= 0 && code <= static_cast<int>(AccountStatus::Credited)) ? static_cast<AccountStatus>(code) : AccountStatus::Active;
+}
 
 
-class TransactionManager {
-private:
-    sqlite3* db;
 
-public:
-    explicit TransactionManager(sqlite3* database) : db(database) {}
+// ---- Метрики ----
+// Гистограммы задержек операций банка, шагов SQLite, хэширования и фиксаций.
+// Каждый поток пишет в свой набор счётчиков без блокировок, при чтении
+// наборы всех потоков складываются.
 
-    bool create_table() {
-        const char* sqlCreateTransactionsTable =
-            "CREATE TABLE IF NOT EXISTS transactions ("
-            "id INTEGER PRIMARY KEY AUTOINCREMENT,"
-            "user_id INTEGER NOT NULL,"
-            "type TEXT NOT NULL,"
-            "amount FLOAT NOT NULL,"
-            "timestamp DATETIME DEFAULT CURRENT_TIMESTAMP,"
-            "description TEXT,"
-            "FOREIGN KEY(user_id) REFERENCES users(id));";
+enum class Metric { Login, Balance, Deposit, Transfer, History, AdminIncrease, StatusChange,
+    PasswordHash, SqliteStep, Commit, Count };
 
-        char* errMsg = nullptr;
-        int rc = sqlite3_exec(db, sqlCreateTransactionsTable, nullptr, nullptr, &errMsg);
-        if (rc != SQLITE_OK) {
-            std::cerr << "Ошибка создания таблицы транзакций: " << errMsg << std::endl;
-            sqlite3_free(errMsg);
-            return false;
-        }
-        return true;
-    }
+const char* const METRIC_NAMES[] = { "login", "balance", "deposit", "transfer", "history", "admin_increase",
+    "status_change", "password_hash", "sqlite_step", "commit" };
 
-    bool add_transaction(int user_id, const std::string& type, double amount, const std::string& description = "") {
-        const char* sql = "INSERT INTO transactions (user_id, type, amount, description) VALUES (?, ?, ?, ?);";
-        sqlite3_stmt* stmt;
+// Логарифмические корзины: 16 на каждую степень двойки наносекунд,
+// то есть относительная погрешность перцентиля не больше 1/16.
+const int LATENCY_SUB_BUCKETS = 16;
+const int LATENCY_BUCKETS = 61 * LATENCY_SUB_BUCKETS;
+const int METRIC_COUNT = static_cast<int>(Metric::Count);
 
-        if (sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr) != SQLITE_OK) {
-            std::cerr << "Ошибка подготовки запроса транзакции: " << sqlite3_errmsg(db) << std::endl;
-            return false;
-        }
+inline int latency_bucket(unsigned long long ns) {
+    if (ns < LATENCY_SUB_BUCKETS) {
+        return static_cast<int>(ns);
+    }
+    int exponent = 63;
+    while (!(ns >> exponent)) --exponent;
+    int sub = static_cast<int>((ns >> (exponent - 4)) & (LATENCY_SUB_BUCKETS - 1));
+    return (exponent - 3) * LATENCY_SUB_BUCKETS + sub;
+}
 
-        sqlite3_bind_int(stmt, 1, user_id);
-        sqlite3_bind_text(stmt, 2, type.c_str(), -1, SQLITE_STATIC);
-        sqlite3_bind_double(stmt, 3, amount);
-        sqlite3_bind_text(stmt, 4, description.c_str(), -1, SQLITE_STATIC);
+// Верхняя граница значений корзины
+inline unsigned long long latency_bucket_limit(int bucket) {
+    if (bucket < LATENCY_SUB_BUCKETS) {
+        return static_cast<unsigned long long>(bucket);
+    }
+    int exponent = bucket / LATENCY_SUB_BUCKETS + 3;
+    unsigned long long sub = static_cast<unsigned long long>(bucket % LATENCY_SUB_BUCKETS);
+    return ((LATENCY_SUB_BUCKETS + sub + 1) << (exponent - 4)) - 1;
+}
 
-        bool success = true;
-        if (sqlite3_step(stmt) != SQLITE_DONE) {
-            std::cerr << "Ошибка вставки транзакции: " << sqlite3_errmsg(db) << std::endl;
-            success = false;
-        }
+struct MetricSummary {
+    unsigned long long count = 0;
+    double rate = 0;            // операций в секунду с запуска
+    double mean_us = 0;
+    double p50_us = 0;
+    double p99_us = 0;
+    double p999_us = 0;
+    double max_us = 0;
+};
 
-        sqlite3_finalize(stmt);
-        return success;
+class Metrics {
+private:
+    // Пишет только поток-владелец, поэтому хватает relaxed load/store без атомарного сложения
+    struct Shard {
+        std::atomic<unsigned long long> counts[METRIC_COUNT][LATENCY_BUCKETS];
+        std::atomic<unsigned long long> total_ns[METRIC_COUNT];
+        std::atomic<unsigned long long> max_ns[METRIC_COUNT];
+    };
+
+    static std::mutex& shards_mutex() {
+        static std::mutex m;
+        return m;
     }
 
-    void get_all_transactions() {
-        const char* sqlSelectAllTransactions = "SELECT * FROM transactions;";
-        sqlite3_stmt* stmt;
+    // Наборы завершившихся потоков остаются в списке, их данные не теряются
+    static std::vector<std::unique_ptr<Shard>>& shards() {
+        static std::vector<std::unique_ptr<Shard>> all;
+        return all;
+    }
 
-        int rc = sqlite3_prepare_v2(db, sqlSelectAllTransactions, -1, &stmt, nullptr);
-        if (rc != SQLITE_OK) {
-            std::cerr << "Ошибка подготовки запроса: " << sqlite3_errmsg(db) << std::endl;
-            return;
+    static Shard& local() {
+        thread_local Shard* shard = nullptr;
+        if (shard == nullptr) {
+            std::unique_ptr<Shard> created(new Shard());
+            shard = created.get();
+            std::lock_guard<std::mutex> lock(shards_mutex());
+            shards().push_back(std::move(created));
         }
+        return *shard;
+    }
 
-        std::cout << "\n=== Все транзакции ===\n";
+    static void bump(std::atomic<unsigned long long>& counter, unsigned long long delta) {
+        counter.store(counter.load(std::memory_order_relaxed) + delta, std::memory_order_relaxed);
+    }
 
-        while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
-            int id = sqlite3_column_int(stmt, 0);
-            int userId = sqlite3_column_int(stmt, 1);
-            const unsigned char* type = sqlite3_column_text(stmt, 2);
-            float amount = static_cast<float>(sqlite3_column_double(stmt, 3));
-            const unsigned char* date = sqlite3_column_text(stmt, 4);
+public:
+    static std::chrono::steady_clock::time_point started() {
+        static const std::chrono::steady_clock::time_point at = std::chrono::steady_clock::now();
+        return at;
+    }
 
-            std::cout << "ID: " << id << ", User ID: " << userId
-                << ", Тип: " << type << ", Сумма: " << amount
-                << ", Дата: " << date << std::endl;
+    static void record(Metric metric, std::chrono::steady_clock::duration elapsed) {
+        unsigned long long ns = static_cast<unsigned long long>(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+        int m = static_cast<int>(metric);
+        Shard& shard = local();
+        bump(shard.counts[m][latency_bucket(ns)], 1);
+        bump(shard.total_ns[m], ns);
+        if (ns > shard.max_ns[m].load(std::memory_order_relaxed)) {
+            shard.max_ns[m].store(ns, std::memory_order_relaxed);
         }
+    }
 
-        if (rc != SQLITE_DONE) {
-            std::cerr << "Ошибка чтения транзакций: " << sqlite3_errmsg(db) << std::endl;
+    static MetricSummary summarize(Metric metric) {
+        int m = static_cast<int>(metric);
+        std::vector<unsigned long long> merged(LATENCY_BUCKETS, 0);
+        MetricSummary summary;
+        unsigned long long total_ns = 0, max_ns = 0;
+        {
+            std::lock_guard<std::mutex> lock(shards_mutex());
+            for (const auto& shard : shards()) {
+                for (int b = 0; b < LATENCY_BUCKETS; ++b) {
+                    merged[b] += shard->counts[m][b].load(std::memory_order_relaxed);
+                }
+                total_ns += shard->total_ns[m].load(std::memory_order_relaxed);
+                max_ns = std::max(max_ns, shard->max_ns[m].load(std::memory_order_relaxed));
+            }
+        }
+        for (unsigned long long c : merged) summary.count += c;
+        if (summary.count == 0) {
+            return summary;
         }
 
-        sqlite3_finalize(stmt);
+        double uptime = std::chrono::duration<double>(std::chrono::steady_clock::now() - started()).count();
+        summary.rate = uptime > 0 ? summary.count / uptime : 0;
+        summary.mean_us = total_ns / 1000.0 / summary.count;
+        summary.max_us = max_ns / 1000.0;
+
+        const double quantiles[] = { 0.50, 0.99, 0.999 };
+        double* targets[] = { &summary.p50_us, &summary.p99_us, &summary.p999_us };
+        unsigned long long seen = 0;
+        int q = 0;
+        for (int b = 0; b < LATENCY_BUCKETS && q < 3; ++b) {
+            seen += merged[b];
+            while (q < 3 && seen > 0 && seen >= quantiles[q] * summary.count) {
+                *targets[q] = std::min(latency_bucket_limit(b), max_ns) / 1000.0;
+                ++q;
+            }
+        }
+        return summary;
     }
-};
-
-class User {
-private:
-    std::string first_name;
-    std::string last_name;
-    std::string password;
-    float cash;
-    std::string status;
-
-public:
-    User(const std::string& fname, const std::string& lname, const std::string& pwd, float money, const std::string& stat = "")
-        : first_name(fname), last_name(lname), password(pwd), cash(money), status(stat) {}
 
-    static bool create_table(sqlite3* db) {
-        const char* sqlCreateUsersTable =
-            "CREATE TABLE IF NOT EXISTS users ("
-            "id INTEGER PRIMARY KEY AUTOINCREMENT,"
-            "first_name TEXT NOT NULL,"
-            "last_name TEXT NOT NULL,"
-            "password TEXT NOT NULL,"
-            "cash FLOAT,"
-            "status TEXT DEFAULT NULL);";
-
-        char* errMsg = nullptr;
-        int rc = sqlite3_exec(db, sqlCreateUsersTable, nullptr, nullptr, &errMsg);
-        if (rc != SQLITE_OK) {
-            std::cerr << "Ошибка создания таблицы пользователей: " << errMsg << std::endl;
-            sqlite3_free(errMsg);
-            return false;
+    // Таблица для меню администратора и файла статистики сервера.
+    // Заголовки латиницей: setw считает байты, а не символы
+    static std::string report() {
+        std::ostringstream out;
+        out << std::fixed << std::setprecision(1);
+        out << std::left << std::setw(16) << "operation" << std::right
+            << std::setw(12) << "count" << std::setw(10) << "per_sec"
+            << std::setw(11) << "mean_us" << std::setw(11) << "p50_us" << std::setw(11) << "p99_us"
+            << std::setw(12) << "p999_us" << std::setw(11) << "max_us" << "\n";
+        for (int m = 0; m < METRIC_COUNT; ++m) {
+            MetricSummary s = summarize(static_cast<Metric>(m));
+            out << std::left << std::setw(16) << METRIC_NAMES[m] << std::right
+                << std::setw(12) << s.count << std::setw(10) << s.rate
+                << std::setw(11) << s.mean_us << std::setw(11) << s.p50_us << std::setw(11) << s.p99_us
+                << std::setw(12) << s.p999_us << std::setw(11) << s.max_us << "\n";
         }
-        return true;
+        return out.str();
     }
+};
 
-    bool saveToDB(sqlite3* db) {
-        const char* insertSQL = "INSERT INTO users (first_name, last_name, password, cash) VALUES (?, ?, ?, ?);";
-        sqlite3_stmt* stmt;
-
-        int rc = sqlite3_prepare_v2(db, insertSQL, -1, &stmt, nullptr);
-        if (rc != SQLITE_OK) {
-            std::cerr << "Ошибка подготовки запроса: " << sqlite3_errmsg(db) << std::endl;
-            return false;
-        }
+// Замер времени до конца области видимости. Для операций банка заодно
+// запоминает текущую операцию потока - её подписывает трассировка запросов.
+class ScopedLatency {
+private:
+    Metric metric;
+    Metric outer;
+    std::chrono::steady_clock::time_point begin;
 
-        sqlite3_bind_text(stmt, 1, first_name.c_str(), -1, SQLITE_STATIC);
-        sqlite3_bind_text(stmt, 2, last_name.c_str(), -1, SQLITE_STATIC);
-        sqlite3_bind_text(stmt, 3, password.c_str(), -1, SQLITE_STATIC);
-        sqlite3_bind_double(stmt, 4, cash);
+    static bool is_operation(Metric m) {
+        return static_cast<int>(m) < static_cast<int>(Metric::PasswordHash);
+    }
 
-        rc = sqlite3_step(stmt);
-        if (rc != SQLITE_DONE) {
-            std::cerr << "Ошибка при вставке: " << sqlite3_errmsg(db) << std::endl;
-            sqlite3_finalize(stmt);
-            return false;
-        }
+public:
+    explicit ScopedLatency(Metric m) : metric(m), outer(current_operation()), begin(std::chrono::steady_clock::now()) {
+        if (is_operation(metric)) current_operation() = metric;
+    }
 
-        sqlite3_finalize(stmt);
-        return true;
+    ~ScopedLatency() {
+        Metrics::record(metric, std::chrono::steady_clock::now() - begin);
+        current_operation() = outer;
     }
-};
 
+    // Metric::Count - вне операции банка
+    static Metric& current_operation() {
+        thread_local Metric operation = Metric::Count;
+        return operation;
+    }
 
+    ScopedLatency(const ScopedLatency&) = delete;
+    ScopedLatency& operator=(const ScopedLatency&) = delete;
+};
 
+inline int timed_step(sqlite3_stmt* stmt) {
+    ScopedLatency timer(Metric::SqliteStep);
+    return sqlite3_step(stmt);
+}
 
+// ---- Терминал ----
+// Очистка экрана и ожидание клавиши без запуска внешних команд (cls/pause).
+// В неинтерактивном режиме (--batch или ввод не с терминала) паузы и очистка пропускаются.
 
-std::string hash_password(const std::string& password) {
-    unsigned char hash[SHA256_DIGEST_LENGTH];
-    SHA256(reinterpret_cast<const unsigned char*>(password.c_str()), password.size(), hash);
+bool& interactive_terminal() {
+    static bool interactive = true;
+    return interactive;
+}
 
-    std::stringstream ss;
-    for (unsigned char c : hash) {
-        ss << std::hex << std::setw(2) << std::setfill('0') << (int)c;
+void init_terminal(bool batch) {
+#ifdef _WIN32
+    bool tty = _isatty(_fileno(stdin)) && _isatty(_fileno(stdout));
+    HANDLE out = GetStdHandle(STD_OUTPUT_HANDLE);
+    DWORD mode = 0;
+    if (GetConsoleMode(out, &mode)) {
+        SetConsoleMode(out, mode | ENABLE_VIRTUAL_TERMINAL_PROCESSING);
     }
-
-    return ss.str();
+#else
+    bool tty = isatty(STDIN_FILENO) && isatty(STDOUT_FILENO);
+#endif
+    interactive_terminal() = tty && !batch;
 }
 
-std::string normalize_name(const std::string& input) {
-    if (input.empty()) return "";
-
-    std::string result = input;
-    std::transform(result.begin(), result.end(), result.begin(), ::tolower);
-    result[0] = std::toupper(result[0]);
+void clear_screen() {
+    if (!interactive_terminal()) return;
+    std::cout << "\x1b[2J\x1b[H" << std::flush;
+}
 
-    return result;
+void pause_screen() {
+    if (!interactive_terminal()) return;
+    std::cout << "Для продолжения нажмите любую клавишу . . ." << std::flush;
+#ifdef _WIN32
+    _getch();
+#else
+    termios saved;
+    tcgetattr(STDIN_FILENO, &saved);
+    termios raw = saved;
+    raw.c_lflag &= ~(ICANON | ECHO);
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    tcsetattr(STDIN_FILENO, TCSANOW, &raw);
+    char key;
+    ssize_t ignored = read(STDIN_FILENO, &key, 1);
+    (void)ignored;
+    tcsetattr(STDIN_FILENO, TCSANOW, &saved);
+#endif
+    std::cout << "\n";
 }
 
-void display_user_transactions(sqlite3* db, int user_id) {
-    sqlite3_stmt* stmt;
-    const char* sql =
-        "SELECT t.type, t.amount, t.timestamp, t.description, u.first_name, u.last_name "
-        "FROM transactions t "
-        "JOIN users u ON t.user_id = u.id "
-        "WHERE t.user_id = ? "
-        "ORDER BY t.timestamp DESC";
+// Кэш подготовленных запросов, привязанный к соединению.
+// Запрос компилируется один раз, дальше переиспользуется через sqlite3_reset.
+class StatementCache {
+private:
+    sqlite3* db;
+    std::unordered_map<std::string, sqlite3_stmt*> statements;
+    unsigned long long hit_count = 0;
+    unsigned long long miss_count = 0;
 
-    if (sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr) != SQLITE_OK) {
-        std::cerr << "Ошибка подготовки запроса: " << sqlite3_errmsg(db) << std::endl;
-        return;
+    static std::mutex& registry_mutex() {
+        static std::mutex m;
+        return m;
     }
 
-    sqlite3_bind_int(stmt, 1, user_id);
-
-    std::cout << "\n--- Ваши транзакции ---\n";
-    bool found = false;
-    while (sqlite3_step(stmt) == SQLITE_ROW) {
-        std::string type = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 0));
-        double amount = sqlite3_column_double(stmt, 1);
-        std::string timestamp = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 2));
-        const char* desc = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 3));
-        const char* first_name = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 4));
-        const char* last_name = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 5));
-
-        std::cout << "Пользователь: " << first_name << " " << last_name
-            << " | Тип: " << type
-            << " | Сумма: " << amount
-            << " | Дата: " << timestamp
-            << " | Описание: " << (desc ? desc : "") << std::endl;
-        found = true;
+    static std::unordered_map<sqlite3*, StatementCache*>& registry() {
+        static std::unordered_map<sqlite3*, StatementCache*> caches;
+        return caches;
     }
 
-    if (!found) {
-        std::cout << "У вас пока нет транзакций.\n";
+public:
+    explicit StatementCache(sqlite3* database) : db(database) {
+        std::lock_guard<std::mutex> lock(registry_mutex());
+        registry()[db] = this;
     }
 
-    sqlite3_finalize(stmt);
-    system("pause");
-}
+    ~StatementCache() {
+        {
+            std::lock_guard<std::mutex> lock(registry_mutex());
+            registry().erase(db);
+        }
+        for (auto& entry : statements) {
+            sqlite3_finalize(entry.second);
+        }
+    }
 
-void show_balance(sqlite3* db, int user_id) {
-    const char* sql = "SELECT cash FROM users WHERE id = ?;";
-    sqlite3_stmt* stmt;
+    StatementCache(const StatementCache&) = delete;
+    StatementCache& operator=(const StatementCache&) = delete;
 
-    if (sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr) == SQLITE_OK) {
-        sqlite3_bind_int(stmt, 1, user_id);
+    static StatementCache* of(sqlite3* database) {
+        std::lock_guard<std::mutex> lock(registry_mutex());
+        auto it = registry().find(database);
+        return it != registry().end() ? it->second : nullptr;
+    }
 
-        if (sqlite3_step(stmt) == SQLITE_ROW) {
-            double balance = sqlite3_column_double(stmt, 0);
-            std::cout << "Ваш баланс: " << balance << " руб." << std::endl;
+    // Возвращает сброшенный запрос или nullptr, если запрос уже выполняется
+    // (вложенное использование) либо не компилируется.
+    sqlite3_stmt* acquire(const char* sql) {
+        auto it = statements.find(sql);
+        if (it != statements.end()) {
+            if (sqlite3_stmt_busy(it->second)) {
+                return nullptr;
+            }
+            ++hit_count;
+            sqlite3_reset(it->second);
+            sqlite3_clear_bindings(it->second);
+            return it->second;
         }
 
-        sqlite3_finalize(stmt);
-    }
-    else {
-        std::cerr << "Ошибка запроса: " << sqlite3_errmsg(db) << std::endl;
+        sqlite3_stmt* stmt = nullptr;
+        if (sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr) != SQLITE_OK) {
+            return nullptr;
+        }
+        ++miss_count;
+        statements.emplace(sql, stmt);
+        return stmt;
     }
 
-    system("pause");
-}
+    unsigned long long hits() const { return hit_count; }
+    unsigned long long misses() const { return miss_count; }
+    size_t size() const { return statements.size(); }
+};
 
-void deposit_balance(sqlite3* db, int user_id) {
-    double amount;
-    std::string amount_str;
+// Запрос из кэша соединения. При выходе из области видимости сбрасывается,
+// чтобы не держать открытую транзакцию чтения. Если кэша нет или запрос
+// уже занят, готовится обычный запрос и финализируется здесь же.
+class CachedStatement {
+private:
+    sqlite3_stmt* stmt = nullptr;
+    bool owned = false;
 
-    while (true) {
-        std::cout << "Введите сумму пополнения: ";
-        std::cin >> amount_str;
+public:
+    CachedStatement(sqlite3* db, const char* sql) {
+        StatementCache* cache = StatementCache::of(db);
+        if (cache != nullptr) {
+            stmt = cache->acquire(sql);
+        }
+        if (stmt == nullptr) {
+            if (sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr) != SQLITE_OK) {
+                sqlite3_finalize(stmt);
+                stmt = nullptr;
+            }
+            owned = true;
+        }
+    }
 
-        try {
-            amount = std::stod(amount_str);
-            if (amount <= 0) throw std::invalid_argument("negative");
-            break;
+    ~CachedStatement() {
+        if (stmt == nullptr) return;
+        if (owned) {
+            sqlite3_finalize(stmt);
         }
-        catch (...) {
-            std::cout << "Некорректное значение. Попробуйте снова.\n";
+        else {
+            sqlite3_reset(stmt);
+            sqlite3_clear_bindings(stmt);
         }
     }
 
-    const char* getBalanceSQL = "SELECT cash FROM users WHERE id = ?;";
-    sqlite3_stmt* getStmt;
-    if (sqlite3_prepare_v2(db, getBalanceSQL, -1, &getStmt, nullptr) == SQLITE_OK) {
-        sqlite3_bind_int(getStmt, 1, user_id);
+    CachedStatement(const CachedStatement&) = delete;
+    CachedStatement& operator=(const CachedStatement&) = delete;
 
-        if (sqlite3_step(getStmt) == SQLITE_ROW) {
-            double current_cash = sqlite3_column_double(getStmt, 0);
-            sqlite3_finalize(getStmt);
+    operator sqlite3_stmt*() const { return stmt; }
+};
 
-            double new_cash = current_cash + amount;
+// Транзакция SQLite. Если commit() не был вызван, откатывается в деструкторе.
+// Внутри уже открытой транзакции работает как точка сохранения (SAVEPOINT).
+class SqlTransaction {
+private:
+    sqlite3* db;
+    bool active = false;
+    bool nested = false;
 
-            const char* updateSQL = "UPDATE users SET cash = ? WHERE id = ?;";
-            sqlite3_stmt* updateStmt;
-            if (sqlite3_prepare_v2(db, updateSQL, -1, &updateStmt, nullptr) == SQLITE_OK) {
-                sqlite3_bind_double(updateStmt, 1, new_cash);
-                sqlite3_bind_int(updateStmt, 2, user_id);
+    bool run(const char* sql) {
+        CachedStatement stmt(db, sql);
+        return stmt && timed_step(stmt) == SQLITE_DONE;
+    }
 
-                if (sqlite3_step(updateStmt) == SQLITE_DONE) {
-                    std::cout << "Баланс успешно пополнен на " << amount << " руб." << std::endl;
-                    TransactionManager trx(db);
-                    trx.add_transaction(user_id, "deposit", amount, "Пополнение через банкомат");
-                }
-                else {
-                    std::cerr << "Ошибка при обновлении баланса: " << sqlite3_errmsg(db) << std::endl;
-                }
-                sqlite3_finalize(updateStmt);
-            }
-        }
-        else {
-            std::cerr << "Ошибка при получении текущего баланса." << std::endl;
-            sqlite3_finalize(getStmt);
+public:
+    explicit SqlTransaction(sqlite3* database, const char* begin_sql = "BEGIN IMMEDIATE;") : db(database) {
+        nested = sqlite3_get_autocommit(db) == 0;
+        active = run(nested ? "SAVEPOINT nested_txn;" : begin_sql);
+        if (!active) {
+            std::cerr << "Ошибка начала транзакции: " << sqlite3_errmsg(db) << std::endl;
         }
     }
-    else {
-        std::cerr << "Ошибка подготовки запроса: " << sqlite3_errmsg(db) << std::endl;
-    }
-
-    system("pause");
-}
 
-void transfer_to_user(sqlite3* db, int user_id) {
-    std::string recipient_first_name, recipient_last_name;
-    double amount;
+    ~SqlTransaction() {
+        rollback();
+    }
 
-    std::cout << "Введите имя получателя: ";
-    std::cin >> recipient_first_name;
-    std::cout << "Введите фамилию получателя: ";
-    std::cin >> recipient_last_name;
+    SqlTransaction(const SqlTransaction&) = delete;
+    SqlTransaction& operator=(const SqlTransaction&) = delete;
 
-    std::string amount_str;
+    bool started() const { return active; }
 
-    while (true) {
-        std::cout << "Введите сумму перевода: ";
-        std::cin >> amount_str;
+    bool commit() {
+        if (!active) return false;
+        ScopedLatency timer(Metric::Commit);
+        if (!run(nested ? "RELEASE nested_txn;" : "COMMIT;")) {
+            std::cerr << "Ошибка фиксации транзакции: " << sqlite3_errmsg(db) << std::endl;
+            return false;
+        }
+        active = false;
+        return true;
+    }
 
-        try {
-            amount = std::stod(amount_str);
-            if (amount <= 0) throw std::invalid_argument("negative");
-            break;
+    void rollback() {
+        if (!active) return;
+        if (nested) {
+            run("ROLLBACK TO nested_txn;");
+            run("RELEASE nested_txn;");
         }
-        catch (...) {
-            std::cout << "Некорректная сумма. Попробуйте снова.\n";
+        else {
+            run("ROLLBACK;");
         }
+        active = false;
     }
+};
 
-    double sender_balance = 0.0;
-    std::string sender_first_name, sender_last_name;
+// Счета делятся между сегментами БД по корзинам: корзина счёта - (id - 1) % SHARD_BUCKETS
+const int SHARD_BUCKETS = 256;
+
+// Параметры соединения, применяемые при открытии БД.
+// Значения по умолчанию рассчитаны на рабочую нагрузку; переопределяются в bankdb.conf.
+struct ConnectionProfile {
+    std::string journal_mode = "WAL";
+    std::string synchronous = "NORMAL";
+    long long cache_size = -65536;      // отрицательное значение - в КиБ (64 МиБ)
+    long long mmap_size = 268435456;    // 256 МиБ
+    std::string temp_store = "MEMORY";
+    int busy_timeout = 5000;            // мс
+
+    // Групповая фиксация записей журнала (LedgerWriter)
+    bool group_commit = false;
+    int group_commit_batch = 256;       // записей в одной транзакции
+    int group_commit_window_ms = 2;     // сколько ждать пополнения пакета
+    int group_commit_queue = 4096;      // ёмкость очереди
+
+    // Файл статистики задержек в серверном режиме
+    std::string stats_file = "bankdb.stats";
+    int stats_interval = 10;            // секунд между записями, 0 - не писать
+
+    // Журнал медленных запросов (sqlite3_trace_v2)
+    int slow_query_ms = -1;             // порог в мс, отрицательное значение - трассировка выключена
+    std::string slow_query_log = "bankdb-slow.log";
+    long long slow_query_log_kb = 1024; // после этого размера журнал ротируется
+
+    // Число файлов БД, по которым распределяются счета (ShardRouter)
+    int shards = 1;
+
+    // Хранилище журнала: таблица transactions или файлы, отображённые в память (MappedLedger)
+    std::string ledger_store = "sqlite";
+};
 
-    sqlite3_stmt* stmt_check_sender;
-    const char* check_sender_sql = "SELECT cash, first_name, last_name FROM users WHERE id = ?;";
-    if (sqlite3_prepare_v2(db, check_sender_sql, -1, &stmt_check_sender, nullptr) == SQLITE_OK) {
-        sqlite3_bind_int(stmt_check_sender, 1, user_id);
-        if (sqlite3_step(stmt_check_sender) == SQLITE_ROW) {
-            sender_balance = sqlite3_column_double(stmt_check_sender, 0);
-            sender_first_name = reinterpret_cast<const char*>(sqlite3_column_text(stmt_check_sender, 1));
-            sender_last_name = reinterpret_cast<const char*>(sqlite3_column_text(stmt_check_sender, 2));
-        }
-        sqlite3_finalize(stmt_check_sender);
+static bool is_one_of(const std::string& value, std::initializer_list<const char*> allowed) {
+    for (const char* item : allowed) {
+        if (value == item) return true;
     }
+    return false;
+}
 
-    if (sender_balance < amount) {
-        std::cout << "Недостаточно средств.\n";
-        system("pause");
-        return;
+// Формат файла: строки "ключ = значение", комментарии начинаются с '#'.
+// Если файла нет, используются значения по умолчанию.
+ConnectionProfile load_connection_profile(const std::string& path) {
+    ConnectionProfile profile;
+    std::ifstream in(path);
+    if (!in) {
+        return profile;
     }
 
-    int recipient_id = -1;
-    double recipient_balance = 0.0;
-    sqlite3_stmt* stmt_recipient;
-    const char* find_recipient_sql = "SELECT id, cash, status FROM users WHERE first_name = ? AND last_name = ?;";
-    if (sqlite3_prepare_v2(db, find_recipient_sql, -1, &stmt_recipient, nullptr) == SQLITE_OK) {
-        sqlite3_bind_text(stmt_recipient, 1, recipient_first_name.c_str(), -1, SQLITE_STATIC);
-        sqlite3_bind_text(stmt_recipient, 2, recipient_last_name.c_str(), -1, SQLITE_STATIC);
-
-        if (sqlite3_step(stmt_recipient) == SQLITE_ROW) {
-            const unsigned char* status_text = sqlite3_column_text(stmt_recipient, 2);
-            if (status_text != nullptr && std::string(reinterpret_cast<const char*>(status_text)) == "deleted") {
-                std::cout << "Нельзя перевести деньги: пользователь помечен как удалённый.\n";
-                sqlite3_finalize(stmt_recipient);
-                system("pause");
-                return;
-            }
+    std::string line;
+    int line_no = 0;
+    while (std::getline(in, line)) {
+        ++line_no;
+        size_t comment = line.find('#');
+        if (comment != std::string::npos) line.erase(comment);
+
+        size_t eq = line.find('=');
+        if (eq == std::string::npos) continue;
+
+        std::string key = line.substr(0, eq);
+        std::string value = line.substr(eq + 1);
+        auto trim = [](std::string& str) {
+            str.erase(0, str.find_first_not_of(" \t\r"));
+            str.erase(str.find_last_not_of(" \t\r") + 1);
+        };
+        trim(key);
+        trim(value);
+        std::transform(key.begin(), key.end(), key.begin(), ::tolower);
+        std::string upper = value;
+        std::transform(upper.begin(), upper.end(), upper.begin(), ::toupper);
 
-            if (status_text != nullptr && std::string(reinterpret_cast<const char*>(status_text)) == "banned") {
-                std::cout << "Нельзя перевести деньги: пользователь помечен как заблокированный.\n";
-                sqlite3_finalize(stmt_recipient);
-                system("pause");
-                return;
+        try {
+            if (key == "journal_mode" && is_one_of(upper, { "WAL", "DELETE", "TRUNCATE", "PERSIST", "MEMORY", "OFF" })) {
+                profile.journal_mode = upper;
             }
-
-            recipient_id = sqlite3_column_int(stmt_recipient, 0);
-            recipient_balance = sqlite3_column_double(stmt_recipient, 1);
+            else if (key == "synchronous" && is_one_of(upper, { "OFF", "NORMAL", "FULL", "EXTRA" })) {
+                profile.synchronous = upper;
+            }
+            else if (key == "cache_size") {
+                profile.cache_size = std::stoll(value);
+            }
+            else if (key == "mmap_size") {
+                profile.mmap_size = std::stoll(value);
+            }
+            else if (key == "temp_store" && is_one_of(upper, { "DEFAULT", "FILE", "MEMORY" })) {
+                profile.temp_store = upper;
+            }
+            else if (key == "busy_timeout") {
+                profile.busy_timeout = std::stoi(value);
+            }
+            else if (key == "group_commit" && is_one_of(upper, { "ON", "OFF", "1", "0" })) {
+                profile.group_commit = (upper == "ON" || upper == "1");
+            }
+            else if (key == "group_commit_batch" && std::stoi(value) > 0) {
+                profile.group_commit_batch = std::stoi(value);
+            }
+            else if (key == "group_commit_window_ms" && std::stoi(value) >= 0) {
+                profile.group_commit_window_ms = std::stoi(value);
+            }
+            else if (key == "group_commit_queue" && std::stoi(value) > 0) {
+                profile.group_commit_queue = std::stoi(value);
+            }
+            else if (key == "stats_file" && !value.empty()) {
+                profile.stats_file = value;
+            }
+            else if (key == "stats_interval" && std::stoi(value) >= 0) {
+                profile.stats_interval = std::stoi(value);
+            }
+            else if (key == "slow_query_ms") {
+                profile.slow_query_ms = std::stoi(value);
+            }
+            else if (key == "slow_query_log" && !value.empty()) {
+                profile.slow_query_log = value;
+            }
+            else if (key == "slow_query_log_kb" && std::stoll(value) > 0) {
+                profile.slow_query_log_kb = std::stoll(value);
+            }
+            else if (key == "shards" && std::stoi(value) >= 1 && std::stoi(value) <= SHARD_BUCKETS) {
+                profile.shards = std::stoi(value);
+            }
+            else if (key == "ledger_store" && is_one_of(upper, { "SQLITE", "MMAP" })) {
+                profile.ledger_store = (upper == "MMAP") ? "mmap" : "sqlite";
+            }
+            else {
+                std::cerr << path << ":" << line_no << ": неизвестный параметр или значение: " << key << std::endl;
+            }
+        }
+        catch (...) {
+            std::cerr << path << ":" << line_no << ": некорректное число для " << key << std::endl;
         }
-        sqlite3_finalize(stmt_recipient);
     }
+    return profile;
+}
 
-    if (recipient_id == -1) {
-        std::cout << "Пользователь не найден.\n";
-        system("pause");
-        return;
+static std::string query_pragma(sqlite3* db, const char* pragma) {
+    std::string sql = std::string("PRAGMA ") + pragma + ";";
+    sqlite3_stmt* stmt = nullptr;
+    std::string result;
+    if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) == SQLITE_OK && timed_step(stmt) == SQLITE_ROW) {
+        const unsigned char* text = sqlite3_column_text(stmt, 0);
+        result = (text != nullptr) ? reinterpret_cast<const char*>(text) : "";
     }
+    sqlite3_finalize(stmt);
+    return result;
+}
 
-    sqlite3_stmt* update_sender;
-    const char* update_sender_sql = "UPDATE users SET cash = ? WHERE id = ?;";
-    if (sqlite3_prepare_v2(db, update_sender_sql, -1, &update_sender, nullptr) == SQLITE_OK) {
-        sqlite3_bind_double(update_sender, 1, sender_balance - amount);
-        sqlite3_bind_int(update_sender, 2, user_id);
-        sqlite3_step(update_sender);
-        sqlite3_finalize(update_sender);
+// Трассировка медленных запросов. Подключается к соединению в apply_connection_profile,
+// если задан slow_query_ms. Счётчик строк обнуляется на SQLITE_TRACE_STMT
+// (первый шаг запроса) и растёт на SQLITE_TRACE_ROW,
+// по SQLITE_TRACE_PROFILE получает его время; запросы дольше порога пишутся
+// в журнал вместе с операцией банка и планом запроса. План берётся через
+// отдельное соединение только для чтения: из обратного вызова трассировки
+// нельзя выполнять запросы на том же соединении.
+class SlowQueryTracer {
+private:
+    sqlite3* db;
+    long long threshold_ns;
+    std::string log_path;
+    long long log_limit;
+    sqlite3* explain_db = nullptr;
+    std::unordered_map<sqlite3_stmt*, long long> rows;
+
+    static const int LOG_GENERATIONS = 3;
+
+    // Журнал общий для всех соединений
+    static std::mutex& log_mutex() {
+        static std::mutex m;
+        return m;
     }
 
-    sqlite3_stmt* update_recipient;
-    const char* update_recipient_sql = "UPDATE users SET cash = ? WHERE id = ?;";
-    if (sqlite3_prepare_v2(db, update_recipient_sql, -1, &update_recipient, nullptr) == SQLITE_OK) {
-        sqlite3_bind_double(update_recipient, 1, recipient_balance + amount);
-        sqlite3_bind_int(update_recipient, 2, recipient_id);
-        sqlite3_step(update_recipient);
-        sqlite3_finalize(update_recipient);
-    }
+    SlowQueryTracer(sqlite3* database, const ConnectionProfile& profile)
+        : db(database), threshold_ns(profile.slow_query_ms * 1000000LL),
+          log_path(profile.slow_query_log), log_limit(profile.slow_query_log_kb * 1024) {}
 
-    std::cout << "Перевод выполнен успешно.\n";
+    ~SlowQueryTracer() {
+        if (explain_db != nullptr) sqlite3_close(explain_db);
+    }
 
-    TransactionManager trx(db);
-    trx.add_transaction(user_id, "transfer_out", amount,
-        "Перевод пользователю " + recipient_first_name + " " + recipient_last_name);
-    trx.add_transaction(recipient_id, "transfer_in", amount,
-        "Получение перевода от " + sender_first_name + " " + sender_last_name);
+    std::string query_plan(const char* sql) {
+        if (explain_db == nullptr) {
+            const char* file = sqlite3_db_filename(db, "main");
+            if (file == nullptr || *file == '\0' ||
+                sqlite3_open_v2(file, &explain_db, SQLITE_OPEN_READONLY, nullptr) != SQLITE_OK) {
+                sqlite3_close(explain_db);
+                explain_db = nullptr;
+                return "  план недоступен\n";
+            }
+        }
 
-    system("pause");
+        std::string plan;
+        sqlite3_stmt* stmt = nullptr;
+        std::string explain = std::string("EXPLAIN QUERY PLAN ") + sql;
+        if (sqlite3_prepare_v2(explain_db, explain.c_str(), -1, &stmt, nullptr) == SQLITE_OK) {
+            while (sqlite3_step(stmt) == SQLITE_ROW) {
+                const unsigned char* detail = sqlite3_column_text(stmt, 3);
+                plan += "  план: " + std::string(detail ? reinterpret_cast<const char*>(detail) : "") + "\n";
+            }
+        }
+        else {
+            plan = "  план недоступен: " + std::string(sqlite3_errmsg(explain_db)) + "\n";
+        }
+        sqlite3_finalize(stmt);
+        return plan;
+    }
+
+    // Текущий файл переименовывается в .1, .1 - в .2 и так далее
+    void rotate() {
+        for (int i = LOG_GENERATIONS - 1; i >= 0; --i) {
+            std::string from = (i == 0) ? log_path : log_path + "." + std::to_string(i);
+            std::string to = log_path + "." + std::to_string(i + 1);
+            std::remove(to.c_str());
+            std::rename(from.c_str(), to.c_str());
+        }
+    }
+
+    void write(const std::string& entry) {
+        std::lock_guard<std::mutex> lock(log_mutex());
+        {
+            std::ifstream existing(log_path, std::ios::binary | std::ios::ate);
+            if (existing && static_cast<long long>(existing.tellg()) + static_cast<long long>(entry.size()) > log_limit) {
+                existing.close();
+                rotate();
+            }
+        }
+        std::ofstream out(log_path, std::ios::app);
+        out << entry;
+        if (!out) {
+            std::cerr << "Невозможно записать журнал медленных запросов: " << log_path << std::endl;
+        }
+    }
+
+    void on_profile(sqlite3_stmt* stmt, long long ns) {
+        long long stepped = 0;
+        auto it = rows.find(stmt);
+        if (it != rows.end()) {
+            stepped = it->second;
+            rows.erase(it);
+        }
+        if (ns < threshold_ns) {
+            return;
+        }
+
+        // Запросы с паролем пишутся без подставленных значений
+        const char* sql = sqlite3_sql(stmt);
+        std::string text = (sql != nullptr) ? sql : "";
+        if (text.find("password") == std::string::npos) {
+            char* expanded = sqlite3_expanded_sql(stmt);
+            if (expanded != nullptr) {
+                text = expanded;
+                sqlite3_free(expanded);
+            }
+        }
+
+        Metric operation = ScopedLatency::current_operation();
+        std::time_t now = std::time(nullptr);
+        char stamp[32];
+        std::strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", std::localtime(&now));
+
+        std::ostringstream entry;
+        entry << std::fixed << std::setprecision(3)
+            << stamp << " | " << ns / 1e6 << " мс | строк: " << stepped
+            << " | операция: " << (operation == Metric::Count ? "-" : METRIC_NAMES[static_cast<int>(operation)]) << "\n"
+            << "  " << text << "\n";
+        if (sql != nullptr && text.compare(0, 7, "EXPLAIN") != 0) {
+            entry << query_plan(sql);
+        }
+        write(entry.str());
+    }
+
+    static int callback(unsigned mask, void* context, void* p, void* x) {
+        SlowQueryTracer* tracer = static_cast<SlowQueryTracer*>(context);
+        if (mask == SQLITE_TRACE_STMT) {
+            tracer->rows[static_cast<sqlite3_stmt*>(p)] = 0;
+        }
+        else if (mask == SQLITE_TRACE_ROW) {
+            ++tracer->rows[static_cast<sqlite3_stmt*>(p)];
+        }
+        else if (mask == SQLITE_TRACE_PROFILE) {
+            tracer->on_profile(static_cast<sqlite3_stmt*>(p), *static_cast<long long*>(x));
+        }
+        else if (mask == SQLITE_TRACE_CLOSE) {
+            delete tracer;
+        }
+        return 0;
+    }
+
+public:
+    // Трассировщик живёт до закрытия соединения (событие SQLITE_TRACE_CLOSE)
+    static void attach(sqlite3* db, const ConnectionProfile& profile) {
+        SlowQueryTracer* tracer = new SlowQueryTracer(db, profile);
+        if (sqlite3_trace_v2(db, SQLITE_TRACE_STMT | SQLITE_TRACE_ROW | SQLITE_TRACE_PROFILE | SQLITE_TRACE_CLOSE,
+            callback, tracer) != SQLITE_OK) {
+            std::cerr << "Ошибка включения трассировки: " << sqlite3_errmsg(db) << std::endl;
+            delete tracer;
+        }
+    }
+};
+
+bool apply_connection_profile(sqlite3* db, const ConnectionProfile& profile, bool report = true) {
+    sqlite3_busy_timeout(db, profile.busy_timeout);
+
+    // Значения проверены при загрузке, поэтому их можно подставлять в текст PRAGMA
+    std::string sql =
+        "PRAGMA journal_mode = " + profile.journal_mode + ";"
+        "PRAGMA synchronous = " + profile.synchronous + ";"
+        "PRAGMA cache_size = " + std::to_string(profile.cache_size) + ";"
+        "PRAGMA mmap_size = " + std::to_string(profile.mmap_size) + ";"
+        "PRAGMA temp_store = " + profile.temp_store + ";";
+
+    char* errMsg = nullptr;
+    if (sqlite3_exec(db, sql.c_str(), nullptr, nullptr, &errMsg) != SQLITE_OK) {
+        std::cerr << "Ошибка настройки соединения: " << errMsg << std::endl;
+        sqlite3_free(errMsg);
+        return false;
+    }
+
+    if (profile.slow_query_ms >= 0) {
+        SlowQueryTracer::attach(db, profile);
+    }
+
+    if (!report) {
+        return true;
+    }
+
+    std::clog << "Параметры БД: journal_mode=" << query_pragma(db, "journal_mode")
+        << " synchronous=" << query_pragma(db, "synchronous")
+        << " cache_size=" << query_pragma(db, "cache_size")
+        << " mmap_size=" << query_pragma(db, "mmap_size")
+        << " temp_store=" << query_pragma(db, "temp_store")
+        << " busy_timeout=" << query_pragma(db, "busy_timeout");
+    if (profile.slow_query_ms >= 0) {
+        std::clog << " slow_query_ms=" << profile.slow_query_ms;
+    }
+    if (profile.ledger_store != "sqlite") {
+        std::clog << " ledger_store=" << profile.ledger_store;
+    }
+    std::clog << std::endl;
+    return true;
+}
+
+// ---- Сегменты БД ----
+// При shards > 1 счета хранятся в нескольких файлах: bankdb.db, bankdb.1.db, ...
+// У каждого файла своя блокировка записи и свой LedgerWriter, поэтому записи
+// в разные сегменты не ждут друг друга. Сегмент счёта задаёт таблица корзин
+// shard_buckets в основном файле (сегмент 0), там же хранится счётчик id новых
+// счетов. Маршрутизатор создаётся поверх соединения с основным файлом и держит
+// свои соединения с остальными сегментами. При одном сегменте его нет,
+// и функции работают с переданным соединением как раньше.
+
+// bankdb.db -> bankdb.1.db
+std::string shard_path(const std::string& base, size_t shard) {
+    if (shard == 0) {
+        return base;
+    }
+    size_t dot = base.rfind('.');
+    if (dot == std::string::npos) {
+        return base + "." + std::to_string(shard);
+    }
+    return base.substr(0, dot) + "." + std::to_string(shard) + base.substr(dot);
+}
+
+// Таблица корзин, общая для всех маршрутизаторов процесса над одним основным
+// файлом: перенос корзины меняет маршрут сразу для всех соединений. Операции
+// со счетами идут под разделяемой блокировкой (ShardLease), переключение
+// маршрута - под исключительной (ShardMap::Pause).
+class ShardMap {
+private:
+    std::atomic<int> owners[SHARD_BUCKETS];
+    std::shared_timed_mutex switch_mutex;
+    std::mutex gate_mutex;
+    std::atomic<bool> pausing{ false };
+    bool loaded = false;
+
+    static std::mutex& registry_mutex() {
+        static std::mutex m;
+        return m;
+    }
+
+    static std::unordered_map<std::string, std::unique_ptr<ShardMap>>& registry() {
+        static std::unordered_map<std::string, std::unique_ptr<ShardMap>> maps;
+        return maps;
+    }
+
+    bool load(sqlite3* db, int shards) {
+        std::vector<int> buckets(SHARD_BUCKETS, -1);
+        CachedStatement stmt(db, "SELECT bucket, shard FROM shard_buckets;");
+        if (!stmt) {
+            std::cerr << "Ошибка подготовки запроса: " << sqlite3_errmsg(db) << std::endl;
+            return false;
+        }
+        int rc;
+        while ((rc = timed_step(stmt)) == SQLITE_ROW) {
+            int bucket = sqlite3_column_int(stmt, 0);
+            int shard = sqlite3_column_int(stmt, 1);
+            if (bucket < 0 || bucket >= SHARD_BUCKETS || shard < 0 || shard >= shards) {
+                std::cerr << "Корзина " << bucket << " указывает на несуществующий сегмент " << shard << std::endl;
+                return false;
+            }
+            buckets[bucket] = shard;
+        }
+        if (rc != SQLITE_DONE || std::count(buckets.begin(), buckets.end(), -1) > 0) {
+            std::cerr << "Таблица корзин неполна: " << sqlite3_errmsg(db) << std::endl;
+            return false;
+        }
+        for (int bucket = 0; bucket < SHARD_BUCKETS; ++bucket) {
+            owners[bucket] = buckets[bucket];
+        }
+        loaded = true;
+        return true;
+    }
+
+public:
+    // Таблица читается из основного файла при первом обращении
+    static ShardMap* of(sqlite3* db, int shards) {
+        const char* file = sqlite3_db_filename(db, "main");
+        std::lock_guard<std::mutex> lock(registry_mutex());
+        std::unique_ptr<ShardMap>& map = registry()[(file != nullptr) ? file : ""];
+        if (!map) {
+            map.reset(new ShardMap());
+        }
+        if (!map->loaded && !map->load(db, shards)) {
+            return nullptr;
+        }
+        return map.get();
+    }
+
+    int owner(int bucket) const { return owners[bucket]; }
+    void assign(int bucket, int shard) { owners[bucket] = shard; }
+
+    // Пока идёт переключение, новые операции ждут у входа: иначе при
+    // непрерывной нагрузке исключительная блокировка может не дождаться очереди
+    std::shared_lock<std::shared_timed_mutex> share() {
+        if (pausing) {
+            std::lock_guard<std::mutex> wait(gate_mutex);
+        }
+        return std::shared_lock<std::shared_timed_mutex>(switch_mutex);
+    }
+
+    // Пауза переключения: дожидается начатых операций и не пускает новые
+    class Pause {
+    private:
+        ShardMap& map;
+        std::unique_lock<std::mutex> gate;
+        std::unique_lock<std::shared_timed_mutex> lock;
+
+    public:
+        explicit Pause(ShardMap& owner) : map(owner), gate(owner.gate_mutex) {
+            map.pausing = true;
+            lock = std::unique_lock<std::shared_timed_mutex>(map.switch_mutex);
+        }
+
+        ~Pause() {
+            lock.unlock();
+            map.pausing = false;
+            gate.unlock();
+        }
+
+        Pause(const Pause&) = delete;
+        Pause& operator=(const Pause&) = delete;
+    };
+};
+
+class ShardRouter {
+private:
+    std::vector<sqlite3*> connections;      // [0] - основной файл, соединение принадлежит вызывающему
+    std::vector<std::unique_ptr<StatementCache>> caches;
+    ShardMap* map = nullptr;                // корзина -> сегмент
+    bool ready = false;
+
+    static std::mutex& registry_mutex() {
+        static std::mutex m;
+        return m;
+    }
+
+    static std::unordered_map<sqlite3*, ShardRouter*>& registry() {
+        static std::unordered_map<sqlite3*, ShardRouter*> routers;
+        return routers;
+    }
+
+public:
+    ShardRouter(sqlite3* db, const std::string& base_path, const ConnectionProfile& profile) {
+        connections.push_back(db);
+        for (int k = 1; k < profile.shards; ++k) {
+            std::string path = shard_path(base_path, k);
+            sqlite3* shard = nullptr;
+            if (sqlite3_open(path.c_str(), &shard) != SQLITE_OK || !apply_connection_profile(shard, profile, false)) {
+                std::cerr << "Невозможно открыть сегмент " << path << ": " << sqlite3_errmsg(shard) << std::endl;
+                sqlite3_close(shard);
+                return;
+            }
+            connections.push_back(shard);
+            caches.emplace_back(new StatementCache(shard));
+        }
+        map = ShardMap::of(db, profile.shards);
+        if (map == nullptr) {
+            return;
+        }
+        ready = true;
+
+        std::lock_guard<std::mutex> lock(registry_mutex());
+        for (sqlite3* connection : connections) {
+            registry()[connection] = this;
+        }
+    }
+
+    ~ShardRouter() {
+        {
+            std::lock_guard<std::mutex> lock(registry_mutex());
+            for (sqlite3* connection : connections) {
+                registry().erase(connection);
+            }
+        }
+        // Кэш запросов финализируется до закрытия своего соединения
+        caches.clear();
+        for (size_t k = 1; k < connections.size(); ++k) {
+            sqlite3_close(connections[k]);
+        }
+    }
+
+    ShardRouter(const ShardRouter&) = delete;
+    ShardRouter& operator=(const ShardRouter&) = delete;
+
+    bool started() const { return ready; }
+    size_t size() const { return connections.size(); }
+    sqlite3* connection(size_t shard) const { return connections[shard]; }
+    const std::vector<sqlite3*>& all() const { return connections; }
+
+    ShardMap& buckets() const { return *map; }
+
+    int shard_of(int user_id) const {
+        return (user_id > 0) ? map->owner((user_id - 1) % SHARD_BUCKETS) : 0;
+    }
+
+    sqlite3* route(int user_id) const { return connections[shard_of(user_id)]; }
+
+    // Во время переноса корзины её строки есть в двух сегментах; считаются
+    // только строки сегмента, за которым корзина сейчас закреплена
+    bool owns(size_t shard, int user_id) const { return shard_of(user_id) == static_cast<int>(shard); }
+
+    int index_of(sqlite3* db) const {
+        auto it = std::find(connections.begin(), connections.end(), db);
+        return (it != connections.end()) ? static_cast<int>(it - connections.begin()) : -1;
+    }
+
+    // Маршрутизатор ищется по любому из его соединений
+    static ShardRouter* of(sqlite3* database) {
+        std::lock_guard<std::mutex> lock(registry_mutex());
+        auto it = registry().find(database);
+        return it != registry().end() ? it->second : nullptr;
+    }
+
+    // id нового счёта из общего счётчика. Счётчик не отстаёт от счетов,
+    // созданных в основном файле, пока сегментов не было.
+    bool allocate_user_id(int& user_id) {
+        sqlite3* db = connections[0];
+        SqlTransaction txn(db);
+        CachedStatement next(db,
+            "SELECT max(next_user_id, (SELECT coalesce(max(id), 0) + 1 FROM users)) FROM shard_sequence;");
+        if (!txn.started() || !next || timed_step(next) != SQLITE_ROW) {
+            std::cerr << "Ошибка чтения счётчика id: " << sqlite3_errmsg(db) << std::endl;
+            return false;
+        }
+        user_id = sqlite3_column_int(next, 0);
+        sqlite3_reset(next);
+
+        CachedStatement bump(db, "UPDATE shard_sequence SET next_user_id = ?;");
+        if (!bump) {
+            std::cerr << "Ошибка подготовки запроса: " << sqlite3_errmsg(db) << std::endl;
+            return false;
+        }
+        sqlite3_bind_int(bump, 1, user_id + 1);
+        return timed_step(bump) == SQLITE_DONE && txn.commit();
+    }
+
+    // Таблица корзин заполняется при первом запуске с shards > 1. Если в основном
+    // файле уже есть счета, все корзины остаются за ним: существующие счета
+    // при этом не переносятся, новые сегменты получают корзины через rebalance_shards.
+    static bool init_directory(sqlite3* db, int shards) {
+        long long existing = 0;
+        int used = 0;
+        {
+            CachedStatement stmt(db, "SELECT count(*), coalesce(max(shard), 0) FROM shard_buckets;");
+            if (!stmt || timed_step(stmt) != SQLITE_ROW) {
+                std::cerr << "Ошибка чтения таблицы корзин: " << sqlite3_errmsg(db) << std::endl;
+                return false;
+            }
+            existing = sqlite3_column_int64(stmt, 0);
+            used = sqlite3_column_int(stmt, 1) + 1;
+        }
+        if (existing > 0) {
+            if (used > shards) {
+                std::cerr << "Счета распределены по " << used << " сегментам, а в bankdb.conf shards = " << shards << std::endl;
+                return false;
+            }
+            return true;
+        }
+        if (shards == 1) {
+            return true;
+        }
+
+        SqlTransaction txn(db);
+        CachedStatement has_users(db, "SELECT EXISTS (SELECT 1 FROM users);");
+        CachedStatement insert(db, "INSERT INTO shard_buckets (bucket, shard) VALUES (?, ?);");
+        if (!txn.started() || !has_users || !insert || timed_step(has_users) != SQLITE_ROW) {
+            std::cerr << "Ошибка заполнения таблицы корзин: " << sqlite3_errmsg(db) << std::endl;
+            return false;
+        }
+        bool keep_in_main = sqlite3_column_int(has_users, 0) != 0;
+        sqlite3_reset(has_users);
+
+        for (int bucket = 0; bucket < SHARD_BUCKETS; ++bucket) {
+            sqlite3_bind_int(insert, 1, bucket);
+            sqlite3_bind_int(insert, 2, keep_in_main ? 0 : bucket % shards);
+            if (timed_step(insert) != SQLITE_DONE) {
+                std::cerr << "Ошибка заполнения таблицы корзин: " << sqlite3_errmsg(db) << std::endl;
+                return false;
+            }
+            sqlite3_reset(insert);
+        }
+        if (sqlite3_exec(db, "INSERT INTO shard_sequence (next_user_id) SELECT coalesce(max(id), 0) + 1 FROM users;",
+            nullptr, nullptr, nullptr) != SQLITE_OK || !txn.commit()) {
+            std::cerr << "Ошибка заполнения таблицы корзин: " << sqlite3_errmsg(db) << std::endl;
+            return false;
+        }
+
+        if (keep_in_main) {
+            std::clog << "Сегменты: существующие счета остаются в основном файле, новые сегменты пока пусты "
+                "(корзины переносятся командой --rebalance)" << std::endl;
+        }
+        else {
+            std::clog << "Сегменты: " << SHARD_BUCKETS << " корзин распределены по " << shards << " файлам" << std::endl;
+        }
+        return true;
+    }
+};
+
+// Соединение с сегментом, где хранится счёт, на время одной операции. Пока
+// оно живо, перенос не переключит корзину, поэтому операция целиком идёт
+// в тот сегмент, который выбрала. Вложенные операции блокировку не повторяют.
+class ShardLease {
+private:
+    std::shared_lock<std::shared_timed_mutex> lock;
+    sqlite3* shard;
+    bool counted = false;
+
+    static int& depth() {
+        static thread_local int value = 0;
+        return value;
+    }
+
+public:
+    explicit ShardLease(sqlite3* db, int user_id = 0) : shard(db) {
+        ShardRouter* router = ShardRouter::of(db);
+        if (router == nullptr) {
+            return;
+        }
+        if (depth() == 0) {
+            lock = router->buckets().share();
+        }
+        ++depth();
+        counted = true;
+        if (user_id > 0) {
+            shard = router->route(user_id);
+        }
+    }
+
+    ~ShardLease() {
+        if (counted) --depth();
+    }
+
+    ShardLease(const ShardLease&) = delete;
+    ShardLease& operator=(const ShardLease&) = delete;
+
+    operator sqlite3*() const { return shard; }
+};
+
+std::vector<sqlite3*> shard_connections(sqlite3* db) {
+    ShardRouter* router = ShardRouter::of(db);
+    return (router != nullptr) ? router->all() : std::vector<sqlite3*>{ db };
+}
+
+struct LedgerRow {
+    long long id;
+    int user_id;
+    std::string type;
+    Money amount;
+    std::string timestamp;
+    std::string description;
+    bool has_balance;       // false - balance_after не заполнен
+    Money balance_after;
+};
+
+// Запись для пакетной вставки в журнал
+struct LedgerEntry {
+    int user_id;
+    std::string type;
+    Money amount;
+    std::string description;
+    bool credit = false;    // перед записью зачислить amount на users.cash
+};
+
+// ---- Бинарный журнал ----
+// При ledger_store = mmap записи журнала хранятся не в таблице transactions,
+// а в файлах bankdb.db-ledger.000000, bankdb.db-ledger.000001, ... по
+// LEDGER_SEGMENT_RECORDS записей фиксированного размера. Файлы отображаются
+// в память, запись с номером id лежит по смещению (id - 1) * 128.
+// Число зафиксированных записей хранит ledger_log, последнюю запись каждого
+// счёта - ledger_heads; обе таблицы меняются в той же транзакции SQLite, что
+// и баланс, поэтому запись видна ровно тогда, когда зафиксирована её транзакция.
+// Всё, что лежит в файле дальше, - остаток откаченной транзакции, его
+// перезапишет следующая. Записи одного счёта связаны ссылкой на предыдущую,
+// каждая LEDGER_INDEX_STRIDE-я из них попадает в ledger_index, чтобы листать
+// историю к новым записям, не проходя её от конца. Записи защищены CRC-32.
+// Поддерживается только один файл БД (shards = 1).
+
+const long long LEDGER_SEGMENT_RECORDS = 524288;    // 64 МиБ на файл
+const size_t LEDGER_MAX_SEGMENTS = 4096;
+const int LEDGER_INDEX_STRIDE = 64;
+const long long LEDGER_VERIFY_TAIL = 4096;          // записей, проверяемых при открытии
+
+// Коды типов записей в бинарном журнале
+enum class LedgerType : unsigned char { Unknown = 0, Deposit = 1, TransferIn = 2, AdminIncrease = 3, TransferOut = 4 };
+
+LedgerType ledger_type_code(const std::string& type) {
+    if (type == "deposit") return LedgerType::Deposit;
+    if (type == "transfer_in") return LedgerType::TransferIn;
+    if (type == "admin_increase") return LedgerType::AdminIncrease;
+    if (type == "transfer_out") return LedgerType::TransferOut;
+    return LedgerType::Unknown;
+}
+
+const char* ledger_type_name(LedgerType type) {
+    switch (type) {
+    case LedgerType::Deposit: return "deposit";
+    case LedgerType::TransferIn: return "transfer_in";
+    case LedgerType::AdminIncrease: return "admin_increase";
+    case LedgerType::TransferOut: return "transfer_out";
+    default: return "unknown";
+    }
+}
+
+// Знак суммы записи в балансе счёта; запись неизвестного типа в баланс не входит
+Money ledger_sign(LedgerType type) {
+    if (type == LedgerType::Unknown) return 0;
+    return (type == LedgerType::TransferOut) ? -1 : 1;
+}
+
+// "YYYY-MM-DD HH:MM:SS" в UTC, как CURRENT_TIMESTAMP в SQLite
+std::string format_utc(long long seconds) {
+    std::time_t at = static_cast<std::time_t>(seconds);
+    std::tm parts = {};
+#ifdef _WIN32
+    gmtime_s(&parts, &at);
+#else
+    gmtime_r(&at, &parts);
+#endif
+    char text[32];
+    std::strftime(text, sizeof(text), "%Y-%m-%d %H:%M:%S", &parts);
+    return text;
+}
+
+// Разбирает "YYYY-MM-DD" или "YYYY-MM-DD HH:MM:SS" в UTC в секунды
+bool parse_utc(const std::string& text, long long& seconds) {
+    int year = 0, month = 0, day = 0, hour = 0, minute = 0, second = 0;
+    char tail;
+    int fields = std::sscanf(text.c_str(), "%4d-%2d-%2d %2d:%2d:%2d%c", &year, &month, &day, &hour, &minute, &second, &tail);
+    if ((fields != 3 || text.size() != 10) && fields != 6) {
+        return false;
+    }
+    if (month < 1 || month > 12 || day < 1 || day > 31 || hour > 23 || minute > 59 || second > 59) {
+        return false;
+    }
+    // Дни от 1970-01-01 по григорианскому календарю, без mktime и часового пояса
+    long long y = year - (month <= 2 ? 1 : 0);
+    long long era = (y >= 0 ? y : y - 399) / 400;
+    long long year_of_era = y - era * 400;
+    long long day_of_year = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+    long long day_of_era = year_of_era * 365 + year_of_era / 4 - year_of_era / 100 + day_of_year;
+    seconds = (era * 146097 + day_of_era - 719468) * 86400LL + hour * 3600 + minute * 60 + second;
+    return true;
+}
+
+// CRC-32 с многочленом 0xEDB88320, как в zlib
+uint32_t crc32(const void* data, size_t size) {
+    static const std::vector<uint32_t> table = [] {
+        std::vector<uint32_t> values(256);
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t c = i;
+            for (int bit = 0; bit < 8; ++bit) {
+                c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : (c >> 1);
+            }
+            values[i] = c;
+        }
+        return values;
+    }();
+
+    const unsigned char* bytes = static_cast<const unsigned char*>(data);
+    uint32_t crc = 0xFFFFFFFFu;
+    for (size_t i = 0; i < size; ++i) {
+        crc = table[(crc ^ bytes[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return crc ^ 0xFFFFFFFFu;
+}
+
+// Запись бинарного журнала. Поля пишутся в порядке байтов машины, поэтому
+// файлы журнала переносятся только между машинами с одинаковым порядком.
+struct LedgerRecord {
+    uint32_t crc;               // CRC-32 остальных байт записи
+    uint32_t user_id;
+    int64_t id;
+    int64_t prev;               // предыдущая запись того же счёта, 0 - нет
+    int64_t amount;
+    int64_t balance_after;
+    int64_t timestamp;          // секунды UTC
+    uint32_t seq;               // номер записи среди записей счёта, с 1
+    uint8_t type;               // LedgerType
+    uint8_t has_balance;
+    uint8_t description_size;
+    char description[73];       // длинное описание обрезается по границе символа UTF-8
+};
+static_assert(sizeof(LedgerRecord) == 128, "запись бинарного журнала должна занимать 128 байт");
+
+class MappedLedger {
+private:
+    struct Segment {
+        std::atomic<char*> base{ nullptr };
+#ifdef _WIN32
+        HANDLE file = INVALID_HANDLE_VALUE;
+        HANDLE mapping = nullptr;
+#else
+        int fd = -1;
+#endif
+    };
+
+    static const long long SEGMENT_BYTES = LEDGER_SEGMENT_RECORDS * static_cast<long long>(sizeof(LedgerRecord));
+
+    std::string path;           // файл БД, по нему журнал находят все соединения
+    bool durable;               // synchronous = FULL/EXTRA: записи сбрасываются на диск до фиксации
+    bool ready = false;
+    std::unique_ptr<Segment[]> segments;
+    std::mutex segment_mutex;
+    std::mutex dirty_mutex;
+    long long dirty_low = 0, dirty_high = 0;    // записи, ещё не сброшенные на диск
+
+    static std::mutex& registry_mutex() {
+        static std::mutex m;
+        return m;
+    }
+
+    static std::unordered_map<std::string, MappedLedger*>& registry() {
+        static std::unordered_map<std::string, MappedLedger*> ledgers;
+        return ledgers;
+    }
+
+    static std::string key_of(sqlite3* database) {
+        const char* file = sqlite3_db_filename(database, "main");
+        return (file != nullptr) ? file : "";
+    }
+
+    static std::string segment_path(const std::string& db_path, size_t index) {
+        std::ostringstream name;
+        name << db_path << "-ledger." << std::setw(6) << std::setfill('0') << index;
+        return name.str();
+    }
+
+    // Файл сегмента сразу получает полный размер; на Linux он разрежённый
+    // и занимает на диске только записанные страницы
+    static bool map_segment(Segment& segment, const std::string& file) {
+#ifdef _WIN32
+        segment.file = CreateFileA(file.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE,
+            nullptr, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (segment.file == INVALID_HANDLE_VALUE) {
+            return false;
+        }
+        segment.mapping = CreateFileMappingA(segment.file, nullptr, PAGE_READWRITE,
+            static_cast<DWORD>(SEGMENT_BYTES >> 32), static_cast<DWORD>(SEGMENT_BYTES & 0xFFFFFFFF), nullptr);
+        if (segment.mapping == nullptr) {
+            return false;
+        }
+        void* base = MapViewOfFile(segment.mapping, FILE_MAP_ALL_ACCESS, 0, 0, static_cast<SIZE_T>(SEGMENT_BYTES));
+        if (base == nullptr) {
+            return false;
+        }
+#else
+        segment.fd = ::open(file.c_str(), O_RDWR | O_CREAT, 0644);
+        struct stat info;
+        if (segment.fd < 0 || fstat(segment.fd, &info) != 0
+            || (info.st_size < SEGMENT_BYTES && ftruncate(segment.fd, SEGMENT_BYTES) != 0)) {
+            return false;
+        }
+        void* base = mmap(nullptr, static_cast<size_t>(SEGMENT_BYTES), PROT_READ | PROT_WRITE, MAP_SHARED, segment.fd, 0);
+        if (base == MAP_FAILED) {
+            return false;
+        }
+#endif
+        segment.base = static_cast<char*>(base);
+        return true;
+    }
+
+    static void unmap_segment(Segment& segment) {
+        char* base = segment.base.exchange(nullptr);
+#ifdef _WIN32
+        if (base != nullptr) UnmapViewOfFile(base);
+        if (segment.mapping != nullptr) CloseHandle(segment.mapping);
+        if (segment.file != INVALID_HANDLE_VALUE) CloseHandle(segment.file);
+        segment.mapping = nullptr;
+        segment.file = INVALID_HANDLE_VALUE;
+#else
+        if (base != nullptr) munmap(base, static_cast<size_t>(SEGMENT_BYTES));
+        if (segment.fd >= 0) ::close(segment.fd);
+        segment.fd = -1;
+#endif
+    }
+
+    // Сегмент отображается при первом обращении и остаётся отображённым до закрытия журнала
+    LedgerRecord* slot(long long id) {
+        size_t index = static_cast<size_t>((id - 1) / LEDGER_SEGMENT_RECORDS);
+        if (id < 1 || index >= LEDGER_MAX_SEGMENTS) {
+            std::cerr << "Номер записи бинарного журнала вне допустимого диапазона: " << id << std::endl;
+            return nullptr;
+        }
+        Segment& segment = segments[index];
+        char* base = segment.base.load();
+        if (base == nullptr) {
+            std::lock_guard<std::mutex> lock(segment_mutex);
+            base = segment.base.load();
+            if (base == nullptr) {
+                std::string file = segment_path(path, index);
+                if (!map_segment(segment, file)) {
+                    std::cerr << "Невозможно отобразить в память файл журнала " << file << std::endl;
+                    unmap_segment(segment);
+                    return nullptr;
+                }
+                base = segment.base.load();
+            }
+        }
+        return reinterpret_cast<LedgerRecord*>(base) + (id - 1) % LEDGER_SEGMENT_RECORDS;
+    }
+
+    static uint32_t checksum(const LedgerRecord& record) {
+        return crc32(reinterpret_cast<const char*>(&record) + sizeof(record.crc), sizeof(record) - sizeof(record.crc));
+    }
+
+    bool store(LedgerRecord& record) {
+        LedgerRecord* target = slot(record.id);
+        if (target == nullptr) {
+            return false;
+        }
+        record.crc = checksum(record);
+        std::memcpy(target, &record, sizeof(record));
+        if (durable) {
+            std::lock_guard<std::mutex> lock(dirty_mutex);
+            dirty_low = (dirty_low == 0) ? record.id : std::min<long long>(dirty_low, record.id);
+            dirty_high = std::max<long long>(dirty_high, record.id);
+        }
+        return true;
+    }
+
+    static void sync_range(Segment& segment, long long offset, long long bytes) {
+        char* base = segment.base.load();
+        if (base == nullptr) return;
+#ifdef _WIN32
+        FlushViewOfFile(base + offset, static_cast<SIZE_T>(bytes));
+        FlushFileBuffers(segment.file);
+#else
+        static const long long page = sysconf(_SC_PAGESIZE);
+        long long start = offset - offset % page;
+        msync(base + start, static_cast<size_t>(offset + bytes - start), MS_SYNC);
+#endif
+    }
+
+    // Вызывается перед фиксацией транзакции на соединении, которое писало в журнал:
+    // записи должны попасть на диск раньше, чем счётчик в ledger_log
+    static int on_commit(void* connection) {
+        MappedLedger* ledger = of(static_cast<sqlite3*>(connection));
+        if (ledger != nullptr) {
+            ledger->flush();
+        }
+        return 0;
+    }
+
+    static bool set_records(sqlite3* db, long long records) {
+        CachedStatement stmt(db, "UPDATE ledger_log SET records = ?;");
+        if (!stmt) return false;
+        sqlite3_bind_int64(stmt, 1, records);
+        return timed_step(stmt) == SQLITE_DONE;
+    }
+
+    static bool set_head(sqlite3* db, const LedgerRecord& record) {
+        CachedStatement head(db, "INSERT OR REPLACE INTO ledger_heads (user_id, head, entries) VALUES (?, ?, ?);");
+        if (!head) return false;
+        sqlite3_bind_int(head, 1, static_cast<int>(record.user_id));
+        sqlite3_bind_int64(head, 2, record.id);
+        sqlite3_bind_int64(head, 3, record.seq);
+        if (timed_step(head) != SQLITE_DONE) return false;
+        return record.seq % LEDGER_INDEX_STRIDE != 0 || add_index(db, record);
+    }
+
+    static bool add_index(sqlite3* db, const LedgerRecord& record) {
+        CachedStatement index(db, "INSERT OR REPLACE INTO ledger_index (user_id, seq, record_id) VALUES (?, ?, ?);");
+        if (!index) return false;
+        sqlite3_bind_int(index, 1, static_cast<int>(record.user_id));
+        sqlite3_bind_int64(index, 2, record.seq);
+        sqlite3_bind_int64(index, 3, record.id);
+        return timed_step(index) == SQLITE_DONE;
+    }
+
+    static bool head_of(sqlite3* db, int user_id, long long& head) {
+        CachedStatement stmt(db, "SELECT head FROM ledger_heads WHERE user_id = ?;");
+        if (!stmt) return false;
+        sqlite3_bind_int(stmt, 1, user_id);
+        int rc = timed_step(stmt);
+        head = (rc == SQLITE_ROW) ? sqlite3_column_int64(stmt, 0) : 0;
+        return rc == SQLITE_ROW || rc == SQLITE_DONE;
+    }
+
+    // Запись из ledger_index с номером seq среди записей счёта; 0 - её ещё нет
+    static bool indexed(sqlite3* db, int user_id, long long seq, long long& record_id) {
+        CachedStatement stmt(db, "SELECT record_id FROM ledger_index WHERE user_id = ? AND seq = ?;");
+        if (!stmt) return false;
+        sqlite3_bind_int(stmt, 1, user_id);
+        sqlite3_bind_int64(stmt, 2, seq);
+        int rc = timed_step(stmt);
+        record_id = (rc == SQLITE_ROW) ? sqlite3_column_int64(stmt, 0) : 0;
+        return rc == SQLITE_ROW || rc == SQLITE_DONE;
+    }
+
+    static void set_description(LedgerRecord& record, const std::string& text) {
+        size_t size = std::min(text.size(), sizeof(record.description));
+        while (size > 0 && size < text.size() && (static_cast<unsigned char>(text[size]) & 0xC0) == 0x80) {
+            --size;
+        }
+        std::memcpy(record.description, text.data(), size);
+        record.description_size = static_cast<uint8_t>(size);
+    }
+
+    static LedgerRow to_row(const LedgerRecord& record) {
+        size_t size = std::min<size_t>(record.description_size, sizeof(record.description));
+        return { record.id, static_cast<int>(record.user_id), ledger_type_name(static_cast<LedgerType>(record.type)),
+            record.amount, format_utc(record.timestamp), std::string(record.description, size),
+            record.has_balance != 0, record.balance_after };
+    }
+
+    // При первом запуске с ledger_store = mmap записи таблицы transactions
+    // переносятся в файлы журнала в порядке id, таблица очищается
+    bool import_table(sqlite3* db, long long& records) {
+        {
+            CachedStatement any(db, "SELECT 1 FROM transactions LIMIT 1;");
+            if (!any || timed_step(any) != SQLITE_ROW) {
+                return true;
+            }
+        }
+
+        auto started = std::chrono::steady_clock::now();
+        SqlTransaction txn(db);
+        CachedStatement rows(db,
+            "SELECT id, user_id, type, amount, CAST(strftime('%s', timestamp) AS INTEGER), description, balance_after "
+            "FROM transactions ORDER BY id;");
+        if (!txn.started() || !rows) {
+            std::cerr << "Ошибка переноса журнала: " << sqlite3_errmsg(db) << std::endl;
+            return false;
+        }
+
+        std::unordered_map<int, LedgerRecord> heads;
+        int rc;
+        while ((rc = timed_step(rows)) == SQLITE_ROW) {
+            const unsigned char* type = sqlite3_column_text(rows, 2);
+            const unsigned char* desc = sqlite3_column_text(rows, 5);
+            LedgerRecord record = {};
+            record.user_id = static_cast<uint32_t>(sqlite3_column_int(rows, 1));
+            record.type = static_cast<uint8_t>(ledger_type_code(type ? reinterpret_cast<const char*>(type) : ""));
+            if (record.type == static_cast<uint8_t>(LedgerType::Unknown)) {
+                std::cerr << "Запись журнала " << sqlite3_column_int64(rows, 0) << " неизвестного типа '"
+                    << (type ? reinterpret_cast<const char*>(type) : "") << "' не переносится в бинарный журнал" << std::endl;
+                return false;
+            }
+
+            LedgerRecord& head = heads[static_cast<int>(record.user_id)];
+            record.id = ++records;
+            record.prev = head.id;
+            record.seq = head.seq + 1;
+            record.amount = sqlite3_column_int64(rows, 3);
+            record.timestamp = sqlite3_column_int64(rows, 4);
+            record.has_balance = sqlite3_column_type(rows, 6) != SQLITE_NULL;
+            record.balance_after = sqlite3_column_int64(rows, 6);
+            set_description(record, desc ? reinterpret_cast<const char*>(desc) : "");
+            if (!store(record) || (record.seq % LEDGER_INDEX_STRIDE == 0 && !add_index(db, record))) {
+                std::cerr << "Ошибка переноса записи журнала " << record.id << ": " << sqlite3_errmsg(db) << std::endl;
+                return false;
+            }
+            head = record;
+            if (records % 1000000 == 0) {
+                std::clog << "Перенесено записей журнала: " << records << std::endl;
+            }
+        }
+        if (rc != SQLITE_DONE) {
+            std::cerr << "Ошибка чтения журнала: " << sqlite3_errmsg(db) << std::endl;
+            return false;
+        }
+
+        for (const auto& item : heads) {
+            if (!set_head(db, item.second)) {
+                std::cerr << "Ошибка записи ledger_heads: " << sqlite3_errmsg(db) << std::endl;
+                return false;
+            }
+        }
+        {
+            std::lock_guard<std::mutex> lock(dirty_mutex);
+            dirty_low = 1;
+            dirty_high = records;
+        }
+        flush();
+        if (!set_records(db, records) || sqlite3_exec(db, "DELETE FROM transactions;", nullptr, nullptr, nullptr) != SQLITE_OK
+            || !txn.commit()) {
+            std::cerr << "Ошибка переноса журнала: " << sqlite3_errmsg(db) << std::endl;
+            return false;
+        }
+        // Место, освобождённое таблицей, возвращается файлу БД
+        sqlite3_exec(db, "VACUUM;", nullptr, nullptr, nullptr);
+        std::clog << "Журнал перенесён в бинарные файлы: " << records << " записей за "
+            << std::fixed << std::setprecision(1)
+            << std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count() << " с" << std::endl;
+        return true;
+    }
+
+    // Запись без сообщения об ошибке: false - её нет или CRC не сходится
+    bool intact(long long id, LedgerRecord& record) {
+        const LedgerRecord* stored = slot(id);
+        if (stored == nullptr) {
+            return false;
+        }
+        std::memcpy(&record, stored, sizeof(record));
+        return record.crc == checksum(record) && record.id == id;
+    }
+
+    // Последние записи проверяются при открытии: при synchronous = NORMAL после
+    // сбоя питания они могли не попасть на диск, хотя счётчик в БД зафиксирован.
+    // Журнал усекается до записи перед первой повреждённой: счётчик записей,
+    // ledger_heads и ledger_index возвращаются к ней. Балансы счетов уже включают
+    // потерянные записи, поэтому такие счета покажет сверка (--reconcile).
+    bool verify_tail(sqlite3* db, long long& records) {
+        LedgerRecord record;
+        long long damaged = 0;
+        for (long long id = std::max(1LL, records - LEDGER_VERIFY_TAIL + 1); id <= records && damaged == 0; ++id) {
+            if (!intact(id, record)) {
+                damaged = id;
+            }
+        }
+        if (damaged == 0) {
+            return true;
+        }
+        long long kept = damaged - 1;
+
+        SqlTransaction txn(db);
+        CachedStatement lost(db, "SELECT user_id FROM ledger_heads WHERE head > ?;");
+        if (!txn.started() || !lost) {
+            std::cerr << "Ошибка восстановления журнала: " << sqlite3_errmsg(db) << std::endl;
+            return false;
+        }
+        sqlite3_bind_int64(lost, 1, kept);
+        std::unordered_map<int, bool> affected;     // счёт -> найдена его последняя целая запись
+        int rc;
+        while ((rc = timed_step(lost)) == SQLITE_ROW) {
+            affected[sqlite3_column_int(lost, 0)] = false;
+        }
+        if (rc != SQLITE_DONE) {
+            std::cerr << "Ошибка восстановления журнала: " << sqlite3_errmsg(db) << std::endl;
+            return false;
+        }
+
+        // Новые последние записи счетов ищутся одним проходом назад от границы:
+        // ссылки prev повреждённых записей ненадёжны
+        size_t found = 0;
+        for (long long id = kept; id >= 1 && found < affected.size(); --id) {
+            if (!intact(id, record)) {
+                std::cerr << "Повреждена запись бинарного журнала " << id << " (" << path
+                    << ") перед концом журнала, восстановление невозможно" << std::endl;
+                return false;
+            }
+            auto it = affected.find(static_cast<int>(record.user_id));
+            if (it == affected.end() || it->second) {
+                continue;
+            }
+            it->second = true;
+            ++found;
+            if (!set_head(db, record)) {
+                std::cerr << "Ошибка записи ledger_heads: " << sqlite3_errmsg(db) << std::endl;
+                return false;
+            }
+        }
+        for (const auto& account : affected) {
+            CachedStatement forget(db, "DELETE FROM ledger_heads WHERE user_id = ?;");
+            if (account.second || !forget) {
+                continue;
+            }
+            sqlite3_bind_int(forget, 1, account.first);
+            timed_step(forget);
+        }
+        CachedStatement index(db, "DELETE FROM ledger_index WHERE record_id > ?;");
+        if (!index) {
+            std::cerr << "Ошибка восстановления журнала: " << sqlite3_errmsg(db) << std::endl;
+            return false;
+        }
+        sqlite3_bind_int64(index, 1, kept);
+        if (timed_step(index) != SQLITE_DONE || !set_records(db, kept) || !txn.commit()) {
+            std::cerr << "Ошибка восстановления журнала: " << sqlite3_errmsg(db) << std::endl;
+            return false;
+        }
+        std::clog << "Внимание: повреждена запись бинарного журнала " << damaged << " (" << path
+            << "-ledger.*), журнал усечён до " << kept << " записей, потеряно " << (records - kept)
+            << ". Записи счетов (" << affected.size() << ") могут не сходиться с балансом, "
+            << "проверьте их сверкой (--reconcile)" << std::endl;
+        records = kept;
+        return true;
+    }
+
+public:
+    MappedLedger(sqlite3* db, const ConnectionProfile& profile)
+        : path(key_of(db)), durable(profile.synchronous == "FULL" || profile.synchronous == "EXTRA"),
+          segments(new Segment[LEDGER_MAX_SEGMENTS]) {
+        long long records = 0;
+        if (path.empty() || !committed(db, records)) {
+            std::cerr << "Невозможно открыть бинарный журнал: " << sqlite3_errmsg(db) << std::endl;
+            return;
+        }
+        if ((records == 0 && !import_table(db, records)) || !verify_tail(db, records)) {
+            std::cerr << "Бинарный журнал " << path << "-ledger.* не открыт" << std::endl;
+            return;
+        }
+        ready = true;
+
+        std::lock_guard<std::mutex> lock(registry_mutex());
+        registry()[path] = this;
+        std::clog << "Бинарный журнал: " << path << "-ledger.*, записей: " << records << std::endl;
+    }
+
+    ~MappedLedger() {
+        if (ready) {
+            std::lock_guard<std::mutex> lock(registry_mutex());
+            registry().erase(path);
+        }
+        flush();
+        for (size_t i = 0; i < LEDGER_MAX_SEGMENTS; ++i) {
+            unmap_segment(segments[i]);
+        }
+    }
+
+    MappedLedger(const MappedLedger&) = delete;
+    MappedLedger& operator=(const MappedLedger&) = delete;
+
+    bool started() const { return ready; }
+
+    static MappedLedger* of(sqlite3* database) {
+        std::lock_guard<std::mutex> lock(registry_mutex());
+        if (registry().empty()) {
+            return nullptr;
+        }
+        auto it = registry().find(key_of(database));
+        return it != registry().end() ? it->second : nullptr;
+    }
+
+    // Число зафиксированных записей в снимке соединения; false, если таблицы ещё нет
+    static bool committed(sqlite3* db, long long& records) {
+        CachedStatement stmt(db, "SELECT records FROM ledger_log;");
+        if (!stmt || timed_step(stmt) != SQLITE_ROW) {
+            return false;
+        }
+        records = sqlite3_column_int64(stmt, 0);
+        return true;
+    }
+
+    static void remove_files(const std::string& db_path) {
+        for (size_t index = 0; std::remove(segment_path(db_path, index).c_str()) == 0; ++index) {
+        }
+    }
+
+    // Записи дописываются в одной транзакции (внутри уже открытой - под точкой
+    // сохранения) вместе с новым числом записей и последними записями счетов.
+    // balance_after берётся из users.cash, как при вставке в таблицу.
+    bool append(sqlite3* db, const LedgerEntry* entries, size_t count, std::string& error) {
+        SqlTransaction txn(db);
+        long long records = 0;
+        if (!txn.started() || !committed(db, records)) {
+            error = sqlite3_errmsg(db);
+            return false;
+        }
+
+        for (size_t i = 0; i < count; ++i) {
+            const LedgerEntry& entry = entries[i];
+            LedgerRecord record = {};
+            record.type = static_cast<uint8_t>(ledger_type_code(entry.type));
+            if (record.type == static_cast<uint8_t>(LedgerType::Unknown) || entry.user_id <= 0) {
+                error = "запись типа '" + entry.type + "' для счёта " + std::to_string(entry.user_id)
+                    + " не поддерживается бинарным журналом";
+                return false;
+            }
+
+            CachedStatement state(db,
+                "SELECT (SELECT cash FROM users WHERE id = ?1), h.head, h.entries "
+                "FROM (SELECT ?1 AS id) AS k LEFT JOIN ledger_heads AS h ON h.user_id = k.id;");
+            if (!state) {
+                error = sqlite3_errmsg(db);
+                return false;
+            }
+            sqlite3_bind_int(state, 1, entry.user_id);
+            if (timed_step(state) != SQLITE_ROW) {
+                error = sqlite3_errmsg(db);
+                return false;
+            }
+
+            record.user_id = static_cast<uint32_t>(entry.user_id);
+            record.id = ++records;
+            record.prev = sqlite3_column_int64(state, 1);
+            record.seq = static_cast<uint32_t>(sqlite3_column_int64(state, 2) + 1);
+            record.amount = entry.amount;
+            record.has_balance = sqlite3_column_type(state, 0) != SQLITE_NULL;
+            record.balance_after = sqlite3_column_int64(state, 0);
+            record.timestamp = static_cast<int64_t>(std::time(nullptr));
+            set_description(record, entry.description);
+            if (!store(record)) {
+                error = "запись в файл журнала не удалась";
+                return false;
+            }
+            if (!set_head(db, record)) {
+                error = sqlite3_errmsg(db);
+                return false;
+            }
+        }
+
+        if (!set_records(db, records)) {
+            error = sqlite3_errmsg(db);
+            return false;
+        }
+        if (durable) {
+            sqlite3_commit_hook(db, on_commit, db);
+        }
+        if (!txn.commit()) {
+            error = sqlite3_errmsg(db);
+            return false;
+        }
+        return true;
+    }
+
+    // Сбрасывает на диск записи, изменённые с прошлого сброса
+    void flush() {
+        long long low, high;
+        {
+            std::lock_guard<std::mutex> lock(dirty_mutex);
+            low = dirty_low;
+            high = dirty_high;
+            dirty_low = dirty_high = 0;
+        }
+        for (long long id = low; id > 0 && id <= high;) {
+            size_t index = static_cast<size_t>((id - 1) / LEDGER_SEGMENT_RECORDS);
+            long long last = std::min(high, static_cast<long long>(index + 1) * LEDGER_SEGMENT_RECORDS);
+            sync_range(segments[index], ((id - 1) % LEDGER_SEGMENT_RECORDS) * static_cast<long long>(sizeof(LedgerRecord)),
+                (last - id + 1) * static_cast<long long>(sizeof(LedgerRecord)));
+            id = last + 1;
+        }
+    }
+
+    // Зафиксированная запись с номером id; false, если она повреждена
+    bool read(long long id, LedgerRecord& record) {
+        if (!intact(id, record)) {
+            std::cerr << "Повреждена запись бинарного журнала " << id << " (" << path << ")" << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    // Страница от новых записей к старым, начиная с записи перед before
+    // (0 - с последней). user_id < 0 - записи всех счетов.
+    bool older(sqlite3* db, int user_id, long long before, int limit, std::vector<LedgerRow>& rows) {
+        LedgerRecord record;
+        long long id = 0;
+        if (user_id < 0) {
+            if (!committed(db, id)) {
+                return false;
+            }
+            if (before > 0) {
+                id = std::min(id, before - 1);
+            }
+            for (; id > 0 && static_cast<int>(rows.size()) < limit; --id) {
+                if (!read(id, record)) return false;
+                rows.push_back(to_row(record));
+            }
+            return true;
+        }
+
+        if (before > 0) {
+            if (!read(before, record)) return false;
+            id = record.prev;
+        }
+        else if (!head_of(db, user_id, id)) {
+            return false;
+        }
+        for (; id > 0 && static_cast<int>(rows.size()) < limit; id = record.prev) {
+            if (!read(id, record)) return false;
+            rows.push_back(to_row(record));
+        }
+        return true;
+    }
+
+    // limit записей сразу после after, тоже от новых к старым. Для счёта
+    // обход начинается с ближайшей отметки ledger_index над нужными записями,
+    // поэтому проходит не больше limit + LEDGER_INDEX_STRIDE записей.
+    bool newer(sqlite3* db, int user_id, long long after, int limit, std::vector<LedgerRow>& rows) {
+        LedgerRecord record;
+        if (user_id < 0) {
+            long long records = 0;
+            if (!committed(db, records)) {
+                return false;
+            }
+            for (long long id = std::min(records, after + limit); id > after; --id) {
+                if (!read(id, record)) return false;
+                rows.push_back(to_row(record));
+            }
+            return true;
+        }
+
+        if (!read(after, record)) {
+            return false;
+        }
+        long long from_seq = record.seq;
+        long long to_seq = from_seq + limit;
+        long long mark = (to_seq + LEDGER_INDEX_STRIDE - 1) / LEDGER_INDEX_STRIDE * LEDGER_INDEX_STRIDE;
+        long long id = 0;
+        if (!indexed(db, user_id, mark, id) || (id == 0 && !head_of(db, user_id, id))) {
+            return false;
+        }
+        for (; id > 0; id = record.prev) {
+            if (!read(id, record)) return false;
+            if (record.seq <= from_seq) break;
+            if (record.seq <= to_seq) rows.push_back(to_row(record));
+        }
+        return true;
+    }
+
+    // Записи счёта от старых к новым. Цепочка prev ведёт от новых к старым,
+    // поэтому она проходится отрезками между соседними отметками ledger_index:
+    // каждая запись читается один раз, в памяти не больше LEDGER_INDEX_STRIDE записей.
+    // visit возвращает false, чтобы прервать обход; тогда false возвращает и обход.
+    bool ascending(sqlite3* db, int user_id, const std::function<bool(const LedgerRecord&)>& visit) {
+        long long head = 0;
+        LedgerRecord record;
+        if (!head_of(db, user_id, head)) {
+            return false;
+        }
+        if (head == 0) {
+            return true;
+        }
+        if (!read(head, record)) {
+            return false;
+        }
+        long long last_seq = record.seq;
+        std::vector<LedgerRecord> window;
+        window.reserve(LEDGER_INDEX_STRIDE);
+        for (long long low = 0; low < last_seq; low += LEDGER_INDEX_STRIDE) {
+            long long high = std::min<long long>(low + LEDGER_INDEX_STRIDE, last_seq);
+            long long id = 0;
+            if (high < last_seq && !indexed(db, user_id, high, id)) {
+                return false;
+            }
+            window.clear();
+            for (id = (id > 0) ? id : head; id > 0; id = record.prev) {
+                if (!read(id, record)) return false;
+                if (record.seq <= low) break;
+                if (record.seq <= high) window.push_back(record);
+            }
+            for (auto it = window.rbegin(); it != window.rend(); ++it) {
+                if (!visit(*it)) return false;
+            }
+        }
+        return true;
+    }
+
+    // Сумма записей счёта по цепочке от последней записи. Повреждённая запись
+    // обрывает цепочку и считается записью неизвестного типа.
+    void summarize(long long head, long long& entries, Money& total, long long& damaged) {
+        LedgerRecord record;
+        for (long long id = head; id > 0; id = record.prev) {
+            if (!read(id, record)) {
+                ++damaged;
+                return;
+            }
+            ++entries;
+            total += ledger_sign(static_cast<LedgerType>(record.type)) * record.amount;
+        }
+    }
+};
+
+// Постраничное чтение журнала от новых записей к старым по ключу (timestamp, id).
+// Между страницами хранится только ключ первой и последней строки, поэтому
+// стоимость страницы не зависит от размера журнала. Журнал всех пользователей
+// при нескольких сегментах собирается из страниц каждого сегмента; id записей
+// в сегментах повторяются, поэтому в ключ добавляется номер сегмента.
+class LedgerCursor {
+public:
+    enum class Direction { First, Older, Newer };
+
+private:
+    sqlite3* database;
+    int user_id;
+    int page_size;
+    std::string first_ts, last_ts;
+    long long first_id = 0, last_id = 0;
+    int first_shard = 0, last_shard = 0;
+
+    struct ShardRow {
+        int shard;
+        LedgerRow row;
+
+        bool operator<(const ShardRow& other) const {
+            return std::tie(row.timestamp, row.id, shard) < std::tie(other.row.timestamp, other.row.id, other.shard);
+        }
+    };
+
+    // router задан для журнала всех пользователей: строки корзины, которая
+    // ещё переносится в сегмент или уже перенесена из него, пропускаются,
+    // и страница сегмента добирается следующими строками
+    bool fetch_shard(sqlite3* db, int shard, const ShardRouter* router, Direction dir, std::string ts, long long id,
+        bool inclusive, std::vector<ShardRow>& rows) {
+        int found = 0;
+        while (true) {
+            std::string sql = page_sql(user_id >= 0, dir, inclusive);
+            CachedStatement stmt(db, sql.c_str());
+            if (!stmt) {
+                std::cerr << "Ошибка подготовки запроса: " << sqlite3_errmsg(db) << std::endl;
+                return false;
+            }
+
+            int idx = 1;
+            if (user_id >= 0) {
+                sqlite3_bind_int(stmt, idx++, user_id);
+            }
+            if (dir != Direction::First) {
+                sqlite3_bind_text(stmt, idx++, ts.c_str(), -1, SQLITE_STATIC);
+                sqlite3_bind_int64(stmt, idx++, id);
+            }
+            sqlite3_bind_int(stmt, idx, page_size);
+
+            int fetched = 0;
+            std::string last_ts;
+            long long last_row = 0;
+            int rc;
+            while ((rc = timed_step(stmt)) == SQLITE_ROW) {
+                const unsigned char* type = sqlite3_column_text(stmt, 2);
+                const unsigned char* date = sqlite3_column_text(stmt, 4);
+                const unsigned char* desc = sqlite3_column_text(stmt, 5);
+                ShardRow item{ shard, {
+                    sqlite3_column_int64(stmt, 0),
+                    sqlite3_column_int(stmt, 1),
+                    type ? reinterpret_cast<const char*>(type) : "",
+                    sqlite3_column_int64(stmt, 3),
+                    date ? reinterpret_cast<const char*>(date) : "",
+                    desc ? reinterpret_cast<const char*>(desc) : "",
+                    sqlite3_column_type(stmt, 6) != SQLITE_NULL,
+                    sqlite3_column_int64(stmt, 6) } };
+                ++fetched;
+                last_ts = item.row.timestamp;
+                last_row = item.row.id;
+                if (router == nullptr || router->owns(shard, item.row.user_id)) {
+                    rows.push_back(std::move(item));
+                    ++found;
+                }
+            }
+            if (rc != SQLITE_DONE) {
+                std::cerr << "Ошибка чтения транзакций: " << sqlite3_errmsg(db) << std::endl;
+                return false;
+            }
+            if (fetched < page_size || found >= page_size) {
+                return true;
+            }
+            ts = last_ts;
+            id = last_row;
+            if (dir == Direction::First) {
+                dir = Direction::Older;
+            }
+            inclusive = false;
+        }
+    }
+
+    // Бинарный журнал листается по номерам записей, журнал счёта - по цепочке записей счёта
+    std::vector<LedgerRow> fetch_log(MappedLedger& log, Direction dir, long long id) {
+        std::vector<LedgerRow> rows;
+        rows.reserve(page_size);
+        bool ok = (dir == Direction::Newer) ? log.newer(database, user_id, id, page_size, rows)
+            : log.older(database, user_id, (dir == Direction::First) ? 0 : id, page_size, rows);
+        if (!ok) {
+            std::cerr << "Ошибка чтения бинарного журнала: " << sqlite3_errmsg(database) << std::endl;
+        }
+        if (!rows.empty()) {
+            first_ts = rows.front().timestamp;
+            first_id = rows.front().id;
+            last_ts = rows.back().timestamp;
+            last_id = rows.back().id;
+        }
+        return rows;
+    }
+
+    std::vector<LedgerRow> fetch(Direction dir, const std::string& ts, long long id, int shard) {
+        ScopedLatency timer(Metric::History);
+        MappedLedger* log = MappedLedger::of(database);
+        if (log != nullptr) {
+            return fetch_log(*log, dir, id);
+        }
+        // Сегмент счёта выбирается заново для каждой страницы: счёт могли перенести
+        ShardLease lease(database, std::max(user_id, 0));
+        std::vector<sqlite3*> shards = (user_id >= 0) ? std::vector<sqlite3*>{ lease } : shard_connections(database);
+        const ShardRouter* router = (user_id >= 0) ? nullptr : ShardRouter::of(database);
+
+        std::vector<ShardRow> merged;
+        merged.reserve(page_size);
+        for (int s = 0; s < static_cast<int>(shards.size()); ++s) {
+            // Строка другого сегмента с тем же (timestamp, id) упорядочена по номеру сегмента
+            bool inclusive = (dir == Direction::Older && s < shard) || (dir == Direction::Newer && s > shard);
+            fetch_shard(shards[s], s, router, dir, ts, id, inclusive, merged);
+        }
+
+        // Более новые строки выбираются по возрастанию ключа, на экран - как остальные страницы
+        std::sort(merged.begin(), merged.end());
+        if (dir != Direction::Newer) {
+            std::reverse(merged.begin(), merged.end());
+        }
+        if (merged.size() > static_cast<size_t>(page_size)) {
+            merged.resize(page_size);
+        }
+        if (dir == Direction::Newer) {
+            std::reverse(merged.begin(), merged.end());
+        }
+
+        std::vector<LedgerRow> rows;
+        rows.reserve(merged.size());
+        for (ShardRow& item : merged) {
+            rows.push_back(std::move(item.row));
+        }
+        if (!rows.empty()) {
+            first_ts = rows.front().timestamp;
+            first_id = rows.front().id;
+            first_shard = merged.front().shard;
+            last_ts = rows.back().timestamp;
+            last_id = rows.back().id;
+            last_shard = merged.back().shard;
+        }
+        return rows;
+    }
+
+public:
+    // user_id < 0 - журнал всех пользователей
+    LedgerCursor(sqlite3* db, int page, int user = -1) : database(db), user_id(user), page_size(page) {}
+
+    static std::string page_sql(bool per_user, Direction dir, bool inclusive = false) {
+        std::string sql = "SELECT id, user_id, type, amount, timestamp, description, balance_after FROM transactions";
+        std::string where = per_user ? "user_id = ?" : "";
+        if (dir != Direction::First) {
+            if (!where.empty()) where += " AND ";
+            where += "(timestamp, id) ";
+            where += (dir == Direction::Older) ? "<" : ">";
+            where += inclusive ? "= (?, ?)" : " (?, ?)";
+        }
+        if (!where.empty()) sql += " WHERE " + where;
+        sql += (dir == Direction::Newer) ? " ORDER BY timestamp ASC, id ASC" : " ORDER BY timestamp DESC, id DESC";
+        sql += " LIMIT ?;";
+        return sql;
+    }
+
+    int size() const { return page_size; }
+    std::vector<LedgerRow> first() { return fetch(Direction::First, "", 0, 0); }
+    std::vector<LedgerRow> next() { return fetch(Direction::Older, last_ts, last_id, last_shard); }
+    std::vector<LedgerRow> previous() { return fetch(Direction::Newer, first_ts, first_id, first_shard); }
+};
+
+struct UserRow {
+    int id;
+    std::string first_name;
+    std::string last_name;
+    std::string password;
+    Money cash;
+    AccountStatus status;
+};
+
+// Постраничное чтение списка пользователей по возрастанию id.
+// id счетов уникальны во всех сегментах, поэтому страницы сегментов
+// просто сливаются по id. Копии счетов в сегменте, за которым их корзина
+// не закреплена (идёт перенос), пропускаются.
+class UserCursor {
+private:
+    sqlite3* database;
+    int page_size;
+    int first_id = 0, last_id = 0;
+
+    std::vector<UserRow> fetch(const char* sql, int key, bool descending) {
+        ShardLease lease(database);
+        ShardRouter* router = ShardRouter::of(database);
+        std::vector<sqlite3*> shards = shard_connections(database);
+        std::vector<UserRow> rows;
+        rows.reserve(page_size);
+        for (size_t k = 0; k < shards.size(); ++k) {
+            sqlite3* db = shards[k];
+            int from = key;
+            int found = 0;
+            int fetched = page_size;
+            while (fetched == page_size && found < page_size) {
+                CachedStatement stmt(db, sql);
+                if (!stmt) {
+                    std::cerr << "Ошибка SELECT-запроса: " << sqlite3_errmsg(db) << std::endl;
+                    return rows;
+                }
+                sqlite3_bind_int(stmt, 1, from);
+                sqlite3_bind_int(stmt, 2, page_size);
+
+                fetched = 0;
+                while (timed_step(stmt) == SQLITE_ROW) {
+                    ++fetched;
+                    from = sqlite3_column_int(stmt, 0);
+                    if (router != nullptr && !router->owns(k, from)) {
+                        continue;
+                    }
+                    rows.push_back({
+                        from,
+                        reinterpret_cast<const char*>(sqlite3_column_text(stmt, 1)),
+                        reinterpret_cast<const char*>(sqlite3_column_text(stmt, 2)),
+                        reinterpret_cast<const char*>(sqlite3_column_text(stmt, 3)),
+                        sqlite3_column_int64(stmt, 4),
+                        column_status(stmt, 5) });
+                    ++found;
+                }
+            }
+        }
+
+        std::sort(rows.begin(), rows.end(), [](const UserRow& a, const UserRow& b) { return a.id < b.id; });
+        if (descending) {
+            std::reverse(rows.begin(), rows.end());
+        }
+        if (rows.size() > static_cast<size_t>(page_size)) {
+            rows.resize(page_size);
+        }
+        if (descending) {
+            std::reverse(rows.begin(), rows.end());
+        }
+        if (!rows.empty()) {
+            first_id = rows.front().id;
+            last_id = rows.back().id;
+        }
+        return rows;
+    }
+
+public:
+    UserCursor(sqlite3* db, int page) : database(db), page_size(page) {}
+
+    int size() const { return page_size; }
+
+    std::vector<UserRow> first() {
+        return fetch("SELECT id, first_name, last_name, password, cash, status FROM users "
+            "WHERE id > ? ORDER BY id LIMIT ?;", 0, false);
+    }
+
+    std::vector<UserRow> next() {
+        return fetch("SELECT id, first_name, last_name, password, cash, status FROM users "
+            "WHERE id > ? ORDER BY id LIMIT ?;", last_id, false);
+    }
+
+    std::vector<UserRow> previous() {
+        return fetch("SELECT id, first_name, last_name, password, cash, status FROM users "
+            "WHERE id < ? ORDER BY id DESC LIMIT ?;", first_id, true);
+    }
+};
+
+// Постраничный просмотр: печатает первую страницу и, если записей больше
+// одной страницы, даёт листать вперёд и назад.
+template <typename Cursor, typename PrintPage>
+bool browse_pages(Cursor& cursor, PrintPage print_page) {
+    auto page = cursor.first();
+    if (page.empty()) {
+        return false;
+    }
+    print_page(page);
+    if (static_cast<int>(page.size()) < cursor.size()) {
+        return true;
+    }
+
+    std::string choice;
+    while (true) {
+        std::cout << "1 - Следующая страница, 2 - Предыдущая страница, 0 - Закончить просмотр >> ";
+        std::cin >> choice;
+
+        if (choice == "0" || !std::cin) {
+            break;
+        }
+        else if (choice == "1" || choice == "2") {
+            auto other = (choice == "1") ? cursor.next() : cursor.previous();
+            if (other.empty()) {
+                std::cout << "Больше записей нет.\n";
+                continue;
+            }
+            page = std::move(other);
+            print_page(page);
+        }
+        else {
+            std::cout << "Неверный выбор, попробуйте снова.\n";
+        }
+    }
+    return true;
+}
+
+struct BatchResult {
+    size_t inserted = 0;
+    bool committed = false;
+    std::vector<std::pair<size_t, std::string>> failures;   // индекс записи и текст ошибки
+};
+
+class TransactionManager {
+private:
+    sqlite3* db;
+    MappedLedger* log;      // не nullptr - журнал в бинарных файлах, а не в таблице
+
+    // 5 параметров на строку, 100 строк укладываются в старый лимит SQLite на 999 параметров
+    static const size_t MULTI_ROW_CHUNK = 100;
+
+    // balance_after берётся из users.cash в момент вставки, поэтому баланс
+    // должен быть изменён раньше в той же транзакции
+    static std::string insert_sql(size_t rows) {
+        std::string sql = "INSERT INTO transactions (user_id, type, amount, description, balance_after) VALUES ";
+        for (size_t i = 0; i < rows; ++i) {
+            sql += (i == 0) ? "" : ", ";
+            sql += "(?, ?, ?, ?, (SELECT cash FROM users WHERE id = ?))";
+        }
+        sql += ";";
+        return sql;
+    }
+
+    bool insert_chunk(const LedgerEntry* entries, size_t rows, std::string& error) {
+        if (log != nullptr) {
+            return log->append(db, entries, rows, error);
+        }
+
+        std::string sql = insert_sql(rows);
+        CachedStatement stmt(db, sql.c_str());
+        if (!stmt) {
+            error = sqlite3_errmsg(db);
+            return false;
+        }
+
+        int idx = 1;
+        for (size_t i = 0; i < rows; ++i) {
+            sqlite3_bind_int(stmt, idx++, entries[i].user_id);
+            sqlite3_bind_text(stmt, idx++, entries[i].type.c_str(), -1, SQLITE_STATIC);
+            sqlite3_bind_int64(stmt, idx++, entries[i].amount);
+            sqlite3_bind_text(stmt, idx++, entries[i].description.c_str(), -1, SQLITE_STATIC);
+            sqlite3_bind_int(stmt, idx++, entries[i].user_id);
+        }
+        if (timed_step(stmt) != SQLITE_DONE) {
+            error = sqlite3_errmsg(db);
+            return false;
+        }
+        return true;
+    }
+
+    // Зачисление и запись журнала вместе, под точкой сохранения: при ошибке
+    // откатывается только эта запись, а не весь пакет
+    bool write_entry(const LedgerEntry& entry, std::string& error) {
+        if (!entry.credit) {
+            return insert_chunk(&entry, 1, error);
+        }
+
+        SqlTransaction row(db);
+        CachedStatement stmt(db, "UPDATE users SET cash = cash + ? WHERE id = ?;");
+        if (!row.started() || !stmt) {
+            error = sqlite3_errmsg(db);
+            return false;
+        }
+        sqlite3_bind_int64(stmt, 1, entry.amount);
+        sqlite3_bind_int(stmt, 2, entry.user_id);
+        if (timed_step(stmt) != SQLITE_DONE) {
+            error = sqlite3_errmsg(db);
+            return false;
+        }
+        if (sqlite3_changes(db) == 0) {
+            error = "счёт " + std::to_string(entry.user_id) + " не найден";
+            return false;
+        }
+        if (!insert_chunk(&entry, 1, error)) {
+            return false;
+        }
+        return row.commit();
+    }
+
+public:
+    explicit TransactionManager(sqlite3* database) : db(database), log(MappedLedger::of(database)) {}
+
+    bool create_table() {
+        const char* sqlCreateTransactionsTable =
+            "CREATE TABLE IF NOT EXISTS transactions ("
+            "id INTEGER PRIMARY KEY AUTOINCREMENT,"
+            "user_id INTEGER NOT NULL,"
+            "type TEXT NOT NULL,"
+            "amount INTEGER NOT NULL,"
+            "timestamp DATETIME DEFAULT CURRENT_TIMESTAMP,"
+            "description TEXT,"
+            "balance_after INTEGER,"
+            "FOREIGN KEY(user_id) REFERENCES users(id));";
+
+        char* errMsg = nullptr;
+        int rc = sqlite3_exec(db, sqlCreateTransactionsTable, nullptr, nullptr, &errMsg);
+        if (rc != SQLITE_OK) {
+            std::cerr << "Ошибка создания таблицы транзакций: " << errMsg << std::endl;
+            sqlite3_free(errMsg);
+            return false;
+        }
+        return true;
+    }
+
+    bool create_indexes() {
+        const char* sqlCreateHistoryIndexes =
+            "CREATE INDEX IF NOT EXISTS idx_transactions_user_time ON transactions(user_id, timestamp, id);"
+            "CREATE INDEX IF NOT EXISTS idx_transactions_time ON transactions(timestamp, id);";
+
+        char* errMsg = nullptr;
+        int rc = sqlite3_exec(db, sqlCreateHistoryIndexes, nullptr, nullptr, &errMsg);
+        if (rc != SQLITE_OK) {
+            std::cerr << "Ошибка создания индекса транзакций: " << errMsg << std::endl;
+            sqlite3_free(errMsg);
+            return false;
+        }
+        return true;
+    }
+
+    // Баланс счёта должен быть уже изменён в текущей транзакции: из него берётся balance_after
+    bool add_transaction(int user_id, const std::string& type, Money amount, const std::string& description = "") {
+        if (log != nullptr) {
+            LedgerEntry entry{ user_id, type, amount, description };
+            std::string error;
+            if (!log->append(db, &entry, 1, error)) {
+                std::cerr << "Ошибка вставки транзакции: " << error << std::endl;
+                return false;
+            }
+            return true;
+        }
+
+        const char* sql = "INSERT INTO transactions (user_id, type, amount, description, balance_after) "
+            "VALUES (?, ?, ?, ?, (SELECT cash FROM users WHERE id = ?));";
+        CachedStatement stmt(db, sql);
+
+        if (!stmt) {
+            std::cerr << "Ошибка подготовки запроса транзакции: " << sqlite3_errmsg(db) << std::endl;
+            return false;
+        }
+
+        sqlite3_bind_int(stmt, 1, user_id);
+        sqlite3_bind_text(stmt, 2, type.c_str(), -1, SQLITE_STATIC);
+        sqlite3_bind_int64(stmt, 3, amount);
+        sqlite3_bind_text(stmt, 4, description.c_str(), -1, SQLITE_STATIC);
+        sqlite3_bind_int(stmt, 5, user_id);
+
+        bool success = true;
+        if (timed_step(stmt) != SQLITE_DONE) {
+            std::cerr << "Ошибка вставки транзакции: " << sqlite3_errmsg(db) << std::endl;
+            success = false;
+        }
+
+        return success;
+    }
+
+    // Пакетная вставка в одной транзакции. В режиме multi_row записи идут
+    // группами через многострочный VALUES; если группа не вставилась, она
+    // повторяется построчно, чтобы найти ошибочные записи. Записи с зачислением
+    // всегда пишутся по одной, чтобы balance_after учитывал предыдущие.
+    BatchResult add_transactions(const LedgerEntry* entries, size_t count, bool multi_row = false) {
+        BatchResult result;
+        SqlTransaction txn(db);
+        if (!txn.started()) {
+            result.failures.emplace_back(0, sqlite3_errmsg(db));
+            return result;
+        }
+
+        size_t pos = 0;
+        while (pos < count) {
+            size_t chunk = 1;
+            while (multi_row && chunk < MULTI_ROW_CHUNK && pos + chunk < count
+                && !entries[pos].credit && !entries[pos + chunk].credit) {
+                ++chunk;
+            }
+            std::string chunk_error;
+            if (chunk > 1 && insert_chunk(entries + pos, chunk, chunk_error)) {
+                result.inserted += chunk;
+            }
+            else {
+                for (size_t i = pos; i < pos + chunk; ++i) {
+                    std::string error;
+                    if (write_entry(entries[i], error)) {
+                        ++result.inserted;
+                    }
+                    else {
+                        result.failures.emplace_back(i, error);
+                    }
+                }
+            }
+            pos += chunk;
+        }
+
+        result.committed = txn.commit();
+        if (!result.committed) {
+            result.inserted = 0;
+        }
+        return result;
+    }
+
+    BatchResult add_transactions(const std::vector<LedgerEntry>& entries, bool multi_row = false) {
+        return add_transactions(entries.data(), entries.size(), multi_row);
+    }
+
+    // Если для этой БД запущен LedgerWriter, запись уходит в групповую фиксацию,
+    // иначе выполняется сразу. Результат становится готов после фиксации записи.
+    std::future<bool> add_transaction_async(const LedgerEntry& entry);
+
+    void get_all_transactions() {
+        LedgerCursor cursor(db, PAGE_SIZE);
+
+        std::cout << "\n=== Все транзакции ===\n";
+
+        bool found = browse_pages(cursor, [](const std::vector<LedgerRow>& page) {
+            for (const LedgerRow& row : page) {
+                std::cout << "ID: " << row.id << ", User ID: " << row.user_id
+                    << ", Тип: " << row.type << ", Сумма: " << format_money(row.amount)
+                    << ", Дата: " << row.timestamp << "\n";
+            }
+            std::cout << std::flush;
+        });
+
+        if (!found) {
+            std::cout << "Транзакций пока нет.\n";
+        }
+    }
+};
+
+// Операция записи, которую писатель выполняет внутри пакета на своём
+// соединении: проверки, изменения балансов и записи журнала одной операции.
+// Операция сама открывает SqlTransaction (внутри пакета - точку сохранения)
+// и возвращает свой код результата.
+using LedgerJob = std::function<int(sqlite3*)>;
+
+// Фоновый писатель журнала с групповой фиксацией. Записи и операции копятся
+// в ограниченной очереди и выполняются пакетами на отдельном соединении: пакет
+// фиксируется одной транзакцией, когда набран group_commit_batch элементов или
+// истекло окно group_commit_window_ms. Вызывающий получает подтверждение
+// только после фиксации своего пакета.
+class LedgerWriter {
+private:
+    struct Pending {
+        LedgerEntry entry;
+        std::promise<bool> done;
+        LedgerJob job;              // если задана - выполняется вместо записи entry
+        int failure = 0;            // код результата операции, если пакет не зафиксирован
+        std::promise<int> job_done;
+    };
+
+    std::string path;
+    ConnectionProfile profile;
+    sqlite3* db = nullptr;
+    std::mutex mutex;
+    std::condition_variable not_empty;
+    std::condition_variable not_full;
+    std::deque<Pending> queue;
+    bool stopping = false;
+    std::thread worker;
+    unsigned long long batch_count = 0;
+    unsigned long long entry_count = 0;
+
+    static std::mutex& registry_mutex() {
+        static std::mutex m;
+        return m;
+    }
+
+    static std::unordered_map<std::string, LedgerWriter*>& registry() {
+        static std::unordered_map<std::string, LedgerWriter*> writers;
+        return writers;
+    }
+
+    // false - писатель останавливается, элемент не принят
+    bool push(Pending& item) {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            not_full.wait(lock, [this] {
+                return stopping || queue.size() < static_cast<size_t>(profile.group_commit_queue);
+            });
+            if (stopping) {
+                return false;
+            }
+            queue.push_back(std::move(item));
+        }
+        not_empty.notify_one();
+        return true;
+    }
+
+    void run() {
+        StatementCache statements(db);
+        TransactionManager tm(db);
+        std::vector<Pending> batch;
+        std::vector<LedgerEntry> entries;
+        const size_t batch_limit = static_cast<size_t>(profile.group_commit_batch);
+
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                not_empty.wait(lock, [this] { return stopping || !queue.empty(); });
+                if (queue.empty()) {
+                    break;
+                }
+
+                auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(profile.group_commit_window_ms);
+                not_empty.wait_until(lock, deadline, [&] { return stopping || queue.size() >= batch_limit; });
+
+                size_t take = std::min(queue.size(), batch_limit);
+                for (size_t i = 0; i < take; ++i) {
+                    batch.push_back(std::move(queue.front()));
+                    queue.pop_front();
+                }
+            }
+            not_full.notify_all();
+
+            // Подряд идущие записи пишутся одной пакетной вставкой, операции - по одной
+            SqlTransaction txn(db);
+            std::vector<bool> ok(batch.size(), txn.started());
+            std::vector<int> codes(batch.size());
+            size_t pos = 0;
+            while (txn.started() && pos < batch.size()) {
+                if (batch[pos].job) {
+                    codes[pos] = batch[pos].job(db);
+                    ++pos;
+                    continue;
+                }
+                entries.clear();
+                size_t end = pos;
+                while (end < batch.size() && !batch[end].job) {
+                    entries.push_back(batch[end++].entry);
+                }
+                BatchResult result = tm.add_transactions(entries, true);
+                if (!result.committed) {
+                    std::fill(ok.begin() + pos, ok.begin() + end, false);
+                }
+                for (const auto& failure : result.failures) {
+                    ok[pos + failure.first] = false;
+                    std::cerr << "Ошибка вставки транзакции: " << failure.second << std::endl;
+                }
+                pos = end;
+            }
+            bool committed = txn.started() && txn.commit();
+            for (size_t i = 0; i < batch.size(); ++i) {
+                if (batch[i].job) {
+                    batch[i].job_done.set_value(committed ? codes[i] : batch[i].failure);
+                }
+                else {
+                    batch[i].done.set_value(committed && ok[i]);
+                }
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                ++batch_count;
+                entry_count += batch.size();
+            }
+            batch.clear();
+        }
+    }
+
+public:
+    LedgerWriter(const std::string& db_path, const ConnectionProfile& conn_profile)
+        : path(db_path), profile(conn_profile) {
+        if (sqlite3_open(path.c_str(), &db) != SQLITE_OK || !apply_connection_profile(db, profile, false)) {
+            std::cerr << "Невозможно открыть БД для записи журнала: " << sqlite3_errmsg(db) << std::endl;
+            sqlite3_close(db);
+            db = nullptr;
+            return;
+        }
+
+        worker = std::thread(&LedgerWriter::run, this);
+
+        std::lock_guard<std::mutex> lock(registry_mutex());
+        registry()[key_of(db)] = this;
+    }
+
+    ~LedgerWriter() {
+        if (db == nullptr) return;
+        {
+            std::lock_guard<std::mutex> lock(registry_mutex());
+            registry().erase(key_of(db));
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        not_empty.notify_all();
+        worker.join();
+        sqlite3_close(db);
+    }
+
+    LedgerWriter(const LedgerWriter&) = delete;
+    LedgerWriter& operator=(const LedgerWriter&) = delete;
+
+    bool started() const { return db != nullptr; }
+
+    // Писатель ищется по файлу БД, поэтому его видят все соединения с этим файлом
+    static std::string key_of(sqlite3* database) {
+        const char* file = sqlite3_db_filename(database, "main");
+        return (file != nullptr) ? file : "";
+    }
+
+    static LedgerWriter* of(sqlite3* database) {
+        std::lock_guard<std::mutex> lock(registry_mutex());
+        auto it = registry().find(key_of(database));
+        return it != registry().end() ? it->second : nullptr;
+    }
+
+    // Блокируется, пока в очереди нет места
+    std::future<bool> enqueue(LedgerEntry entry) {
+        Pending item;
+        item.entry = std::move(entry);
+        std::future<bool> result = item.done.get_future();
+        if (!push(item)) {
+            item.done.set_value(false);
+        }
+        return result;
+    }
+
+    // Операция выполняется в пакете; failure - её результат, если пакет не зафиксирован
+    std::future<int> submit(LedgerJob job, int failure) {
+        Pending item;
+        item.job = std::move(job);
+        item.failure = failure;
+        std::future<int> result = item.job_done.get_future();
+        if (!push(item)) {
+            item.job_done.set_value(failure);
+        }
+        return result;
+    }
+
+    unsigned long long batches() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return batch_count;
+    }
+
+    unsigned long long entries() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return entry_count;
+    }
+};
+
+std::future<bool> TransactionManager::add_transaction_async(const LedgerEntry& entry) {
+    LedgerWriter* writer = LedgerWriter::of(db);
+    if (writer != nullptr) {
+        return writer->enqueue(entry);
+    }
+
+    BatchResult result = add_transactions(&entry, 1);
+    for (const auto& failure : result.failures) {
+        std::cerr << "Ошибка вставки транзакции: " << failure.second << std::endl;
+    }
+    std::promise<bool> done;
+    done.set_value(result.committed && result.failures.empty());
+    return done.get_future();
+}
+
+// Выполняет операцию записи через LedgerWriter файла db, если он запущен,
+// иначе сразу на db. Внутри уже открытой транзакции операция выполняется
+// на db: писатель ждал бы её блокировку записи. failure - результат, если
+// пакет писателя не зафиксирован.
+template <typename Result, typename Job>
+Result commit_grouped(sqlite3* db, Job job, Result failure) {
+    LedgerWriter* writer = LedgerWriter::of(db);
+    if (writer == nullptr || sqlite3_get_autocommit(db) == 0) {
+        return job(db);
+    }
+    return static_cast<Result>(writer->submit([&job](sqlite3* connection) {
+        return static_cast<int>(job(connection));
+    }, static_cast<int>(failure)).get());
+}
+
+class User {
+private:
+    std::string first_name;
+    std::string last_name;
+    std::string password;
+    Money cash;
+    AccountStatus status;
+
+public:
+    User(const std::string& fname, const std::string& lname, const std::string& pwd, Money money, AccountStatus stat = AccountStatus::Active)
+        : first_name(fname), last_name(lname), password(pwd), cash(money), status(stat) {}
+
+    static bool create_table(sqlite3* db) {
+        const char* sqlCreateUsersTable =
+            "CREATE TABLE IF NOT EXISTS users ("
+            "id INTEGER PRIMARY KEY AUTOINCREMENT,"
+            "first_name TEXT NOT NULL,"
+            "last_name TEXT NOT NULL,"
+            "password TEXT NOT NULL,"
+            "cash INTEGER NOT NULL DEFAULT 0,"
+            "status INTEGER NOT NULL DEFAULT 0);";
+
+        char* errMsg = nullptr;
+        int rc = sqlite3_exec(db, sqlCreateUsersTable, nullptr, nullptr, &errMsg);
+        if (rc != SQLITE_OK) {
+            std::cerr << "Ошибка создания таблицы пользователей: " << errMsg << std::endl;
+            sqlite3_free(errMsg);
+            return false;
+        }
+        return true;
+    }
+
+    static bool create_indexes(sqlite3* db) {
+        const char* sqlCreateNameIndex =
+            "CREATE INDEX IF NOT EXISTS idx_users_name ON users(last_name, first_name);";
+
+        char* errMsg = nullptr;
+        int rc = sqlite3_exec(db, sqlCreateNameIndex, nullptr, nullptr, &errMsg);
+        if (rc != SQLITE_OK) {
+            std::cerr << "Ошибка создания индекса пользователей: " << errMsg << std::endl;
+            sqlite3_free(errMsg);
+            return false;
+        }
+        return true;
+    }
+
+    // id <= 0 - id назначает SQLite; при нескольких сегментах id выдаёт ShardRouter
+    bool saveToDB(sqlite3* db, int id = 0) {
+        const char* insertSQL = "INSERT INTO users (first_name, last_name, password, cash, status, id) VALUES (?, ?, ?, ?, ?, ?);";
+        CachedStatement stmt(db, insertSQL);
+
+        if (!stmt) {
+            std::cerr << "Ошибка подготовки запроса: " << sqlite3_errmsg(db) << std::endl;
+            return false;
+        }
+
+        sqlite3_bind_text(stmt, 1, first_name.c_str(), -1, SQLITE_STATIC);
+        sqlite3_bind_text(stmt, 2, last_name.c_str(), -1, SQLITE_STATIC);
+        sqlite3_bind_text(stmt, 3, password.c_str(), -1, SQLITE_STATIC);
+        sqlite3_bind_int64(stmt, 4, cash);
+        sqlite3_bind_int(stmt, 5, static_cast<int>(status));
+        if (id > 0) {
+            sqlite3_bind_int(stmt, 6, id);
+        }
+        else {
+            sqlite3_bind_null(stmt, 6);
+        }
+
+        int rc = timed_step(stmt);
+        if (rc != SQLITE_DONE) {
+            std::cerr << "Ошибка при вставке: " << sqlite3_errmsg(db) << std::endl;
+            return false;
+        }
+
+        return true;
+    }
+};
+
+
+
+
+
+std::string hash_password(const std::string& password) {
+    ScopedLatency timer(Metric::PasswordHash);
+    unsigned char hash[SHA256_DIGEST_LENGTH];
+    SHA256(reinterpret_cast<const unsigned char*>(password.c_str()), password.size(), hash);
+
+    std::stringstream ss;
+    for (unsigned char c : hash) {
+        ss << std::hex << std::setw(2) << std::setfill('0') << (int)c;
+    }
+
+    return ss.str();
+}
+
+std::string normalize_name(const std::string& input) {
+    if (input.empty()) return "";
+
+    std::string result = input;
+    std::transform(result.begin(), result.end(), result.begin(), ::tolower);
+    result[0] = std::toupper(result[0]);
+
+    return result;
+}
+
+// Разбор суммы в рублях ("150", "150.5", "150,05") сразу в копейки, без double:
+// больше двух знаков после запятой и экспоненциальная запись не принимаются.
+bool parse_money(const std::string& text, Money& amount, bool allow_zero) {
+    size_t pos = 0;
+    Money rubles = 0;
+    size_t int_digits = 0;
+    while (pos < text.size() && text[pos] >= '0' && text[pos] <= '9') {
+        rubles = rubles * 10 + (text[pos] - '0');
+        if (rubles > MAX_MONEY / KOPECKS_PER_RUBLE) return false;
+        ++pos;
+        ++int_digits;
+    }
+
+    Money kopecks = 0;
+    size_t frac_digits = 0;
+    if (pos < text.size() && (text[pos] == '.' || text[pos] == ',')) {
+        ++pos;
+        while (pos < text.size() && text[pos] >= '0' && text[pos] <= '9') {
+            if (++frac_digits > 2) return false;
+            kopecks = kopecks * 10 + (text[pos] - '0');
+            ++pos;
+        }
+        if (frac_digits == 1) kopecks *= 10;
+    }
+
+    if (pos != text.size() || int_digits + frac_digits == 0) {
+        return false;
+    }
+    Money total = rubles * KOPECKS_PER_RUBLE + kopecks;
+    if (total >= MAX_MONEY || (total == 0 && !allow_zero)) {
+        return false;
+    }
+    amount = total;
+    return true;
+}
+
+// Разбор целого числа из min..max: строка должна целиком состоять из
+// десятичной записи числа, знак "+" и пробелы не допускаются
+bool parse_int(const std::string& text, int& value, int min, int max) {
+    int parsed = 0;
+    const char* end = text.data() + text.size();
+    std::from_chars_result result = std::from_chars(text.data(), end, parsed);
+    if (text.empty() || result.ec != std::errc() || result.ptr != end || parsed < min || parsed > max) {
+        return false;
+    }
+    value = parsed;
+    return true;
+}
+
+std::string format_money(Money amount) {
+    Money magnitude = amount < 0 ? -amount : amount;
+    Money kopecks = magnitude % KOPECKS_PER_RUBLE;
+    std::string text = (amount < 0 ? "-" : "") + std::to_string(magnitude / KOPECKS_PER_RUBLE) + ".";
+    text += static_cast<char>('0' + kopecks / 10);
+    text += static_cast<char>('0' + kopecks % 10);
+    return text;
+}
+
+static std::string column_type(sqlite3* db, const char* table, const char* column) {
+    std::string sql = std::string("PRAGMA table_info(") + table + ");";
+    sqlite3_stmt* stmt = nullptr;
+    std::string type;
+    if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) != SQLITE_OK) {
+        return type;
+    }
+    while (timed_step(stmt) == SQLITE_ROW) {
+        const unsigned char* name = sqlite3_column_text(stmt, 1);
+        const unsigned char* decl = sqlite3_column_text(stmt, 2);
+        if (name != nullptr && std::string(reinterpret_cast<const char*>(name)) == column) {
+            type = decl ? reinterpret_cast<const char*>(decl) : "";
+            break;
+        }
+    }
+    sqlite3_finalize(stmt);
+    std::transform(type.begin(), type.end(), type.begin(), ::toupper);
+    return type;
+}
+
+// ---- Миграции схемы ----
+// Номер последней применённой миграции хранится в PRAGMA user_version.
+// Базы, созданные до появления миграций, имеют версию 0, поэтому ранние
+// миграции проверяют фактическое состояние схемы и ничего не ломают,
+// если изменение уже было сделано.
+
+// 1: таблицы пользователей и журнала
+static bool migration_create_tables(sqlite3* db) {
+    TransactionManager tm(db);
+    return User::create_table(db) && tm.create_table();
+}
+
+// 2: колонка status в базах, созданных до её появления
+static bool migration_add_status(sqlite3* db) {
+    if (!column_type(db, "users", "status").empty()) {
+        return true;
+    }
+    char* errMsg = nullptr;
+    if (sqlite3_exec(db, "ALTER TABLE users ADD COLUMN status TEXT DEFAULT NULL;", nullptr, nullptr, &errMsg) != SQLITE_OK) {
+        std::cerr << "Ошибка при добавлении столбца status: " << errMsg << std::endl;
+        sqlite3_free(errMsg);
+        return false;
+    }
+    return true;
+}
+
+// 3: индексы поиска по имени и истории операций
+static bool migration_create_indexes(sqlite3* db) {
+    TransactionManager tm(db);
+    return User::create_indexes(db) && tm.create_indexes();
+}
+
+// 4: FLOAT-колонки cash и amount - в целые копейки, текстовый status - в код
+// AccountStatus. SQLite не меняет тип колонки через ALTER, поэтому таблицы
+// пересоздаются с копированием данных, а индексы создаются заново.
+static bool migration_integer_columns(sqlite3* db) {
+    bool cash_float = column_type(db, "users", "cash") != "INTEGER";
+    bool status_text = column_type(db, "users", "status") != "INTEGER";
+    bool ledger_float = column_type(db, "transactions", "amount") != "INTEGER";
+    if (!cash_float && !status_text && !ledger_float) {
+        return true;
+    }
+
+    std::string sql;
+    if (cash_float || status_text) {
+        std::string cash = cash_float ? "CAST(ROUND(COALESCE(cash, 0) * 100) AS INTEGER)" : "cash";
+        std::string status = status_text
+            ? "CASE status WHEN 'deleted' THEN 1 WHEN 'banned' THEN 2 WHEN 'credited' THEN 3 ELSE 0 END"
+            : "status";
+        sql +=
+            "CREATE TABLE users_migrated ("
+            "id INTEGER PRIMARY KEY AUTOINCREMENT,"
+            "first_name TEXT NOT NULL,"
+            "last_name TEXT NOT NULL,"
+            "password TEXT NOT NULL,"
+            "cash INTEGER NOT NULL DEFAULT 0,"
+            "status INTEGER NOT NULL DEFAULT 0);"
+            "INSERT INTO users_migrated (id, first_name, last_name, password, cash, status) "
+            "SELECT id, first_name, last_name, password, " + cash + ", " + status + " FROM users;"
+            "DROP TABLE users;"
+            "ALTER TABLE users_migrated RENAME TO users;";
+    }
+    if (ledger_float) {
+        sql +=
+            "CREATE TABLE transactions_migrated ("
+            "id INTEGER PRIMARY KEY AUTOINCREMENT,"
+            "user_id INTEGER NOT NULL,"
+            "type TEXT NOT NULL,"
+            "amount INTEGER NOT NULL,"
+            "timestamp DATETIME DEFAULT CURRENT_TIMESTAMP,"
+            "description TEXT,"
+            "FOREIGN KEY(user_id) REFERENCES users(id));"
+            "INSERT INTO transactions_migrated (id, user_id, type, amount, timestamp, description) "
+            "SELECT id, user_id, type, CAST(ROUND(amount * 100) AS INTEGER), timestamp, description FROM transactions;"
+            "DROP TABLE transactions;"
+            "ALTER TABLE transactions_migrated RENAME TO transactions;";
+    }
+
+    char* errMsg = nullptr;
+    if (sqlite3_exec(db, sql.c_str(), nullptr, nullptr, &errMsg) != SQLITE_OK) {
+        std::cerr << "Ошибка перевода схемы БД: " << errMsg << std::endl;
+        sqlite3_free(errMsg);
+        return false;
+    }
+    return migration_create_indexes(db);
+}
+
+// 5: остаток счёта после каждой записи журнала. Для уже существующих записей
+// он восстанавливается от текущего баланса назад по истории счёта.
+static bool migration_balance_after(sqlite3* db) {
+    const char* sql =
+        "UPDATE transactions SET balance_after = r.balance FROM ("
+        " SELECT t.id, u.cash - coalesce(sum(CASE t.type WHEN 'transfer_out' THEN -t.amount"
+        "  WHEN 'deposit' THEN t.amount WHEN 'transfer_in' THEN t.amount WHEN 'admin_increase' THEN t.amount END)"
+        "  OVER (PARTITION BY t.user_id ORDER BY t.timestamp DESC, t.id DESC"
+        "  ROWS BETWEEN UNBOUNDED PRECEDING AND 1 PRECEDING), 0) AS balance"
+        " FROM transactions t JOIN users u ON u.id = t.user_id) AS r"
+        " WHERE r.id = transactions.id AND transactions.balance_after IS NULL;";
+
+    char* errMsg = nullptr;
+    if (column_type(db, "transactions", "balance_after").empty()
+        && sqlite3_exec(db, "ALTER TABLE transactions ADD COLUMN balance_after INTEGER;", nullptr, nullptr, &errMsg) != SQLITE_OK) {
+        std::cerr << "Ошибка при добавлении столбца balance_after: " << errMsg << std::endl;
+        sqlite3_free(errMsg);
+        return false;
+    }
+    if (sqlite3_exec(db, sql, nullptr, nullptr, &errMsg) != SQLITE_OK) {
+        std::cerr << "Ошибка заполнения balance_after: " << errMsg << std::endl;
+        sqlite3_free(errMsg);
+        return false;
+    }
+    return true;
+}
+
+// 6: таблицы сегментов. Корзины и счётчик id используются только в основном
+// файле, очереди межсегментных переводов - в каждом сегменте.
+static bool migration_shard_tables(sqlite3* db) {
+    const char* sql =
+        "CREATE TABLE IF NOT EXISTS shard_buckets (bucket INTEGER PRIMARY KEY, shard INTEGER NOT NULL);"
+        "CREATE TABLE IF NOT EXISTS shard_sequence (next_user_id INTEGER NOT NULL);"
+        "CREATE TABLE IF NOT EXISTS transfer_outbox ("
+        "id INTEGER PRIMARY KEY AUTOINCREMENT,"
+        "recipient_id INTEGER NOT NULL,"
+        "amount INTEGER NOT NULL,"
+        "description TEXT);"
+        "CREATE TABLE IF NOT EXISTS transfer_inbox ("
+        "source_shard INTEGER NOT NULL,"
+        "transfer_id INTEGER NOT NULL,"
+        "PRIMARY KEY (source_shard, transfer_id)) WITHOUT ROWID;";
+
+    char* errMsg = nullptr;
+    if (sqlite3_exec(db, sql, nullptr, nullptr, &errMsg) != SQLITE_OK) {
+        std::cerr << "Ошибка создания таблиц сегментов: " << errMsg << std::endl;
+        sqlite3_free(errMsg);
+        return false;
+    }
+    return true;
+}
+
+// 7: незавершённые переносы корзин; используется только в основном файле
+static bool migration_shard_moves(sqlite3* db) {
+    const char* sql =
+        "CREATE TABLE IF NOT EXISTS shard_moves ("
+        "bucket INTEGER PRIMARY KEY,"
+        "from_shard INTEGER NOT NULL,"
+        "to_shard INTEGER NOT NULL,"
+        "switched INTEGER NOT NULL DEFAULT 0);";
+
+    char* errMsg = nullptr;
+    if (sqlite3_exec(db, sql, nullptr, nullptr, &errMsg) != SQLITE_OK) {
+        std::cerr << "Ошибка создания таблицы переносов: " << errMsg << std::endl;
+        sqlite3_free(errMsg);
+        return false;
+    }
+    return true;
+}
+
+// 8: состояние бинарного журнала (MappedLedger): число зафиксированных записей,
+// последняя запись каждого счёта и каждая LEDGER_INDEX_STRIDE-я запись счёта
+static bool migration_ledger_log(sqlite3* db) {
+    const char* sql =
+        "CREATE TABLE IF NOT EXISTS ledger_log (records INTEGER NOT NULL);"
+        "INSERT INTO ledger_log (records) SELECT 0 WHERE NOT EXISTS (SELECT 1 FROM ledger_log);"
+        "CREATE TABLE IF NOT EXISTS ledger_heads ("
+        "user_id INTEGER PRIMARY KEY,"
+        "head INTEGER NOT NULL,"
+        "entries INTEGER NOT NULL);"
+        "CREATE TABLE IF NOT EXISTS ledger_index ("
+        "user_id INTEGER NOT NULL,"
+        "seq INTEGER NOT NULL,"
+        "record_id INTEGER NOT NULL,"
+        "PRIMARY KEY (user_id, seq)) WITHOUT ROWID;";
+
+    char* errMsg = nullptr;
+    if (sqlite3_exec(db, sql, nullptr, nullptr, &errMsg) != SQLITE_OK) {
+        std::cerr << "Ошибка создания таблиц бинарного журнала: " << errMsg << std::endl;
+        sqlite3_free(errMsg);
+        return false;
+    }
+    return true;
+}
+
+struct Migration {
+    int version;
+    const char* description;
+    bool (*apply)(sqlite3* db);
+};
+
+// Новые миграции добавляются только в конец, номера не переиспользуются
+const Migration MIGRATIONS[] = {
+    { 1, "таблицы users и transactions", migration_create_tables },
+    { 2, "колонка users.status", migration_add_status },
+    { 3, "индексы idx_users_name и idx_transactions_*", migration_create_indexes },
+    { 4, "суммы в копейках и коды статусов", migration_integer_columns },
+    { 5, "остаток после операции в журнале", migration_balance_after },
+    { 6, "таблицы сегментов и межсегментных переводов", migration_shard_tables },
+    { 7, "таблица переносов корзин", migration_shard_moves },
+    { 8, "таблицы бинарного журнала", migration_ledger_log },
+};
+
+static int schema_version(sqlite3* db) {
+    sqlite3_stmt* stmt = nullptr;
+    int version = -1;
+    if (sqlite3_prepare_v2(db, "PRAGMA user_version;", -1, &stmt, nullptr) == SQLITE_OK && timed_step(stmt) == SQLITE_ROW) {
+        version = sqlite3_column_int(stmt, 0);
+    }
+    sqlite3_finalize(stmt);
+    return version;
+}
+
+// Применяет недостающие миграции, каждую в своей транзакции вместе с новым
+// user_version. Если схема актуальна, всё сводится к чтению user_version.
+bool migrate_schema(sqlite3* db) {
+    const Migration& latest = MIGRATIONS[sizeof(MIGRATIONS) / sizeof(MIGRATIONS[0]) - 1];
+    int version = schema_version(db);
+    if (version == latest.version) {
+        return true;
+    }
+    if (version < 0 || version > latest.version) {
+        std::cerr << "Неизвестная версия схемы БД: " << version
+            << " (программа поддерживает до " << latest.version << ")" << std::endl;
+        return false;
+    }
+
+    for (const Migration& migration : MIGRATIONS) {
+        SqlTransaction txn(db);
+        if (!txn.started()) {
+            return false;
+        }
+        // Перечитывается под блокировкой записи: другой процесс мог успеть обновить схему
+        version = schema_version(db);
+        if (migration.version <= version) {
+            continue;
+        }
+
+        std::string bump = "PRAGMA user_version = " + std::to_string(migration.version) + ";";
+        if (!migration.apply(db) || sqlite3_exec(db, bump.c_str(), nullptr, nullptr, nullptr) != SQLITE_OK || !txn.commit()) {
+            std::cerr << "Ошибка миграции схемы " << migration.version << " (" << migration.description << "): "
+                << sqlite3_errmsg(db) << std::endl;
+            return false;
+        }
+        std::clog << "Миграция схемы " << migration.version << ": " << migration.description << std::endl;
+    }
+    return true;
+}
+
+// Проверяет, что частые запросы не вырождаются в полный просмотр таблицы
+// и не строят временное дерево для сортировки
+bool verify_lookup_plans(sqlite3* db) {
+    std::vector<std::string> lookups = { LOGIN_SQL, FIND_RECIPIENT_SQL };
+    for (bool per_user : { true, false }) {
+        for (auto dir : { LedgerCursor::Direction::First, LedgerCursor::Direction::Older, LedgerCursor::Direction::Newer }) {
+            lookups.push_back(LedgerCursor::page_sql(per_user, dir));
+        }
+    }
+
+    for (const std::string& sql : lookups) {
+        std::string explain = "EXPLAIN QUERY PLAN " + sql;
+        sqlite3_stmt* stmt = nullptr;
+        if (sqlite3_prepare_v2(db, explain.c_str(), -1, &stmt, nullptr) != SQLITE_OK) {
+            std::cerr << "Ошибка подготовки EXPLAIN: " << sqlite3_errmsg(db) << std::endl;
+            sqlite3_finalize(stmt);
+            return false;
+        }
+
+        bool regressed = false;
+        std::string plan;
+        while (timed_step(stmt) == SQLITE_ROW) {
+            const unsigned char* detail = sqlite3_column_text(stmt, 3);
+            std::string line = (detail != nullptr) ? reinterpret_cast<const char*>(detail) : "";
+            // Обход индекса в его порядке (SCAN ... USING INDEX) допустим: он нужен для первой страницы журнала
+            bool table_scan = line.compare(0, 4, "SCAN") == 0 && line.find("USING") == std::string::npos;
+            if (table_scan || line.find("TEMP B-TREE") != std::string::npos) {
+                regressed = true;
+            }
+            plan += "  " + line + "\n";
+        }
+        sqlite3_finalize(stmt);
+
+        if (regressed) {
+            std::cerr << "Запрос выполняется без индекса:\n  " << sql << "\n" << plan;
+            return false;
+        }
+    }
+    return true;
+}
+
+// Кэш счетов id -> {баланс, статус, имя} общий для всех соединений с одним файлом БД.
+// Записи подгружаются при первом чтении, изменения баланса и статуса вносятся
+// в кэш после фиксации транзакции (AccountWrite). Счётчик поколений не даёт
+// чтению, начатому до записи, положить в кэш устаревшее значение. Пока баланс
+// счёта меняет незавершённая запись, прочитанный из БД баланс в кэш не
+// кладётся: он может уже включать изменение, которое запись прибавит сама.
+// Отдельно хранится битовая карта счетов с ненулевым статусом: для обычного
+// счёта проверка права на операцию сводится к проверке одного бита.
+// Изменения, сделанные другим процессом, кэш не видит.
+class AccountCache {
+public:
+    struct Account {
+        Money cash;
+        AccountStatus status;
+        std::string first_name;
+        std::string last_name;
+    };
+
+private:
+    std::shared_timed_mutex mutex;
+    std::unordered_map<int, Account> accounts;
+    std::unordered_map<int, int> writers;   // счёт -> число записей, меняющих его баланс
+    std::vector<bool> restricted_ids;
+    bool restrictions_loaded = false;
+    unsigned long long generation = 0;
+    std::atomic<unsigned long long> hit_count{ 0 };
+    std::atomic<unsigned long long> miss_count{ 0 };
+
+    static std::mutex& registry_mutex() {
+        static std::mutex m;
+        return m;
+    }
+
+    static std::unordered_map<std::string, std::unique_ptr<AccountCache>>& registry() {
+        static std::unordered_map<std::string, std::unique_ptr<AccountCache>> caches;
+        return caches;
+    }
+
+    bool lookup(int user_id, Account& account) {
+        std::shared_lock<std::shared_timed_mutex> lock(mutex);
+        auto it = accounts.find(user_id);
+        if (it == accounts.end()) {
+            return false;
+        }
+        account = it->second;
+        return true;
+    }
+
+    unsigned long long current_generation() {
+        std::shared_lock<std::shared_timed_mutex> lock(mutex);
+        return generation;
+    }
+
+    void store(int user_id, const Account& account, unsigned long long loaded_at) {
+        std::unique_lock<std::shared_timed_mutex> lock(mutex);
+        if (generation == loaded_at && writers.find(user_id) == writers.end()) {
+            accounts[user_id] = account;
+        }
+    }
+
+public:
+    static AccountCache& of(sqlite3* database) {
+        const char* file = sqlite3_db_filename(database, "main");
+        std::lock_guard<std::mutex> lock(registry_mutex());
+        std::unique_ptr<AccountCache>& cache = registry()[(file != nullptr) ? file : ""];
+        if (!cache) {
+            cache.reset(new AccountCache());
+        }
+        return *cache;
+    }
+
+    // Счёт из кэша, при промахе - из БД
+    bool get(sqlite3* db, int user_id, Account& account) {
+        if (lookup(user_id, account)) {
+            ++hit_count;
+            return true;
+        }
+        ++miss_count;
+
+        unsigned long long loaded_at = current_generation();
+        CachedStatement stmt(db, "SELECT cash, status, first_name, last_name FROM users WHERE id = ?;");
+        if (!stmt) {
+            std::cerr << "Ошибка подготовки запроса: " << sqlite3_errmsg(db) << std::endl;
+            return false;
+        }
+        sqlite3_bind_int(stmt, 1, user_id);
+        if (timed_step(stmt) != SQLITE_ROW) {
+            return false;
+        }
+        account.cash = sqlite3_column_int64(stmt, 0);
+        account.status = column_status(stmt, 1);
+        account.first_name = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 2));
+        account.last_name = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 3));
+        store(user_id, account, loaded_at);
+        return true;
+    }
+
+    // Заполняет битовую карту статусов; вызывается при запуске после миграций
+    bool load_restrictions(sqlite3* db) {
+        std::vector<bool> bits;
+        CachedStatement stmt(db, "SELECT id FROM users WHERE status <> 0;");
+        if (!stmt) {
+            std::cerr << "Ошибка подготовки запроса: " << sqlite3_errmsg(db) << std::endl;
+            return false;
+        }
+        int rc;
+        while ((rc = timed_step(stmt)) == SQLITE_ROW) {
+            size_t id = static_cast<size_t>(sqlite3_column_int(stmt, 0));
+            if (id >= bits.size()) bits.resize(id + 1);
+            bits[id] = true;
+        }
+        if (rc != SQLITE_DONE) {
+            std::cerr << "Ошибка чтения статусов: " << sqlite3_errmsg(db) << std::endl;
+            return false;
+        }
+
+        std::unique_lock<std::shared_timed_mutex> lock(mutex);
+        restricted_ids.swap(bits);
+        restrictions_loaded = true;
+        return true;
+    }
+
+    // false - у счёта нет статуса; true - статус есть или карта не загружена
+    bool may_be_restricted(int user_id) {
+        std::shared_lock<std::shared_timed_mutex> lock(mutex);
+        if (!restrictions_loaded) return true;
+        size_t id = static_cast<size_t>(user_id);
+        return id < restricted_ids.size() && restricted_ids[id];
+    }
+
+    void begin_write() {
+        std::unique_lock<std::shared_timed_mutex> lock(mutex);
+        ++generation;
+    }
+
+    // Баланс счёта будет изменён; вызывается до фиксации транзакции
+    void begin_cash_change(int user_id) {
+        std::unique_lock<std::shared_timed_mutex> lock(mutex);
+        ++writers[user_id];
+    }
+
+    // После фиксации применяет изменения, после отката - выбрасывает затронутые счета
+    void finish_write(const std::vector<std::pair<int, Money>>& cash_changes,
+        const std::vector<std::pair<int, AccountStatus>>& status_changes, bool committed) {
+        std::unique_lock<std::shared_timed_mutex> lock(mutex);
+        ++generation;
+        for (const auto& change : cash_changes) {
+            auto writer = writers.find(change.first);
+            if (writer != writers.end() && --writer->second == 0) {
+                writers.erase(writer);
+            }
+            auto it = accounts.find(change.first);
+            if (it == accounts.end()) continue;
+            if (committed) it->second.cash += change.second;
+            else accounts.erase(it);
+        }
+        for (const auto& change : status_changes) {
+            if (committed && change.first >= 0) {
+                size_t id = static_cast<size_t>(change.first);
+                if (id >= restricted_ids.size()) restricted_ids.resize(id + 1);
+                restricted_ids[id] = change.second != AccountStatus::Active;
+            }
+            auto it = accounts.find(change.first);
+            if (it == accounts.end()) continue;
+            if (committed) it->second.status = change.second;
+            else accounts.erase(it);
+        }
+    }
+
+    // Корзина перенесена в этот файл или из него: записи её счетов устарели,
+    // а биты статусов заменяются на restricted - счета корзины со статусом
+    void replace_bucket(int bucket, const std::vector<int>& restricted) {
+        std::unique_lock<std::shared_timed_mutex> lock(mutex);
+        ++generation;
+        for (auto it = accounts.begin(); it != accounts.end();) {
+            if ((it->first - 1) % SHARD_BUCKETS == bucket) it = accounts.erase(it);
+            else ++it;
+        }
+        for (size_t id = static_cast<size_t>(bucket) + 1; id < restricted_ids.size(); id += SHARD_BUCKETS) {
+            restricted_ids[id] = false;
+        }
+        for (int user_id : restricted) {
+            size_t id = static_cast<size_t>(user_id);
+            if (id >= restricted_ids.size()) restricted_ids.resize(id + 1);
+            restricted_ids[id] = true;
+        }
+    }
+
+    unsigned long long hits() const { return hit_count; }
+    unsigned long long misses() const { return miss_count; }
+
+    size_t size() {
+        std::shared_lock<std::shared_timed_mutex> lock(mutex);
+        return accounts.size();
+    }
+};
+
+// Изменение счетов, которое попадёт в AccountCache только после фиксации.
+// Создаётся до первого UPDATE, cash() вызывается до фиксации транзакции;
+// без вызова commit() затронутые счета удаляются из кэша.
+class AccountWrite {
+private:
+    AccountCache& cache;
+    std::vector<std::pair<int, Money>> cash_changes;
+    std::vector<std::pair<int, AccountStatus>> status_changes;
+    bool committed = false;
+
+public:
+    explicit AccountWrite(sqlite3* db) : cache(AccountCache::of(db)) {
+        cache.begin_write();
+    }
+
+    ~AccountWrite() {
+        cache.finish_write(cash_changes, status_changes, committed);
+    }
+
+    AccountWrite(const AccountWrite&) = delete;
+    AccountWrite& operator=(const AccountWrite&) = delete;
+
+    void cash(int user_id, Money delta) {
+        cache.begin_cash_change(user_id);
+        cash_changes.emplace_back(user_id, delta);
+    }
+    void status(int user_id, AccountStatus value) { status_changes.emplace_back(user_id, value); }
+    void commit() { committed = true; }
+};
+
+// Вошедший пользователь: id, имя, статус и последний известный баланс.
+// Обновляется из AccountCache после каждой записи, поэтому операции меню
+// не перечитывают users.
+struct Session {
+    int user_id = -1;
+    std::string first_name;
+    std::string last_name;
+    AccountStatus status = AccountStatus::Active;
+    Money balance = 0;
+
+    bool refresh(sqlite3* db) {
+        AccountCache::Account account;
+        ShardLease shard(db, user_id);
+        if (!AccountCache::of(shard).get(shard, user_id, account)) {
+            return false;
+        }
+        first_name = account.first_name;
+        last_name = account.last_name;
+        status = account.status;
+        balance = account.cash;
+        return true;
+    }
+
+    // Переводы запрещены удалённым пользователям и пользователям с задолженностью
+    bool can_transfer() const {
+        return status != AccountStatus::Deleted && status != AccountStatus::Credited;
+    }
+};
+
+// ---- Операции банка без ввода-вывода: общие для меню и серверного режима ----
+
+LoginResult authenticate_user(sqlite3* db, const std::string& first_name, const std::string& last_name,
+    const std::string& password, int& user_id) {
+    ScopedLatency timer(Metric::Login);
+    std::string hashed_password = hash_password(password);
+
+    // Сегмент по имени не определить, поэтому счёт ищется во всех
+    ShardLease lease(db);
+    ShardRouter* router = ShardRouter::of(db);
+    std::vector<sqlite3*> shards = shard_connections(db);
+    for (size_t k = 0; k < shards.size(); ++k) {
+        sqlite3* shard = shards[k];
+        CachedStatement stmt(shard, LOGIN_SQL);
+        if (!stmt) {
+            std::cerr << "Ошибка подготовки запроса входа: " << sqlite3_errmsg(shard) << std::endl;
+            return LoginResult::Error;
+        }
+
+        sqlite3_bind_text(stmt, 1, first_name.c_str(), -1, SQLITE_STATIC);
+        sqlite3_bind_text(stmt, 2, last_name.c_str(), -1, SQLITE_STATIC);
+        sqlite3_bind_text(stmt, 3, hashed_password.c_str(), -1, SQLITE_STATIC);
+
+        if (timed_step(stmt) != SQLITE_ROW || (router != nullptr && !router->owns(k, sqlite3_column_int(stmt, 0)))) {
+            continue;
+        }
+
+        AccountStatus status = column_status(stmt, 1);
+        if (status == AccountStatus::Deleted) {
+            return LoginResult::Deleted;
+        }
+        if (status == AccountStatus::Banned) {
+            return LoginResult::Banned;
+        }
+
+        user_id = sqlite3_column_int(stmt, 0);
+        return LoginResult::Ok;
+    }
+    return LoginResult::WrongCredentials;
+}
+
+bool open_session(sqlite3* db, int user_id, Session& session) {
+    session = Session();
+    session.user_id = user_id;
+    return session.refresh(db);
+}
+
+bool get_balance(sqlite3* db, int user_id, Money& balance) {
+    ScopedLatency timer(Metric::Balance);
+    AccountCache::Account account;
+    ShardLease shard(db, user_id);
+    if (!AccountCache::of(shard).get(shard, user_id, account)) {
+        return false;
+    }
+    balance = account.cash;
+    return true;
+}
+
+// Пополнение относительным UPDATE: параллельные пополнения не теряют друг друга.
+// Зачисление и запись журнала фиксируются вместе, в том числе при групповой фиксации.
+bool perform_deposit(sqlite3* db, int user_id, Money amount) {
+    ScopedLatency timer(Metric::Deposit);
+    ShardLease lease(db, user_id);
+    db = lease;
+    AccountWrite accounts(db);
+    TransactionManager trx(db);
+    LedgerEntry entry{ user_id, "deposit", amount, "Пополнение через банкомат" };
+    entry.credit = true;
+    accounts.cash(user_id, amount);
+    if (!trx.add_transaction_async(entry).get()) {
+        return false;
+    }
+    accounts.commit();
+    return true;
+}
+
+// Переводы запрещены удалённым пользователям и пользователям с задолженностью
+// id берётся из сессии после входа, поэтому счёт без статуса пропускается
+// по битовой карте без обращения к кэшу и БД
+TransferEligibility transfer_eligibility(sqlite3* db, int user_id) {
+    ShardLease lease(db, user_id);
+    db = lease;
+    AccountCache& cache = AccountCache::of(db);
+    if (!cache.may_be_restricted(user_id)) {
+        return TransferEligibility::Allowed;
+    }
+    AccountCache::Account account;
+    if (!cache.get(db, user_id, account)) {
+        return TransferEligibility::NotFound;
+    }
+    if (account.status == AccountStatus::Deleted || account.status == AccountStatus::Credited) {
+        return TransferEligibility::Blocked;
+    }
+    return TransferEligibility::Allowed;
+}
+
+// Проверка статуса, зачисление и запись журнала в одной транзакции
+static AdminResult post_admin_increase(sqlite3* db, int user_id, Money amount, AccountWrite& accounts) {
+    SqlTransaction txn(db);
+    if (!txn.started()) {
+        return AdminResult::Error;
+    }
+
+    CachedStatement checkStmt(db, "SELECT status FROM users WHERE id = ?;");
+    if (!checkStmt) {
+        std::cerr << "Ошибка подготовки запроса: " << sqlite3_errmsg(db) << std::endl;
+        return AdminResult::Error;
+    }
+    sqlite3_bind_int(checkStmt, 1, user_id);
+    if (timed_step(checkStmt) != SQLITE_ROW) {
+        return AdminResult::NotFound;
+    }
+
+    AccountStatus status = column_status(checkStmt, 0);
+    sqlite3_reset(checkStmt);
+    if (status == AccountStatus::Deleted) {
+        return AdminResult::Deleted;
+    }
+    if (status == AccountStatus::Banned) {
+        return AdminResult::Banned;
+    }
+
+    CachedStatement updateStmt(db, "UPDATE users SET cash = cash + ? WHERE id = ?;");
+    if (!updateStmt) {
+        std::cerr << "Ошибка подготовки UPDATE-запроса: " << sqlite3_errmsg(db) << std::endl;
+        return AdminResult::Error;
+    }
+    sqlite3_bind_int64(updateStmt, 1, amount);
+    sqlite3_bind_int(updateStmt, 2, user_id);
+    if (timed_step(updateStmt) != SQLITE_DONE) {
+        std::cerr << "Ошибка обновления баланса: " << sqlite3_errmsg(db) << std::endl;
+        return AdminResult::Error;
+    }
+    sqlite3_reset(updateStmt);
+    accounts.cash(user_id, amount);
+
+    TransactionManager trx(db);
+    if (!trx.add_transaction(user_id, "admin_increase", amount, "Увеличение баланса администратором") || !txn.commit()) {
+        return AdminResult::Error;
+    }
+    return AdminResult::Ok;
+}
+
+AdminResult admin_increase_balance(sqlite3* db, int user_id, Money amount) {
+    ScopedLatency timer(Metric::AdminIncrease);
+    ShardLease lease(db, user_id);
+    db = lease;
+    AccountWrite accounts(db);
+    AdminResult result = commit_grouped(db, [&](sqlite3* connection) {
+        return post_admin_increase(connection, user_id, amount, accounts);
+    }, AdminResult::Error);
+    if (result == AdminResult::Ok) {
+        accounts.commit();
+    }
+    return result;
+}
+
+AdminResult set_user_status(sqlite3* db, int user_id, AccountStatus status) {
+    ScopedLatency timer(Metric::StatusChange);
+    ShardLease lease(db, user_id);
+    db = lease;
+    AccountWrite accounts(db);
+    CachedStatement stmt(db, "UPDATE users SET status = ? WHERE id = ?;");
+    if (!stmt) {
+        std::cerr << "Ошибка подготовки запроса: " << sqlite3_errmsg(db) << std::endl;
+        return AdminResult::Error;
+    }
+
+    sqlite3_bind_int(stmt, 1, static_cast<int>(status));
+    sqlite3_bind_int(stmt, 2, user_id);
+
+    if (timed_step(stmt) != SQLITE_DONE) {
+        std::cerr << "Ошибка при обновлении статуса: " << sqlite3_errmsg(db) << std::endl;
+        return AdminResult::Error;
+    }
+    if (sqlite3_changes(db) == 0) {
+        return AdminResult::NotFound;
+    }
+    accounts.status(user_id, status);
+    accounts.commit();
+    return AdminResult::Ok;
+}
+
+bool create_user(sqlite3* db, const std::string& first_name, const std::string& last_name,
+    const std::string& password, Money cash) {
+    User newUser(normalize_name(first_name), normalize_name(last_name), hash_password(password), cash);
+    int user_id = 0;
+    ShardLease lease(db);
+    ShardRouter* router = ShardRouter::of(db);
+    if (router != nullptr) {
+        if (!router->allocate_user_id(user_id)) {
+            return false;
+        }
+        db = router->route(user_id);
+    }
+
+    SqlTransaction txn(db);
+    if (!txn.started() || !newUser.saveToDB(db, user_id)) {
+        return false;
+    }
+    // Начальный баланс проводится через журнал, иначе счёт не сойдётся при сверке
+    if (cash > 0) {
+        TransactionManager trx(db);
+        if (!trx.add_transaction(static_cast<int>(sqlite3_last_insert_rowid(db)), "deposit", cash, "Начальный баланс")) {
+            return false;
+        }
+    }
+    return txn.commit();
+}
+
+void display_user_transactions(sqlite3* db, const Session& session) {
+    LedgerCursor cursor(db, PAGE_SIZE, session.user_id);
+
+    std::cout << "\n--- Ваши транзакции ---\n";
+    std::cout << "Пользователь: " << session.first_name << " " << session.last_name << "\n";
+    bool found = browse_pages(cursor, [](const std::vector<LedgerRow>& page) {
+        for (const LedgerRow& row : page) {
+            std::cout << "Тип: " << row.type
+                << " | Сумма: " << format_money(row.amount);
+            if (row.has_balance) {
+                std::cout << " | Остаток: " << format_money(row.balance_after);
+            }
+            std::cout << " | Дата: " << row.timestamp
+                << " | Описание: " << row.description << "\n";
+        }
+        std::cout << std::flush;
+    });
+
+    if (!found) {
+        std::cout << "У вас пока нет транзакций.\n";
+    }
+
+    pause_screen();
+}
+
+void show_balance(sqlite3* db, Session& session) {
+    if (session.refresh(db)) {
+        std::cout << "Ваш баланс: " << format_money(session.balance) << " руб.\n";
+    }
+
+    pause_screen();
+}
+
+void deposit_balance(sqlite3* db, Session& session) {
+    Money amount;
+    std::string amount_str;
+
+    while (true) {
+        std::cout << "Введите сумму пополнения: ";
+        std::cin >> amount_str;
+
+        if (parse_money(amount_str, amount)) {
+            break;
+        }
+        std::cout << "Некорректное значение. Попробуйте снова.\n";
+    }
+
+    if (perform_deposit(db, session.user_id, amount)) {
+        session.refresh(db);
+        std::cout << "Баланс успешно пополнен на " << format_money(amount) << " руб.\n";
+    }
+    else {
+        std::cerr << "Ошибка при пополнении баланса." << std::endl;
+    }
+
+    pause_screen();
+}
+
+// Перевод внутри одного файла БД: списание, зачисление и обе записи журнала
+// в одной транзакции. При групповой фиксации выполняется писателем журнала
+// на его соединении.
+static TransferResult post_transfer(sqlite3* db, const Session& sender, const std::string& recipient_first_name,
+    const std::string& recipient_last_name, Money amount, AccountWrite& accounts) {
+    int sender_id = sender.user_id;
+    SqlTransaction txn(db);
+    if (!txn.started()) {
+        return TransferResult::Error;
+    }
+
+    int recipient_id = -1;
+    {
+        CachedStatement stmt(db, FIND_RECIPIENT_SQL);
+        if (!stmt) {
+            std::cerr << "Ошибка подготовки запроса: " << sqlite3_errmsg(db) << std::endl;
+            return TransferResult::Error;
+        }
+        sqlite3_bind_text(stmt, 1, recipient_first_name.c_str(), -1, SQLITE_STATIC);
+        sqlite3_bind_text(stmt, 2, recipient_last_name.c_str(), -1, SQLITE_STATIC);
+        if (timed_step(stmt) != SQLITE_ROW) {
+            return TransferResult::RecipientNotFound;
+        }
+
+        AccountStatus status = column_status(stmt, 1);
+        if (status == AccountStatus::Deleted) {
+            return TransferResult::RecipientDeleted;
+        }
+        if (status == AccountStatus::Banned) {
+            return TransferResult::RecipientBanned;
+        }
+        recipient_id = sqlite3_column_int(stmt, 0);
+    }
+
+    // Списание с проверкой остатка в одном запросе: баланс не читается в C++
+    {
+        CachedStatement debit(db, "UPDATE users SET cash = cash - ? WHERE id = ? AND cash >= ?;");
+        if (!debit) {
+            std::cerr << "Ошибка подготовки запроса: " << sqlite3_errmsg(db) << std::endl;
+            return TransferResult::Error;
+        }
+        sqlite3_bind_int64(debit, 1, amount);
+        sqlite3_bind_int(debit, 2, sender_id);
+        sqlite3_bind_int64(debit, 3, amount);
+        if (timed_step(debit) != SQLITE_DONE) {
+            std::cerr << "Ошибка списания: " << sqlite3_errmsg(db) << std::endl;
+            return TransferResult::Error;
+        }
+        if (sqlite3_changes(db) == 0) {
+            return TransferResult::InsufficientFunds;
+        }
+    }
+
+    {
+        CachedStatement credit(db, "UPDATE users SET cash = cash + ? WHERE id = ?;");
+        if (!credit) {
+            std::cerr << "Ошибка подготовки запроса: " << sqlite3_errmsg(db) << std::endl;
+            return TransferResult::Error;
+        }
+        sqlite3_bind_int64(credit, 1, amount);
+        sqlite3_bind_int(credit, 2, recipient_id);
+        if (timed_step(credit) != SQLITE_DONE) {
+            std::cerr << "Ошибка зачисления: " << sqlite3_errmsg(db) << std::endl;
+            return TransferResult::Error;
+        }
+    }
+
+    TransactionManager trx(db);
+    if (!trx.add_transaction(sender_id, "transfer_out", amount,
+            "Перевод пользователю " + recipient_first_name + " " + recipient_last_name) ||
+        !trx.add_transaction(recipient_id, "transfer_in", amount,
+            "Получение перевода от " + sender.first_name + " " + sender.last_name)) {
+        return TransferResult::Error;
+    }
+
+    accounts.cash(sender_id, -amount);
+    accounts.cash(recipient_id, amount);
+    return txn.commit() ? TransferResult::Ok : TransferResult::Error;
+}
+
+static TransferResult transfer_within_shard(sqlite3* db, const Session& sender, const std::string& recipient_first_name,
+    const std::string& recipient_last_name, Money amount) {
+    AccountWrite accounts(db);
+    TransferResult result = commit_grouped(db, [&](sqlite3* connection) {
+        return post_transfer(connection, sender, recipient_first_name, recipient_last_name, amount, accounts);
+    }, TransferResult::Error);
+    if (result == TransferResult::Ok) {
+        accounts.commit();
+    }
+    return result;
+}
+
+// Перевод между сегментами. Два файла в режиме WAL одной транзакцией SQLite
+// атомарно не зафиксировать, поэтому перевод идёт в три шага:
+//  1. в сегменте отправителя - списание, запись transfer_out и строка transfer_outbox;
+//  2. в сегменте получателя - ключ в transfer_inbox, зачисление и запись transfer_in;
+//  3. в сегменте отправителя - удаление строки transfer_outbox.
+// После сбоя между шагами resume_transfers повторяет шаги 2 и 3 при запуске,
+// а сервер - каждые TRANSFER_RETRY_SECONDS (retry_transfers); повторное
+// зачисление отсекается ключом transfer_inbox.
+// Шаг 2: ключ в transfer_inbox, зачисление и запись transfer_in в сегменте получателя
+static bool post_incoming(sqlite3* target, int source_shard, long long transfer_id, int recipient_id,
+    Money amount, const std::string& description, AccountWrite& accounts) {
+    SqlTransaction txn(target);
+    if (!txn.started()) {
+        return false;
+    }
+    CachedStatement inbox(target, "INSERT OR IGNORE INTO transfer_inbox (source_shard, transfer_id) VALUES (?, ?);");
+    if (!inbox) {
+        std::cerr << "Ошибка подготовки запроса: " << sqlite3_errmsg(target) << std::endl;
+        return false;
+    }
+    sqlite3_bind_int(inbox, 1, source_shard);
+    sqlite3_bind_int64(inbox, 2, transfer_id);
+    if (timed_step(inbox) != SQLITE_DONE) {
+        std::cerr << "Ошибка записи входящего перевода: " << sqlite3_errmsg(target) << std::endl;
+        return false;
+    }
+
+    if (sqlite3_changes(target) > 0) {
+        CachedStatement credit(target, "UPDATE users SET cash = cash + ? WHERE id = ?;");
+        if (!credit) {
+            std::cerr << "Ошибка подготовки запроса: " << sqlite3_errmsg(target) << std::endl;
+            return false;
+        }
+        sqlite3_bind_int64(credit, 1, amount);
+        sqlite3_bind_int(credit, 2, recipient_id);
+        if (timed_step(credit) != SQLITE_DONE || sqlite3_changes(target) == 0) {
+            std::cerr << "Ошибка зачисления перевода " << transfer_id << " на счёт " << recipient_id << std::endl;
+            return false;
+        }
+        TransactionManager trx(target);
+        if (!trx.add_transaction(recipient_id, "transfer_in", amount, description)) {
+            return false;
+        }
+        accounts.cash(recipient_id, amount);
+    }
+    return txn.commit();
+}
+
+// Шаг 3: удаление доставленного перевода из transfer_outbox сегмента отправителя
+static bool remove_outgoing(sqlite3* source, long long transfer_id) {
+    CachedStatement done(source, "DELETE FROM transfer_outbox WHERE id = ?;");
+    if (!done) {
+        std::cerr << "Ошибка подготовки запроса: " << sqlite3_errmsg(source) << std::endl;
+        return false;
+    }
+    sqlite3_bind_int64(done, 1, transfer_id);
+    return timed_step(done) == SQLITE_DONE;
+}
+
+static bool deliver_transfer(ShardRouter& router, sqlite3* source, long long transfer_id, int recipient_id,
+    Money amount, const std::string& description) {
+    sqlite3* target = router.route(recipient_id);
+    int source_shard = router.index_of(source);
+    {
+        AccountWrite accounts(target);
+        bool credited = commit_grouped(target, [&](sqlite3* connection) {
+            return post_incoming(connection, source_shard, transfer_id, recipient_id, amount, description, accounts);
+        }, false);
+        if (!credited) {
+            return false;
+        }
+        accounts.commit();
+    }
+
+    return commit_grouped(source, [transfer_id](sqlite3* connection) {
+        return remove_outgoing(connection, transfer_id);
+    }, false);
+}
+
+// Шаг 1: списание, запись transfer_out и строка transfer_outbox в сегменте отправителя
+static TransferResult post_outgoing(sqlite3* source, const Session& sender, int recipient_id,
+    const std::string& recipient_first_name, const std::string& recipient_last_name, Money amount,
+    const std::string& incoming, AccountWrite& accounts, long long& transfer_id) {
+    SqlTransaction txn(source);
+    if (!txn.started()) {
+        return TransferResult::Error;
+    }
+
+    CachedStatement debit(source, "UPDATE users SET cash = cash - ? WHERE id = ? AND cash >= ?;");
+    if (!debit) {
+        std::cerr << "Ошибка подготовки запроса: " << sqlite3_errmsg(source) << std::endl;
+        return TransferResult::Error;
+    }
+    sqlite3_bind_int64(debit, 1, amount);
+    sqlite3_bind_int(debit, 2, sender.user_id);
+    sqlite3_bind_int64(debit, 3, amount);
+    if (timed_step(debit) != SQLITE_DONE) {
+        std::cerr << "Ошибка списания: " << sqlite3_errmsg(source) << std::endl;
+        return TransferResult::Error;
+    }
+    if (sqlite3_changes(source) == 0) {
+        return TransferResult::InsufficientFunds;
+    }
+
+    TransactionManager trx(source);
+    if (!trx.add_transaction(sender.user_id, "transfer_out", amount,
+            "Перевод пользователю " + recipient_first_name + " " + recipient_last_name)) {
+        return TransferResult::Error;
+    }
+
+    CachedStatement outbox(source, "INSERT INTO transfer_outbox (recipient_id, amount, description) VALUES (?, ?, ?);");
+    if (!outbox) {
+        std::cerr << "Ошибка подготовки запроса: " << sqlite3_errmsg(source) << std::endl;
+        return TransferResult::Error;
+    }
+    sqlite3_bind_int(outbox, 1, recipient_id);
+    sqlite3_bind_int64(outbox, 2, amount);
+    sqlite3_bind_text(outbox, 3, incoming.c_str(), -1, SQLITE_STATIC);
+    if (timed_step(outbox) != SQLITE_DONE) {
+        std::cerr << "Ошибка записи исходящего перевода: " << sqlite3_errmsg(source) << std::endl;
+        return TransferResult::Error;
+    }
+    transfer_id = sqlite3_last_insert_rowid(source);
+
+    accounts.cash(sender.user_id, -amount);
+    return txn.commit() ? TransferResult::Ok : TransferResult::Error;
+}
+
+static TransferResult transfer_across_shards(ShardRouter& router, const Session& sender, int recipient_id,
+    const std::string& recipient_first_name, const std::string& recipient_last_name, Money amount) {
+    sqlite3* source = router.route(sender.user_id);
+    std::string incoming = "Получение перевода от " + sender.first_name + " " + sender.last_name;
+    long long transfer_id = 0;
+    {
+        AccountWrite accounts(source);
+        TransferResult result = commit_grouped(source, [&](sqlite3* connection) {
+            return post_outgoing(connection, sender, recipient_id, recipient_first_name, recipient_last_name,
+                amount, incoming, accounts, transfer_id);
+        }, TransferResult::Error);
+        if (result != TransferResult::Ok) {
+            return result;
+        }
+        accounts.commit();
+    }
+
+    // Списание уже зафиксировано, и перевод будет доставлен в любом случае
+    if (!deliver_transfer(router, source, transfer_id, recipient_id, amount, incoming)) {
+        std::cerr << "Перевод " << transfer_id << " будет зачислен повторной доставкой" << std::endl;
+    }
+    return TransferResult::Ok;
+}
+
+TransferResult perform_transfer(sqlite3* db, const Session& sender, const std::string& recipient_first_name,
+    const std::string& recipient_last_name, Money amount) {
+    ScopedLatency timer(Metric::Transfer);
+    ShardRouter* router = ShardRouter::of(db);
+    if (router == nullptr) {
+        return transfer_within_shard(db, sender, recipient_first_name, recipient_last_name, amount);
+    }
+
+    ShardLease lease(db);
+    int recipient_id = -1;
+    for (size_t k = 0; k < router->size() && recipient_id < 0; ++k) {
+        sqlite3* shard = router->connection(k);
+        CachedStatement stmt(shard, FIND_RECIPIENT_SQL);
+        if (!stmt) {
+            std::cerr << "Ошибка подготовки запроса: " << sqlite3_errmsg(shard) << std::endl;
+            return TransferResult::Error;
+        }
+        sqlite3_bind_text(stmt, 1, recipient_first_name.c_str(), -1, SQLITE_STATIC);
+        sqlite3_bind_text(stmt, 2, recipient_last_name.c_str(), -1, SQLITE_STATIC);
+        if (timed_step(stmt) != SQLITE_ROW || !router->owns(k, sqlite3_column_int(stmt, 0))) {
+            continue;
+        }
+
+        AccountStatus status = column_status(stmt, 1);
+        if (status == AccountStatus::Deleted) {
+            return TransferResult::RecipientDeleted;
+        }
+        if (status == AccountStatus::Banned) {
+            return TransferResult::RecipientBanned;
+        }
+        recipient_id = sqlite3_column_int(stmt, 0);
+    }
+    if (recipient_id < 0) {
+        return TransferResult::RecipientNotFound;
+    }
+
+    sqlite3* source = router->route(sender.user_id);
+    if (router->route(recipient_id) == source) {
+        return transfer_within_shard(source, sender, recipient_first_name, recipient_last_name, amount);
+    }
+    return transfer_across_shards(*router, sender, recipient_id, recipient_first_name, recipient_last_name, amount);
+}
+
+const int TRANSFER_RETRY_SECONDS = 5;      // повторная доставка переводов в режиме сервера
+
+// Доставляет переводы, оставшиеся в transfer_outbox сегмента source. Перевод,
+// который в это же время доставляет сама операция перевода, будет зачислен
+// один раз: второе зачисление отсекается ключом transfer_inbox.
+static bool deliver_outbox(ShardRouter& router, sqlite3* source, size_t& delivered) {
+    struct Pending {
+        long long id;
+        int recipient_id;
+        Money amount;
+        std::string description;
+    };
+
+    std::vector<Pending> pending;
+    {
+        CachedStatement stmt(source, "SELECT id, recipient_id, amount, description FROM transfer_outbox ORDER BY id;");
+        if (!stmt) {
+            std::cerr << "Ошибка подготовки запроса: " << sqlite3_errmsg(source) << std::endl;
+            return false;
+        }
+        while (timed_step(stmt) == SQLITE_ROW) {
+            const unsigned char* desc = sqlite3_column_text(stmt, 3);
+            pending.push_back({ sqlite3_column_int64(stmt, 0), sqlite3_column_int(stmt, 1),
+                sqlite3_column_int64(stmt, 2), desc ? reinterpret_cast<const char*>(desc) : "" });
+        }
+    }
+    for (const Pending& item : pending) {
+        if (!deliver_transfer(router, source, item.id, item.recipient_id, item.amount, item.description)) {
+            return false;
+        }
+        ++delivered;
+    }
+    return true;
+}
+
+// Повторная доставка во время работы сервера. Ключи transfer_inbox здесь не
+// удаляются: доставка того же перевода может ещё идти в обработчике.
+bool retry_transfers(sqlite3* db) {
+    ShardLease lease(db);
+    ShardRouter* router = ShardRouter::of(db);
+    if (router == nullptr) {
+        return true;
+    }
+    bool ok = true;
+    for (size_t s = 0; s < router->size(); ++s) {
+        size_t delivered = 0;
+        ok = deliver_outbox(*router, router->connection(s), delivered) && ok;
+        if (delivered > 0) {
+            std::clog << "Сегмент " << s << ": зачислено отложенных переводов: " << delivered << std::endl;
+        }
+    }
+    return ok;
+}
+
+// Доводит до конца межсегментные переводы, прерванные сбоем, и удаляет из
+// transfer_inbox ключи завершённых переводов. Выполняется при запуске, пока
+// другие соединения с сегментами не работают.
+bool resume_transfers(sqlite3* db) {
+    ShardRouter* router = ShardRouter::of(db);
+    if (router == nullptr) {
+        return true;
+    }
+
+    for (size_t s = 0; s < router->size(); ++s) {
+        sqlite3* source = router->connection(s);
+        size_t delivered = 0;
+        if (!deliver_outbox(*router, source, delivered)) {
+            return false;
+        }
+        if (delivered > 0) {
+            std::clog << "Сегмент " << s << ": завершено прерванных переводов: " << delivered << std::endl;
+        }
+
+        // Очередь сегмента пуста: все его переводы до последнего выданного номера доставлены
+        long long last_id = 0;
+        {
+            CachedStatement stmt(source, "SELECT seq FROM sqlite_sequence WHERE name = 'transfer_outbox';");
+            if (stmt && timed_step(stmt) == SQLITE_ROW) {
+                last_id = sqlite3_column_int64(stmt, 0);
+            }
+        }
+        for (sqlite3* target : router->all()) {
+            CachedStatement prune(target, "DELETE FROM transfer_inbox WHERE source_shard = ? AND transfer_id <= ?;");
+            if (!prune) {
+                std::cerr << "Ошибка подготовки запроса: " << sqlite3_errmsg(target) << std::endl;
+                return false;
+            }
+            sqlite3_bind_int(prune, 1, static_cast<int>(s));
+            sqlite3_bind_int64(prune, 2, last_id);
+            if (timed_step(prune) != SQLITE_DONE) {
+                std::cerr << "Ошибка очистки входящих переводов: " << sqlite3_errmsg(target) << std::endl;
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+void transfer_to_user(sqlite3* db, Session& session) {
+    std::string recipient_first_name, recipient_last_name;
+    Money amount;
+
+    std::cout << "Введите имя получателя: ";
+    std::cin >> recipient_first_name;
+    recipient_first_name = normalize_name(recipient_first_name);
+    std::cout << "Введите фамилию получателя: ";
+    std::cin >> recipient_last_name;
+    recipient_last_name = normalize_name(recipient_last_name);
+
+    std::string amount_str;
+
+    while (true) {
+        std::cout << "Введите сумму перевода: ";
+        std::cin >> amount_str;
+
+        if (parse_money(amount_str, amount)) {
+            break;
+        }
+        std::cout << "Некорректная сумма. Попробуйте снова.\n";
+    }
+
+    switch (perform_transfer(db, session, recipient_first_name, recipient_last_name, amount)) {
+    case TransferResult::Ok:
+        session.refresh(db);
+        std::cout << "Перевод выполнен успешно.\n";
+        break;
+    case TransferResult::InsufficientFunds:
+        std::cout << "Недостаточно средств.\n";
+        break;
+    case TransferResult::RecipientNotFound:
+        std::cout << "Пользователь не найден.\n";
+        break;
+    case TransferResult::RecipientDeleted:
+        std::cout << "Нельзя перевести деньги: пользователь помечен как удалённый.\n";
+        break;
+    case TransferResult::RecipientBanned:
+        std::cout << "Нельзя перевести деньги: пользователь помечен как заблокированный.\n";
+        break;
+    case TransferResult::Error:
+        std::cout << "Перевод не выполнен, попробуйте позже.\n";
+        break;
+    }
+
+    pause_screen();
+}
+
+void user_menu(sqlite3* db, Session& session) {
+    std::string choice;
+
+    do {
+        clear_screen();
+        std::cout << "----- Меню пользователя -----\n";
+        std::cout << "1 - Показать баланс\n";
+        std::cout << "2 - Пополнение баланса через банкомат\n";
+        std::cout << "3 - Перевод пользователю\n";
+        std::cout << "4 - Показать транзакции\n";
+        std::cout << "5 - Выйти\n";
+        std::cout << ">> ";
+        std::cin >> choice;
+
+        if (choice == "1") {
+            show_balance(db, session);
+        }
+        else if (choice == "2") {
+            deposit_balance(db, session);
+        }
+        else if (choice == "3") {
+            session.refresh(db);
+            if (!session.can_transfer()) {
+                std::cout << "Вы не можете совершать переводы. У вас задолженость.\n";
+                pause_screen();
+            }
+            else {
+                transfer_to_user(db, session);
+            }
+        }
+        else if (choice == "4") {
+            display_user_transactions(db, session);
+        }
+        else if (choice != "5") {
+            std::cout << "Неверный синтаксис, попробуйте еще раз.\n";
+            pause_screen();
+        }
+    } while (choice != "5");
+}
+
+void login_user(sqlite3* db) {
+    std::string first_name, last_name, password;
+
+    std::cout << "Введите имя: ";
+    std::cin >> first_name;
+    first_name = normalize_name(first_name);
+
+    std::cout << "Введите фамилию: ";
+    std::cin >> last_name;
+    last_name = normalize_name(last_name);
+
+    std::cout << "Введите пароль: ";
+    std::cin >> password;
+
+    int user_id = -1;
+    Session session;
+    switch (authenticate_user(db, first_name, last_name, password, user_id)) {
+    case LoginResult::Ok:
+        if (!open_session(db, user_id, session)) {
+            return;
+        }
+        std::cout << "Успешный вход! Добро пожаловать, " << first_name << "!\n";
+        pause_screen();
+        user_menu(db, session);
+        return;
+    case LoginResult::Deleted:
+        std::cout << "Вход невозможен: аккаунт помечен как удалённый.\n";
+        return;
+    case LoginResult::Banned:
+        std::cout << "Вход невозможен: аккаунт помечен как заблокированный.\n";
+        return;
+    case LoginResult::WrongCredentials:
+        std::cout << "Неверные данные! Попробуйте ещё раз.\n";
+        break;
+    case LoginResult::Error:
+        return;
+    }
+
+    pause_screen();
+}
+
+void increase_balance(sqlite3* db) {
+    int user_id;
+    Money amount;
+    std::string amount_str;
+
+    std::cout << "Введите ID пользователя, которому хотите увеличить баланс: ";
+    std::cin >> user_id;
+
+    std::cout << "Введите сумму увеличения: ";
+    std::cin >> amount_str;
+    if (!parse_money(amount_str, amount)) {
+        std::cout << "Некорректная сумма.\n";
+        return;
+    }
+
+    switch (admin_increase_balance(db, user_id, amount)) {
+    case AdminResult::Ok:
+        std::cout << "Баланс успешно обновлён.\n";
+        break;
+    case AdminResult::Deleted:
+        std::cout << "Невозможно изменить баланс — пользователь удалён.\n";
+        pause_screen();
+        break;
+    case AdminResult::Banned:
+        std::cout << "Невозможно изменить баланс — пользователь заблокирован.\n";
+        pause_screen();
+        break;
+    case AdminResult::NotFound:
+        std::cerr << "Пользователь с таким ID не найден." << std::endl;
+        break;
+    case AdminResult::Error:
+        break;
+    }
+}
+
+void create_status(sqlite3* db) {
+    int id;
+    std::cout << "Введите ID пользователя, которому хотите добавить статус: ";
+    std::cin >> id;
+
+    AccountStatus status = AccountStatus::Active;
+    std::string choice;
+
+    while (choice != "1" && choice != "2" && choice != "3" && choice != "4" && choice != "5") {
+        clear_screen();
+        std::cout << "----- Статус пользователя -----\n";
+        std::cout << "1 - deleted\n";
+        std::cout << "2 - banned\n";
+        std::cout << "3 - credited\n";
+        std::cout << "4 - Очистить статус (null)\n";
+        std::cout << "5 - Отмена\n";
+        std::cout << ">> ";
+        std::cin >> choice;
+
+        if (choice == "1") {
+            status = AccountStatus::Deleted;
+        }
+        else if (choice == "2") {
+            status = AccountStatus::Banned;
+        }
+        else if (choice == "3") {
+            status = AccountStatus::Credited;
+        }
+        else if (choice == "4") {
+            status = AccountStatus::Active;
+        }
+        else if (choice == "5") {
+            return;
+        }
+        else {
+            std::cout << "Неверный выбор, попробуйте снова.\n";
+            pause_screen();
+        }
+    }
+
+    switch (set_user_status(db, id, status)) {
+    case AdminResult::Ok: {
+        std::string displayStatus = (status == AccountStatus::Active) ? "NULL" : "\"" + std::string(status_name(status)) + "\"";
+        std::cout << "Статус пользователя с ID " << id << " успешно обновлён на " << displayStatus << ".\n";
+        break;
+    }
+    case AdminResult::NotFound:
+        std::cerr << "Пользователь с таким ID не найден." << std::endl;
+        break;
+    default:
+        break;
+    }
+}
+
+void input_user(sqlite3* db) {
+    UserCursor cursor(db, PAGE_SIZE);
+
+    std::cout << "\nСписок пользователей:\n";
+    std::cout << "------------------------\n";
+    browse_pages(cursor, [](const std::vector<UserRow>& page) {
+        for (const UserRow& user : page) {
+            std::cout << "ID: " << user.id
+                << " | Имя: " << user.first_name
+                << " | Фамилия: " << user.last_name
+                << " | Пароль: " << user.password
+                << " | Баланс: " << format_money(user.cash) << " руб."
+                << " | Статус: " << status_name(user.status) << "\n";
+        }
+        std::cout << "------------------------\n";
+    });
+}
+
+void show_statement_cache_stats(sqlite3* db) {
+    StatementCache* cache = StatementCache::of(db);
+    if (cache == nullptr) {
+        std::cout << "Кэш запросов не подключён.\n";
+        return;
+    }
+
+    unsigned long long total = cache->hits() + cache->misses();
+    std::cout << "\n=== Кэш подготовленных запросов ===\n";
+    std::cout << "Запросов в кэше: " << cache->size() << "\n";
+    std::cout << "Попаданий: " << cache->hits() << "\n";
+    std::cout << "Промахов: " << cache->misses() << "\n";
+    if (total > 0) {
+        std::ostringstream ratio;
+        ratio << std::fixed << std::setprecision(1) << 100.0 * cache->hits() / total;
+        std::cout << "Доля попаданий: " << ratio.str() << "%\n";
+    }
+}
+
+void show_account_cache_stats(sqlite3* db) {
+    std::vector<sqlite3*> shards = shard_connections(db);
+    for (size_t k = 0; k < shards.size(); ++k) {
+        AccountCache& cache = AccountCache::of(shards[k]);
+        std::cout << "\n=== Кэш счетов";
+        if (shards.size() > 1) {
+            std::cout << ", сегмент " << k;
+        }
+        std::cout << " ===\n";
+        std::cout << "Счетов в кэше: " << cache.size() << "\n";
+        std::cout << "Попаданий: " << cache.hits() << "\n";
+        std::cout << "Промахов: " << cache.misses() << "\n";
+    }
+}
+
+void register_user(sqlite3* db, bool money) {
+    std::string first_name, last_name, password;
+    Money cash = 0;
+
+    std::cout << "Введите имя пользователя: ";
+    std::cin >> first_name;
+    first_name = normalize_name(first_name);
+
+    std::cout << "Введите фамилию пользователя: ";
+    std::cin >> last_name;
+    last_name = normalize_name(last_name);
+
+    std::cout << "Введите пароль пользователя: ";
+    std::cin >> password;
+
+    if (money) {
+        std::string cash_str;
+        while (true) {
+            std::cout << "Введите размер денежных средств (в рублях): ";
+            std::cin >> cash_str;
+            if (parse_money(cash_str, cash, true) || !std::cin) {
+                break;
+            }
+            std::cout << "Некорректная сумма. Попробуйте снова.\n";
+        }
+    }
+
+    if (create_user(db, first_name, last_name, password, cash)) {
+        std::cout << "Пользователь успешно добавлен.\n";
+    }
+    else {
+        std::cerr << "Ошибка при добавлении пользователя." << std::endl;
+    }
+
+    pause_screen();
+    clear_screen();
+}
+
+// ---- Сверка балансов с журналом ----
+// users.cash каждого счёта должен быть равен сумме его записей в transactions:
+// deposit, transfer_in и admin_increase увеличивают баланс, transfer_out уменьшает.
+// Диапазон id делится на блоки, которые разбирают потоки; у каждого потока своё
+// соединение только для чтения, и все они читают один и тот же снимок БД.
+// В бинарном журнале сумма счёта считается по цепочке его записей от последней
+// записи из ledger_heads того же снимка.
+
+const int RECONCILE_CHUNK = 4096;
+const int RECONCILE_SAMPLE_ROWS = 10;
+const size_t RECONCILE_PRINT_LIMIT = 100;
+
+const char* const RECONCILE_USERS_SQL = "SELECT id, cash FROM users WHERE id BETWEEN ? AND ? ORDER BY id;";
+// Запись неизвестного типа не входит в сумму и считается отдельно
+const char* const RECONCILE_LEDGER_SQL =
+    "SELECT user_id, count(*), "
+    "coalesce(sum(CASE type WHEN 'deposit' THEN amount WHEN 'transfer_in' THEN amount "
+    "WHEN 'admin_increase' THEN amount WHEN 'transfer_out' THEN -amount END), 0), "
+    "sum(type NOT IN ('deposit', 'transfer_in', 'admin_increase', 'transfer_out')) "
+    "FROM transactions WHERE user_id BETWEEN ? AND ? GROUP BY user_id ORDER BY user_id;";
+const char* const RECONCILE_HEADS_SQL = "SELECT user_id, head FROM ledger_heads WHERE user_id BETWEEN ? AND ? ORDER BY user_id;";
+
+struct LedgerMismatch {
+    int user_id;
+    bool has_account;       // false - записи журнала без счёта в users
+    Money cash;
+    Money ledger;
+    long long entries;
+    long long unknown;      // записи с неизвестным типом
+    std::vector<LedgerRow> rows;
+};
+
+struct ReconcileReport {
+    long long accounts = 0;
+    long long entries = 0;
+    unsigned threads = 0;
+    double seconds = 0;
+    std::vector<LedgerMismatch> mismatches;
+};
+
+static bool known_ledger_type(const std::string& type) {
+    return type == "deposit" || type == "transfer_in" || type == "admin_increase" || type == "transfer_out";
+}
+
+// Сверяет счета и записи журнала с id в [from, to]. Оба запроса идут по возрастанию
+// user_id, поэтому результаты сливаются за один проход. owned - корзины, закреплённые
+// за сегментом; счета остальных корзин - копии незавершённого переноса.
+static bool reconcile_range(sqlite3* db, int from, int to, const std::vector<bool>& owned, ReconcileReport& report) {
+    MappedLedger* log = MappedLedger::of(db);
+    CachedStatement users(db, RECONCILE_USERS_SQL);
+    CachedStatement ledger(db, (log != nullptr) ? RECONCILE_HEADS_SQL : RECONCILE_LEDGER_SQL);
+    if (!users || !ledger) {
+        std::cerr << "Ошибка подготовки запроса: " << sqlite3_errmsg(db) << std::endl;
+        return false;
+    }
+    sqlite3_bind_int(users, 1, from);
+    sqlite3_bind_int(users, 2, to);
+    sqlite3_bind_int(ledger, 1, from);
+    sqlite3_bind_int(ledger, 2, to);
+
+    int user_rc = timed_step(users);
+    int ledger_rc = timed_step(ledger);
+    while (user_rc == SQLITE_ROW || ledger_rc == SQLITE_ROW) {
+        int user_id = (user_rc == SQLITE_ROW) ? sqlite3_column_int(users, 0) : 0;
+        int ledger_id = (ledger_rc == SQLITE_ROW) ? sqlite3_column_int(ledger, 0) : 0;
+        bool has_account = user_rc == SQLITE_ROW && (ledger_rc != SQLITE_ROW || user_id <= ledger_id);
+        bool has_entries = ledger_rc == SQLITE_ROW && (user_rc != SQLITE_ROW || ledger_id <= user_id);
+
+        LedgerMismatch item{ has_account ? user_id : ledger_id, has_account, 0, 0, 0, 0, {} };
+        bool skip = !owned.empty() && !owned[(item.user_id - 1) % SHARD_BUCKETS];
+        if (has_account) {
+            item.cash = sqlite3_column_int64(users, 1);
+            if (!skip) ++report.accounts;
+            user_rc = timed_step(users);
+        }
+        if (has_entries) {
+            if (log != nullptr) {
+                log->summarize(sqlite3_column_int64(ledger, 1), item.entries, item.ledger, item.unknown);
+            }
+            else {
+                item.entries = sqlite3_column_int64(ledger, 1);
+                item.ledger = sqlite3_column_int64(ledger, 2);
+                item.unknown = sqlite3_column_int64(ledger, 3);
+            }
+            if (!skip) report.entries += item.entries;
+            ledger_rc = timed_step(ledger);
+        }
+        if (skip) {
+            continue;
+        }
+
+        if (!has_account || item.cash != item.ledger || item.unknown > 0) {
+            LedgerCursor cursor(db, RECONCILE_SAMPLE_ROWS, item.user_id);
+            item.rows = cursor.first();
+            report.mismatches.push_back(std::move(item));
+        }
+    }
+    if (user_rc != SQLITE_DONE || ledger_rc != SQLITE_DONE) {
+        std::cerr << "Ошибка чтения при сверке: " << sqlite3_errmsg(db) << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Наименьший и наибольший id среди счетов и владельцев записей журнала
+static bool reconcile_bounds(sqlite3* db, int& low, int& high) {
+    CachedStatement stmt(db,
+        "SELECT min(lo), max(hi) FROM (SELECT min(id) AS lo, max(id) AS hi FROM users "
+        "UNION ALL SELECT min(user_id), max(user_id) FROM transactions "
+        "UNION ALL SELECT min(user_id), max(user_id) FROM ledger_heads);");
+    if (!stmt || timed_step(stmt) != SQLITE_ROW) {
+        std::cerr << "Ошибка чтения диапазона id: " << sqlite3_errmsg(db) << std::endl;
+        return false;
+    }
+    low = sqlite3_column_int(stmt, 0);
+    high = sqlite3_column_type(stmt, 1) == SQLITE_NULL ? low - 1 : sqlite3_column_int(stmt, 1);
+    return true;
+}
+
+// Общий снимок: пока db держит блокировку записи, ни одна транзакция не может
+// зафиксироваться, и потоки открывают чтение на одной и той же версии БД.
+// После того как все потоки начали чтение, блокировка снимается, и запись
+// продолжается параллельно со сверкой.
+static bool reconcile_shard(sqlite3* db, unsigned threads, ReconcileReport& report) {
+    const char* path = sqlite3_db_filename(db, "main");
+    if (path == nullptr || *path == '\0') {
+        std::cerr << "Сверка возможна только для БД в файле" << std::endl;
+        return false;
+    }
+    int busy_timeout = std::atoi(query_pragma(db, "busy_timeout").c_str());
+
+    // Закреплённые за сегментом корзины читаются вместе со снимком: перенос
+    // не переключит корзину, пока снимок не зафиксирован
+    std::unique_ptr<ShardLease> lease(new ShardLease(db));
+    std::vector<bool> owned;
+    ShardRouter* router = ShardRouter::of(db);
+    if (router != nullptr) {
+        int shard = router->index_of(db);
+        for (int bucket = 0; bucket < SHARD_BUCKETS; ++bucket) {
+            owned.push_back(router->buckets().owner(bucket) == shard);
+        }
+    }
+
+    SqlTransaction hold(db);
+    int low = 0, high = 0;
+    if (!hold.started() || !reconcile_bounds(db, low, high)) {
+        return false;
+    }
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    unsigned pinned = 0;
+    std::atomic<long long> next_chunk(low);
+    std::atomic<bool> failed(false);
+    std::vector<ReconcileReport> parts(threads);
+    std::vector<std::thread> workers;
+
+    for (unsigned t = 0; t < threads; ++t) {
+        workers.emplace_back([&, t] {
+            sqlite3* reader = nullptr;
+            bool ready = sqlite3_open_v2(path, &reader, SQLITE_OPEN_READONLY, nullptr) == SQLITE_OK;
+            if (ready) {
+                sqlite3_busy_timeout(reader, busy_timeout);
+                // Снимок фиксируется первым чтением внутри транзакции
+                ready = sqlite3_exec(reader, "BEGIN; SELECT count(*) FROM sqlite_master;", nullptr, nullptr, nullptr) == SQLITE_OK;
+            }
+            if (!ready) {
+                std::cerr << "Ошибка открытия БД для сверки: " << sqlite3_errmsg(reader) << std::endl;
+                failed = true;
+            }
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                ++pinned;
+            }
+            cv.notify_all();
+
+            if (ready) {
+                StatementCache statements(reader);
+                while (!failed) {
+                    long long from = next_chunk.fetch_add(RECONCILE_CHUNK);
+                    if (from > high) {
+                        break;
+                    }
+                    long long to = std::min<long long>(from + RECONCILE_CHUNK - 1, high);
+                    if (!reconcile_range(reader, static_cast<int>(from), static_cast<int>(to), owned, parts[t])) {
+                        failed = true;
+                    }
+                }
+            }
+            if (reader != nullptr) {
+                sqlite3_exec(reader, "COMMIT;", nullptr, nullptr, nullptr);
+            }
+            sqlite3_close(reader);
+        });
+    }
+
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [&] { return pinned == threads; });
+    }
+    hold.rollback();
+    lease.reset();
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+    if (failed) {
+        return false;
+    }
+
+    for (ReconcileReport& part : parts) {
+        report.accounts += part.accounts;
+        report.entries += part.entries;
+        std::move(part.mismatches.begin(), part.mismatches.end(), std::back_inserter(report.mismatches));
+    }
+    return true;
+}
+
+// Счёт и его записи журнала всегда лежат в одном сегменте, поэтому сегменты
+// сверяются по очереди, каждый на своём снимке
+bool reconcile_ledger(sqlite3* db, unsigned threads, ReconcileReport& report) {
+    auto started = std::chrono::steady_clock::now();
+    report = ReconcileReport();
+    report.threads = (threads > 0) ? threads : 1;
+    for (sqlite3* shard : shard_connections(db)) {
+        if (!reconcile_shard(shard, report.threads, report)) {
+            return false;
+        }
+    }
+    std::sort(report.mismatches.begin(), report.mismatches.end(),
+        [](const LedgerMismatch& a, const LedgerMismatch& b) { return a.user_id < b.user_id; });
+    report.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+    return true;
+}
+
+void print_reconcile_report(const ReconcileReport& report) {
+    std::cout << "\n=== Сверка балансов с журналом ===\n";
+    std::cout << "Счетов: " << report.accounts << ", записей журнала: " << report.entries
+        << ", потоков: " << report.threads << ", время: "
+        << std::fixed << std::setprecision(2) << report.seconds << " с\n";
+    if (report.mismatches.empty()) {
+        std::cout << "Расхождений не найдено.\n";
+        return;
+    }
+
+    std::cout << "Расхождений: " << report.mismatches.size() << "\n";
+    size_t shown = std::min(report.mismatches.size(), RECONCILE_PRINT_LIMIT);
+    for (size_t i = 0; i < shown; ++i) {
+        const LedgerMismatch& m = report.mismatches[i];
+        if (m.has_account) {
+            std::cout << "\nСчёт " << m.user_id << ": баланс " << format_money(m.cash)
+                << ", по журналу " << format_money(m.ledger)
+                << ", разница " << format_money(m.cash - m.ledger);
+        }
+        else {
+            std::cout << "\nЗаписи журнала без счёта, user_id " << m.user_id
+                << ": сумма " << format_money(m.ledger);
+        }
+        std::cout << ", записей " << m.entries;
+        if (m.unknown > 0) {
+            std::cout << ", неизвестного типа " << m.unknown;
+        }
+        std::cout << "\n";
+        // Последние записи счёта; подозрительные помечены '!'
+        for (const LedgerRow& row : m.rows) {
+            bool suspicious = !known_ledger_type(row.type) || row.amount <= 0;
+            std::cout << (suspicious ? "  ! " : "    ") << "id " << row.id
+                << " | " << row.type
+                << " | " << format_money(row.amount)
+                << " | " << row.timestamp
+                << " | " << row.description << "\n";
+        }
+    }
+    if (shown < report.mismatches.size()) {
+        std::cout << "\n... и ещё " << (report.mismatches.size() - shown) << "\n";
+    }
+}
+
+void reconcile_menu(sqlite3* db) {
+    ReconcileReport report;
+    if (reconcile_ledger(db, std::max(1u, std::thread::hardware_concurrency()), report)) {
+        print_reconcile_report(report);
+    }
+    else {
+        std::cerr << "Сверка не выполнена." << std::endl;
+    }
+}
+
+// ---- Выгрузка журнала по столбцам ----
+// Снимок журнала для аналитики: user_id, код типа, сумма и время записи лежат
+// в файле отдельными столбцами, блоками по COLUMN_BLOCK_ROWS строк. Каждый
+// столбец блока сжат отдельно: хранится разность с минимумом блока (для
+// времени - разность соседних значений), числа переменной длины по 7 бит
+// в байте. Для каждого столбца блока в оглавлении в конце файла записаны
+// смещение, размер, минимум и максимум, поэтому читатель пропускает блоки,
+// которые не попадают под фильтр, и распаковывает только нужные столбцы.
+// Числа в заголовке и оглавлении хранятся в порядке байтов машины.
+
+const int COLUMN_BLOCK_ROWS = 65536;
+const uint32_t COLUMN_FILE_VERSION = 1;
+const char COLUMN_FILE_MAGIC[8] = { 'B', 'A', 'N', 'K', 'C', 'O', 'L', '1' };
+
+enum class LedgerColumn { UserId, Type, Amount, Timestamp, Count };
+const int LEDGER_COLUMNS = static_cast<int>(LedgerColumn::Count);
+const char* const LEDGER_COLUMN_NAMES[] = { "user_id", "type", "amount", "timestamp" };
+
+struct ColumnFileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t block_rows;
+    uint64_t rows;
+    uint64_t blocks;
+    uint64_t index_offset;      // оглавление блоков
+};
+static_assert(sizeof(ColumnFileHeader) == 40, "заголовок файла столбцов должен занимать 40 байт");
+
+struct ColumnChunk {
+    uint64_t offset;
+    uint64_t size;
+    int64_t min;
+    int64_t max;
+};
+
+struct ColumnBlock {
+    uint64_t rows;
+    ColumnChunk columns[LEDGER_COLUMNS];
+};
+
+static void put_varint(uint64_t value, std::string& out) {
+    while (value >= 0x80) {
+        out.push_back(static_cast<char>((value & 0x7F) | 0x80));
+        value >>= 7;
+    }
+    out.push_back(static_cast<char>(value));
+}
+
+static bool get_varint(const char*& data, const char* end, uint64_t& value) {
+    value = 0;
+    for (int shift = 0; data < end && shift < 64; shift += 7) {
+        unsigned char byte = static_cast<unsigned char>(*data++);
+        value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+        if ((byte & 0x80) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Время записей почти упорядочено, поэтому хранятся разности соседних значений
+static bool column_is_delta(LedgerColumn column) {
+    return column == LedgerColumn::Timestamp;
+}
+
+static void encode_column(const std::vector<int64_t>& values, LedgerColumn column, int64_t min, std::string& out) {
+    out.clear();
+    uint64_t prev = static_cast<uint64_t>(min);
+    for (int64_t value : values) {
+        uint64_t diff = static_cast<uint64_t>(value) - prev;
+        if (column_is_delta(column)) {
+            // Зигзаг: небольшие отрицательные разности тоже занимают один байт
+            int64_t signed_diff = static_cast<int64_t>(diff);
+            diff = (static_cast<uint64_t>(signed_diff) << 1) ^ static_cast<uint64_t>(signed_diff >> 63);
+            prev = static_cast<uint64_t>(value);
+        }
+        put_varint(diff, out);
+    }
+}
+
+static bool decode_column(const std::string& data, size_t rows, LedgerColumn column, int64_t min,
+    std::vector<int64_t>& values) {
+    values.resize(rows);
+    const char* pos = data.data();
+    const char* end = pos + data.size();
+    uint64_t prev = static_cast<uint64_t>(min);
+    for (size_t i = 0; i < rows; ++i) {
+        uint64_t diff;
+        if (!get_varint(pos, end, diff)) {
+            return false;
+        }
+        if (column_is_delta(column)) {
+            uint64_t unsigned_diff = (diff >> 1) ^ (~(diff & 1) + 1);
+            prev += unsigned_diff;
+            values[i] = static_cast<int64_t>(prev);
+        }
+        else {
+            values[i] = static_cast<int64_t>(prev + diff);
+        }
+    }
+    return pos == end;
+}
+
+// Пишет файл столбцов блок за блоком: в памяти держится только текущий блок.
+// Файл пишется под временным именем и переименовывается после оглавления,
+// поэтому читатель не увидит недописанный снимок.
+class ColumnarWriter {
+private:
+    std::string path;
+    std::string temp_path;
+    std::ofstream out;
+    std::vector<int64_t> columns[LEDGER_COLUMNS];
+    std::vector<ColumnBlock> index;
+    std::string encoded;
+    uint64_t offset = sizeof(ColumnFileHeader);
+    uint64_t row_count = 0;
+
+    bool flush_block() {
+        size_t count = columns[0].size();
+        if (count == 0) {
+            return true;
+        }
+        ColumnBlock block = {};
+        block.rows = count;
+        for (int c = 0; c < LEDGER_COLUMNS; ++c) {
+            const std::vector<int64_t>& values = columns[c];
+            auto bounds = std::minmax_element(values.begin(), values.end());
+            ColumnChunk& chunk = block.columns[c];
+            chunk.min = *bounds.first;
+            chunk.max = *bounds.second;
+            encode_column(values, static_cast<LedgerColumn>(c), chunk.min, encoded);
+            chunk.offset = offset;
+            chunk.size = encoded.size();
+            out.write(encoded.data(), static_cast<std::streamsize>(encoded.size()));
+            offset += encoded.size();
+            columns[c].clear();
+        }
+        index.push_back(block);
+        return static_cast<bool>(out);
+    }
+
+public:
+    explicit ColumnarWriter(const std::string& file_path) : path(file_path), temp_path(file_path + ".tmp") {
+        out.open(temp_path, std::ios::binary | std::ios::trunc);
+        ColumnFileHeader header = {};
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        for (std::vector<int64_t>& column : columns) {
+            column.reserve(COLUMN_BLOCK_ROWS);
+        }
+    }
+
+    ~ColumnarWriter() {
+        if (out.is_open()) {
+            out.close();
+            std::remove(temp_path.c_str());
+        }
+    }
+
+    ColumnarWriter(const ColumnarWriter&) = delete;
+    ColumnarWriter& operator=(const ColumnarWriter&) = delete;
+
+    bool started() const { return static_cast<bool>(out); }
+
+    bool add(int user_id, LedgerType type, Money amount, long long timestamp) {
+        columns[static_cast<int>(LedgerColumn::UserId)].push_back(user_id);
+        columns[static_cast<int>(LedgerColumn::Type)].push_back(static_cast<int64_t>(type));
+        columns[static_cast<int>(LedgerColumn::Amount)].push_back(amount);
+        columns[static_cast<int>(LedgerColumn::Timestamp)].push_back(timestamp);
+        ++row_count;
+        return columns[0].size() < static_cast<size_t>(COLUMN_BLOCK_ROWS) || flush_block();
+    }
+
+    bool finish() {
+        if (!flush_block()) {
+            return false;
+        }
+        ColumnFileHeader header = {};
+        std::memcpy(header.magic, COLUMN_FILE_MAGIC, sizeof(header.magic));
+        header.version = COLUMN_FILE_VERSION;
+        header.block_rows = COLUMN_BLOCK_ROWS;
+        header.rows = row_count;
+        header.blocks = index.size();
+        header.index_offset = offset;
+        if (!index.empty()) {
+            out.write(reinterpret_cast<const char*>(index.data()), static_cast<std::streamsize>(index.size() * sizeof(ColumnBlock)));
+        }
+        out.seekp(0);
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        out.close();
+        if (!out) {
+            std::remove(temp_path.c_str());
+            return false;
+        }
+        std::remove(path.c_str());
+        return std::rename(temp_path.c_str(), path.c_str()) == 0;
+    }
+
+    long long rows() const { return static_cast<long long>(row_count); }
+    uint64_t size() const { return offset + index.size() * sizeof(ColumnBlock); }
+    size_t blocks() const { return index.size(); }
+};
+
+struct ColumnExportStats {
+    long long rows = 0;
+    size_t blocks = 0;
+    unsigned long long bytes = 0;
+    double seconds = 0;
+};
+
+// Снимки всех сегментов на одной раскладке корзин. Транзакции чтения
+// открываются, пока перенос корзин не может переключить корзину, как при
+// сверке; строки корзин, не закреплённых за сегментом, в снимок не входят.
+class ShardSnapshot {
+private:
+    std::vector<sqlite3*> connections;
+    std::vector<int> owners;
+    std::vector<std::unique_ptr<SqlTransaction>> reads;
+    bool active = false;
+
+public:
+    explicit ShardSnapshot(sqlite3* db) : connections(shard_connections(db)), owners(SHARD_BUCKETS, 0) {
+        ShardLease lease(db);
+        ShardRouter* router = ShardRouter::of(db);
+        for (int bucket = 0; bucket < SHARD_BUCKETS && router != nullptr; ++bucket) {
+            owners[bucket] = router->buckets().owner(bucket);
+        }
+        for (sqlite3* shard : connections) {
+            // Снимок фиксируется первым чтением внутри транзакции
+            reads.emplace_back(new SqlTransaction(shard, "BEGIN;"));
+            long long records = 0;
+            if (!reads.back()->started() || !MappedLedger::committed(shard, records)) {
+                std::cerr << "Ошибка чтения журнала: " << sqlite3_errmsg(shard) << std::endl;
+                return;
+            }
+        }
+        active = true;
+    }
+
+    bool started() const { return active; }
+    const std::vector<sqlite3*>& shards() const { return connections; }
+
+    bool owns(size_t shard, int user_id) const {
+        return user_id <= 0 || owners[(user_id - 1) % SHARD_BUCKETS] == static_cast<int>(shard);
+    }
+
+    // Снимки больше не нужны: сегменты снова видят новые записи
+    void release() { reads.clear(); }
+};
+
+// Выгружает журнал всех сегментов
+bool export_ledger_columns(sqlite3* db, const std::string& path, ColumnExportStats& stats) {
+    auto started = std::chrono::steady_clock::now();
+    ColumnarWriter writer(path);
+    if (!writer.started()) {
+        std::cerr << "Невозможно записать файл выгрузки: " << path << std::endl;
+        return false;
+    }
+
+    ShardSnapshot snapshot(db);
+    if (!snapshot.started()) {
+        return false;
+    }
+    const std::vector<sqlite3*>& shards = snapshot.shards();
+
+    MappedLedger* log = MappedLedger::of(db);
+    if (log != nullptr) {
+        long long records = 0;
+        MappedLedger::committed(db, records);
+        LedgerRecord record;
+        for (long long id = 1; id <= records; ++id) {
+            if (!log->read(id, record)) {
+                return false;
+            }
+            if (!writer.add(static_cast<int>(record.user_id), static_cast<LedgerType>(record.type), record.amount, record.timestamp)) {
+                std::cerr << "Ошибка записи файла выгрузки: " << path << std::endl;
+                return false;
+            }
+        }
+    }
+    for (size_t k = 0; k < shards.size() && log == nullptr; ++k) {
+        sqlite3* shard = shards[k];
+        CachedStatement stmt(shard,
+            "SELECT user_id, type, amount, CAST(strftime('%s', timestamp) AS INTEGER) FROM transactions ORDER BY id;");
+        if (!stmt) {
+            std::cerr << "Ошибка подготовки запроса: " << sqlite3_errmsg(shard) << std::endl;
+            return false;
+        }
+        int rc;
+        while ((rc = timed_step(stmt)) == SQLITE_ROW) {
+            int user_id = sqlite3_column_int(stmt, 0);
+            if (!snapshot.owns(k, user_id)) {
+                continue;
+            }
+            const unsigned char* type = sqlite3_column_text(stmt, 1);
+            if (!writer.add(user_id, ledger_type_code(type ? reinterpret_cast<const char*>(type) : ""),
+                    sqlite3_column_int64(stmt, 2), sqlite3_column_int64(stmt, 3))) {
+                std::cerr << "Ошибка записи файла выгрузки: " << path << std::endl;
+                return false;
+            }
+        }
+        if (rc != SQLITE_DONE) {
+            std::cerr << "Ошибка чтения журнала: " << sqlite3_errmsg(shard) << std::endl;
+            return false;
+        }
+    }
+    snapshot.release();
+
+    if (!writer.finish()) {
+        std::cerr << "Ошибка записи файла выгрузки: " << path << std::endl;
+        return false;
+    }
+    stats.rows = writer.rows();
+    stats.blocks = writer.blocks();
+    stats.bytes = writer.size();
+    stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+    return true;
+}
+
+// Фильтр отчёта: время в секундах UTC, включительно; user_id = 0 - все счета
+struct ColumnFilter {
+    long long from = std::numeric_limits<long long>::min();
+    long long to = std::numeric_limits<long long>::max();
+    int user_id = 0;
+};
+
+struct ColumnSummary {
+    long long rows = 0;
+    long long counts[5] = {};       // по кодам LedgerType
+    Money sums[5] = {};
+    size_t blocks_read = 0;
+    size_t blocks_skipped = 0;
+    double seconds = 0;
+};
+
+// Чтение файла столбцов: оглавление загружается при открытии, столбцы блоков -
+// по запросу
+class ColumnarLedger {
+private:
+    std::ifstream in;
+    ColumnFileHeader header = {};
+    std::vector<ColumnBlock> index;
+    std::string buffer;
+    bool ready = false;
+
+public:
+    explicit ColumnarLedger(const std::string& path) : in(path, std::ios::binary) {
+        if (!in.read(reinterpret_cast<char*>(&header), sizeof(header))
+            || std::memcmp(header.magic, COLUMN_FILE_MAGIC, sizeof(header.magic)) != 0
+            || header.version != COLUMN_FILE_VERSION) {
+            std::cerr << "Файл " << path << " не является выгрузкой журнала по столбцам" << std::endl;
+            return;
+        }
+        // Размеры из файла сверяются с его длиной до выделения памяти под них:
+        // у обрезанного или повреждённого снимка они могут быть любыми
+        in.seekg(0, std::ios::end);
+        uint64_t file_size = static_cast<uint64_t>(in.tellg());
+        if (header.index_offset > file_size
+            || header.blocks > (file_size - header.index_offset) / sizeof(ColumnBlock)) {
+            std::cerr << "Оглавление файла " << path << " повреждено" << std::endl;
+            return;
+        }
+        index.resize(static_cast<size_t>(header.blocks));
+        in.seekg(static_cast<std::streamoff>(header.index_offset));
+        if (!index.empty() && !in.read(reinterpret_cast<char*>(index.data()),
+                static_cast<std::streamsize>(index.size() * sizeof(ColumnBlock)))) {
+            std::cerr << "Оглавление файла " << path << " повреждено" << std::endl;
+            return;
+        }
+        // Каждое значение столбца занимает хотя бы байт, поэтому строк в блоке
+        // не больше, чем байт в любом его столбце
+        for (size_t b = 0; b < index.size(); ++b) {
+            for (const ColumnChunk& chunk : index[b].columns) {
+                if (chunk.offset > file_size || chunk.size > file_size - chunk.offset || index[b].rows > chunk.size) {
+                    std::cerr << "Оглавление файла " << path << " повреждено: неверные размеры блока " << b << std::endl;
+                    return;
+                }
+            }
+        }
+        ready = true;
+    }
+
+    bool started() const { return ready; }
+    long long rows() const { return static_cast<long long>(header.rows); }
+    size_t blocks() const { return index.size(); }
+    const ColumnBlock& block(size_t i) const { return index[i]; }
+
+    bool read_column(size_t block, LedgerColumn column, std::vector<int64_t>& values) {
+        const ColumnBlock& info = index[block];
+        const ColumnChunk& chunk = info.columns[static_cast<int>(column)];
+        buffer.resize(static_cast<size_t>(chunk.size));
+        in.seekg(static_cast<std::streamoff>(chunk.offset));
+        if (!in.read(&buffer[0], static_cast<std::streamsize>(buffer.size()))
+            || !decode_column(buffer, static_cast<size_t>(info.rows), column, chunk.min, values)) {
+            std::cerr << "Столбец " << LEDGER_COLUMN_NAMES[static_cast<int>(column)] << " блока " << block
+                << " повреждён" << std::endl;
+            in.clear();
+            return false;
+        }
+        return true;
+    }
+
+    // Число и сумма записей по типам. Блоки, которые по минимуму и максимуму
+    // не попадают под фильтр, не читаются; столбцы времени и счёта читаются,
+    // только если блок попадает под фильтр не целиком. Строки отбираются маской,
+    // суммы по каждому типу считаются отдельным проходом без ветвлений,
+    // который компилятор разворачивает в векторные инструкции.
+    bool summarize(const ColumnFilter& filter, ColumnSummary& summary) {
+        auto started = std::chrono::steady_clock::now();
+        summary = ColumnSummary();
+        std::vector<int64_t> times, users, types, amounts, mask;
+        for (size_t b = 0; b < index.size(); ++b) {
+            const ColumnChunk& time = index[b].columns[static_cast<int>(LedgerColumn::Timestamp)];
+            const ColumnChunk& user = index[b].columns[static_cast<int>(LedgerColumn::UserId)];
+            if (time.max < filter.from || time.min > filter.to
+                || (filter.user_id != 0 && (filter.user_id < user.min || filter.user_id > user.max))) {
+                ++summary.blocks_skipped;
+                continue;
+            }
+            ++summary.blocks_read;
+
+            size_t rows = static_cast<size_t>(index[b].rows);
+            if (!read_column(b, LedgerColumn::Type, types) || !read_column(b, LedgerColumn::Amount, amounts)) {
+                return false;
+            }
+            mask.assign(rows, 1);
+            if (time.min < filter.from || time.max > filter.to) {
+                if (!read_column(b, LedgerColumn::Timestamp, times)) {
+                    return false;
+                }
+                for (size_t i = 0; i < rows; ++i) {
+                    mask[i] = (times[i] >= filter.from) & (times[i] <= filter.to);
+                }
+            }
+            if (filter.user_id != 0 && (user.min != filter.user_id || user.max != filter.user_id)) {
+                if (!read_column(b, LedgerColumn::UserId, users)) {
+                    return false;
+                }
+                for (size_t i = 0; i < rows; ++i) {
+                    mask[i] &= static_cast<int64_t>(users[i] == filter.user_id);
+                }
+            }
+
+            for (int type = 0; type < 5; ++type) {
+                int64_t count = 0;
+                int64_t sum = 0;
+                for (size_t i = 0; i < rows; ++i) {
+                    int64_t hit = mask[i] & static_cast<int64_t>(types[i] == type);
+                    count += hit;
+                    sum += hit * amounts[i];
+                }
+                summary.counts[type] += count;
+                summary.sums[type] += sum;
+                summary.rows += count;
+            }
+        }
+        summary.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+        return true;
+    }
+};
+
+void print_column_summary(const ColumnSummary& summary) {
+    std::cout << "\n=== Отчёт по журналу ===\n";
+    std::cout << "Записей: " << summary.rows << ", блоков прочитано: " << summary.blocks_read
+        << ", пропущено: " << summary.blocks_skipped << ", время: "
+        << std::fixed << std::setprecision(3) << summary.seconds << " с\n";
+    Money net = 0;
+    for (int type = 0; type < 5; ++type) {
+        if (summary.counts[type] == 0) {
+            continue;
+        }
+        LedgerType code = static_cast<LedgerType>(type);
+        std::cout << std::left << std::setw(16) << ledger_type_name(code) << std::right
+            << " записей: " << std::setw(12) << summary.counts[type]
+            << " сумма: " << format_money(summary.sums[type]) << "\n";
+        net += ledger_sign(code) * summary.sums[type];
+    }
+    std::cout << "Изменение балансов: " << format_money(net) << "\n";
+}
+
+// ConsoleApplication1 --ledger-report <файл> [с YYYY-MM-DD] [по YYYY-MM-DD] [счёт]
+int run_ledger_report(const std::string& path, const std::string& from, const std::string& to, int user_id) {
+    ColumnFilter filter;
+    filter.user_id = user_id;
+    if ((!from.empty() && !parse_utc(from, filter.from)) || (!to.empty() && !parse_utc(to, filter.to))) {
+        std::cerr << "Дата задаётся как YYYY-MM-DD или \"YYYY-MM-DD HH:MM:SS\"" << std::endl;
+        return 1;
+    }
+    // Дата без времени включает весь день
+    if (to.size() == 10) {
+        filter.to += 24 * 3600 - 1;
+    }
+
+    ColumnarLedger ledger(path);
+    ColumnSummary summary;
+    if (!ledger.started() || !ledger.summarize(filter, summary)) {
+        return 1;
+    }
+    print_column_summary(summary);
+    return 0;
+}
+
+// ---- Выгрузка в CSV и JSON ----
+// Счета и журнал выгружаются для хранилища данных прямо из курсора запроса
+// (или из бинарного журнала) в буфер EXPORT_BUFFER_BYTES, который уходит в
+// файл крупными блоками. Числа и время пишутся в буфер без промежуточных
+// строк, текст экранируется по месту, поэтому память не зависит от размера
+// журнала. JSON пишется построчно, по объекту на строку (JSON Lines).
+// Сегменты выгружаются по очереди: внутри сегмента строки идут в порядке id,
+// а при фильтре по счёту или времени - в порядке индекса (timestamp, id),
+// чтобы SQLite не сортировал результат. Номера записей журнала уникальны
+// только внутри сегмента. Пароли не выгружаются.
+
+const size_t EXPORT_BUFFER_BYTES = 1 << 20;
+
+const char* const EXPORT_TRANSACTION_COLUMNS[] = { "id", "user_id", "type", "amount", "timestamp", "description", "balance_after" };
+const char* const EXPORT_USER_COLUMNS[] = { "id", "first_name", "last_name", "cash", "status" };
+
+enum class ExportFormat { Csv, Json };
+
+class ExportWriter {
+private:
+    std::ostream& out;
+    std::vector<char> buffer;
+    size_t used = 0;
+    unsigned long long drained = 0;
+
+    void drain() {
+        out.write(buffer.data(), static_cast<std::streamsize>(used));
+        drained += used;
+        used = 0;
+    }
+
+    // Число из width цифр с ведущими нулями
+    void put_digits(unsigned value, int width) {
+        char digits[10];
+        for (int k = width - 1; k >= 0; --k) {
+            digits[k] = static_cast<char>('0' + value % 10);
+            value /= 10;
+        }
+        put(digits, static_cast<size_t>(width));
+    }
+
+public:
+    explicit ExportWriter(std::ostream& stream) : out(stream), buffer(EXPORT_BUFFER_BYTES) {}
+
+    ExportWriter(const ExportWriter&) = delete;
+    ExportWriter& operator=(const ExportWriter&) = delete;
+
+    void put(char c) {
+        if (used == buffer.size()) {
+            drain();
+        }
+        buffer[used++] = c;
+    }
+
+    void put(const char* text, size_t size) {
+        if (size > buffer.size() - used) {
+            drain();
+            if (size >= buffer.size()) {
+                out.write(text, static_cast<std::streamsize>(size));
+                drained += size;
+                return;
+            }
+        }
+        std::memcpy(buffer.data() + used, text, size);
+        used += size;
+    }
+
+    void put(const char* text) { put(text, std::strlen(text)); }
+
+    // Десятичная запись прямо в буфер, без локали и промежуточной строки
+    void put_int(long long value) {
+        char digits[24];
+        std::to_chars_result written = std::to_chars(digits, digits + sizeof(digits), value);
+        put(digits, static_cast<size_t>(written.ptr - digits));
+    }
+
+    // Рубли с копейками, как format_money
+    void put_money(Money amount) {
+        Money magnitude = amount < 0 ? -amount : amount;
+        if (amount < 0) {
+            put('-');
+        }
+        put_int(magnitude / KOPECKS_PER_RUBLE);
+        put('.');
+        put_digits(static_cast<unsigned>(magnitude % KOPECKS_PER_RUBLE), 2);
+    }
+
+    // "YYYY-MM-DD HH:MM:SS" в UTC, как format_utc
+    void put_time(long long seconds) {
+        std::time_t at = static_cast<std::time_t>(seconds);
+        std::tm parts = {};
+#ifdef _WIN32
+        gmtime_s(&parts, &at);
+#else
+        gmtime_r(&at, &parts);
+#endif
+        put_digits(static_cast<unsigned>(parts.tm_year + 1900), 4);
+        put('-');
+        put_digits(static_cast<unsigned>(parts.tm_mon + 1), 2);
+        put('-');
+        put_digits(static_cast<unsigned>(parts.tm_mday), 2);
+        put(' ');
+        put_digits(static_cast<unsigned>(parts.tm_hour), 2);
+        put(':');
+        put_digits(static_cast<unsigned>(parts.tm_min), 2);
+        put(':');
+        put_digits(static_cast<unsigned>(parts.tm_sec), 2);
+    }
+
+    // Поле CSV по RFC 4180: в кавычках, только если в нём есть запятая,
+    // кавычка или перевод строки; кавычка внутри удваивается
+    void put_csv(const char* text, size_t size) {
+        bool quoted = false;
+        for (size_t k = 0; k < size && !quoted; ++k) {
+            char c = text[k];
+            quoted = c == ',' || c == '"' || c == '\n' || c == '\r';
+        }
+        if (!quoted) {
+            put(text, size);
+            return;
+        }
+        put('"');
+        size_t start = 0;
+        for (size_t k = 0; k < size; ++k) {
+            if (text[k] == '"') {
+                // Кавычка попадает и в конец этого куска, и в начало следующего
+                put(text + start, k + 1 - start);
+                start = k;
+            }
+        }
+        put(text + start, size - start);
+        put('"');
+    }
+
+    void put_json(const char* text, size_t size) {
+        static const char HEX[] = "0123456789abcdef";
+        put('"');
+        size_t start = 0;
+        for (size_t k = 0; k < size; ++k) {
+            unsigned char c = static_cast<unsigned char>(text[k]);
+            if (c >= 0x20 && c != '"' && c != '\\') {
+                continue;
+            }
+            put(text + start, k - start);
+            start = k + 1;
+            put('\\');
+            switch (c) {
+            case '"': put('"'); break;
+            case '\\': put('\\'); break;
+            case '\n': put('n'); break;
+            case '\r': put('r'); break;
+            case '\t': put('t'); break;
+            default:
+                put("u00", 3);
+                put(HEX[c >> 4]);
+                put(HEX[c & 15]);
+            }
+        }
+        put(text + start, size - start);
+        put('"');
+    }
+
+    bool finish() {
+        drain();
+        out.flush();
+        return good();
+    }
+
+    bool good() const { return static_cast<bool>(out); }
+    unsigned long long bytes() const { return drained + used; }
+};
+
+// Строки таблицы выгрузки: поля пишутся по порядку столбцов, о формате
+// знает только этот класс. Для CSV первой строкой идут имена столбцов.
+class ExportTable {
+private:
+    ExportWriter& out;
+    ExportFormat format;
+    const char* const* names;
+    int field = 0;
+    long long row_count = 0;
+
+    void next() {
+        if (format == ExportFormat::Csv) {
+            if (field > 0) {
+                out.put(',');
+            }
+        }
+        else {
+            out.put(field == 0 ? "{\"" : ",\"");
+            out.put(names[field]);
+            out.put("\":", 2);
+        }
+        ++field;
+    }
+
+public:
+    ExportTable(ExportWriter& writer, ExportFormat output, const char* const* columns, int count)
+        : out(writer), format(output), names(columns) {
+        if (format == ExportFormat::Csv) {
+            for (int k = 0; k < count; ++k) {
+                if (k > 0) {
+                    out.put(',');
+                }
+                out.put(columns[k]);
+            }
+            out.put('\n');
+        }
+    }
+
+    void integer(long long value) {
+        next();
+        out.put_int(value);
+    }
+
+    void money(Money amount) {
+        next();
+        out.put_money(amount);
+    }
+
+    void text(const char* value, size_t size) {
+        next();
+        if (format == ExportFormat::Csv) {
+            out.put_csv(value, size);
+        }
+        else {
+            out.put_json(value, size);
+        }
+    }
+
+    void text(const unsigned char* value, int size) {
+        text(reinterpret_cast<const char*>(value), static_cast<size_t>(size));
+    }
+
+    void time(long long seconds) {
+        next();
+        bool quoted = format == ExportFormat::Json;
+        if (quoted) out.put('"');
+        out.put_time(seconds);
+        if (quoted) out.put('"');
+    }
+
+    // Пустое поле в CSV, null в JSON
+    void null() {
+        next();
+        if (format == ExportFormat::Json) {
+            out.put("null", 4);
+        }
+    }
+
+    // false - запись в файл не удалась
+    bool end() {
+        out.put(format == ExportFormat::Json ? "}\n" : "\n");
+        field = 0;
+        ++row_count;
+        return out.good();
+    }
+
+    long long rows() const { return row_count; }
+};
+
+// Что выгружать; время в секундах UTC, включительно
+struct ExportRequest {
+    bool users = false;             // счета вместо журнала
+    ExportFormat format = ExportFormat::Csv;
+    std::string path = "-";         // "-" - стандартный вывод
+    int user_id = 0;                // 0 - все счета
+    std::string type;               // пусто - все типы записей
+    long long from = std::numeric_limits<long long>::min();
+    long long to = std::numeric_limits<long long>::max();
+
+    bool by_time() const {
+        return from != std::numeric_limits<long long>::min() || to != std::numeric_limits<long long>::max();
+    }
+};
+
+struct ExportStats {
+    long long rows = 0;
+    unsigned long long bytes = 0;
+    double seconds = 0;
+};
+
+// ConsoleApplication1 --export <transactions | users> <csv | json> [файл | -]
+//     [--user счёт] [--type тип] [--from YYYY-MM-DD] [--to YYYY-MM-DD]
+bool parse_export_request(int argc, char* argv[], ExportRequest& request) {
+    const char* usage = "Использование: --export <transactions | users> <csv | json> [файл | -] "
+        "[--user счёт] [--type тип] [--from YYYY-MM-DD] [--to YYYY-MM-DD]";
+    std::string table = (argc >= 3) ? argv[2] : "";
+    std::string format = (argc >= 4) ? argv[3] : "";
+    if ((table != "transactions" && table != "users") || (format != "csv" && format != "json")) {
+        std::cerr << usage << std::endl;
+        return false;
+    }
+    request.users = table == "users";
+    request.format = (format == "json") ? ExportFormat::Json : ExportFormat::Csv;
+
+    int arg = 4;
+    if (arg < argc && std::strncmp(argv[arg], "--", 2) != 0) {
+        request.path = argv[arg++];
+    }
+    for (; arg < argc; arg += 2) {
+        std::string option = argv[arg];
+        if (arg + 1 >= argc) {
+            std::cerr << usage << std::endl;
+            return false;
+        }
+        std::string value = argv[arg + 1];
+        if (option == "--user") {
+            request.user_id = std::atoi(value.c_str());
+            if (request.user_id <= 0) {
+                std::cerr << "Номер счёта должен быть положительным: " << value << std::endl;
+                return false;
+            }
+        }
+        else if (option == "--type" && !request.users) {
+            if (ledger_type_code(value) == LedgerType::Unknown) {
+                std::cerr << "Неизвестный тип записи: " << value
+                    << " (deposit, transfer_in, transfer_out, admin_increase)" << std::endl;
+                return false;
+            }
+            request.type = value;
+        }
+        else if ((option == "--from" || option == "--to") && !request.users) {
+            long long& bound = (option == "--from") ? request.from : request.to;
+            if (!parse_utc(value, bound)) {
+                std::cerr << "Дата задаётся как YYYY-MM-DD или \"YYYY-MM-DD HH:MM:SS\"" << std::endl;
+                return false;
+            }
+            // Дата без времени включает весь день
+            if (option == "--to" && value.size() == 10) {
+                bound += 24 * 3600 - 1;
+            }
+        }
+        else {
+            std::cerr << "Неизвестный параметр выгрузки " << option
+                << (request.users ? " (для счетов есть только --user)" : "") << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool export_failed(const char* what, sqlite3* db) {
+    if (db != nullptr) {
+        std::cerr << what << ": " << sqlite3_errmsg(db) << std::endl;
+    }
+    else {
+        std::cerr << what << std::endl;
+    }
+    return false;
+}
+
+// Журнал одного счёта (--user) выгружается по его цепочке записей, весь
+// журнал - подряд по номерам записей
+static bool export_ledger_records(sqlite3* db, const ExportRequest& request, ExportTable& table) {
+    MappedLedger* log = MappedLedger::of(db);
+    LedgerType type = request.type.empty() ? LedgerType::Unknown : ledger_type_code(request.type);
+    auto emit = [&](const LedgerRecord& record) {
+        if ((type != LedgerType::Unknown && record.type != static_cast<uint8_t>(type))
+            || record.timestamp < request.from || record.timestamp > request.to) {
+            return true;
+        }
+        table.integer(record.id);
+        table.integer(record.user_id);
+        const char* name = ledger_type_name(static_cast<LedgerType>(record.type));
+        table.text(name, std::strlen(name));
+        table.money(record.amount);
+        table.time(record.timestamp);
+        table.text(record.description, record.description_size);
+        if (record.has_balance) {
+            table.money(record.balance_after);
+        }
+        else {
+            table.null();
+        }
+        return table.end() || export_failed("Ошибка записи файла выгрузки", nullptr);
+    };
+
+    if (request.user_id > 0) {
+        return log->ascending(db, request.user_id, emit);
+    }
+    long long records = 0;
+    if (!MappedLedger::committed(db, records)) {
+        return export_failed("Ошибка чтения журнала", db);
+    }
+    LedgerRecord record;
+    for (long long id = 1; id <= records; ++id) {
+        if (!log->read(id, record) || !emit(record)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool export_transaction_rows(sqlite3* shard, size_t k, const ShardSnapshot& snapshot,
+    const ExportRequest& request, ExportTable& table) {
+    std::string sql = "SELECT id, user_id, type, amount, timestamp, description, balance_after FROM transactions WHERE 1";
+    if (request.user_id > 0) sql += " AND user_id = ?1";
+    if (!request.type.empty()) sql += " AND type = ?2";
+    if (request.from != std::numeric_limits<long long>::min()) sql += " AND timestamp >= ?3";
+    if (request.to != std::numeric_limits<long long>::max()) sql += " AND timestamp <= ?4";
+    sql += (request.user_id > 0 || request.by_time()) ? " ORDER BY timestamp, id;" : " ORDER BY id;";
+
+    CachedStatement stmt(shard, sql.c_str());
+    if (!stmt) {
+        return export_failed("Ошибка подготовки запроса", shard);
+    }
+    if (request.user_id > 0) sqlite3_bind_int(stmt, 1, request.user_id);
+    if (!request.type.empty()) sqlite3_bind_text(stmt, 2, request.type.c_str(), -1, SQLITE_TRANSIENT);
+    // Время в журнале - текст "YYYY-MM-DD HH:MM:SS", он сравнивается как строка
+    if (request.from != std::numeric_limits<long long>::min()) {
+        sqlite3_bind_text(stmt, 3, format_utc(request.from).c_str(), -1, SQLITE_TRANSIENT);
+    }
+    if (request.to != std::numeric_limits<long long>::max()) {
+        sqlite3_bind_text(stmt, 4, format_utc(request.to).c_str(), -1, SQLITE_TRANSIENT);
+    }
+
+    int rc;
+    while ((rc = timed_step(stmt)) == SQLITE_ROW) {
+        int user_id = sqlite3_column_int(stmt, 1);
+        if (!snapshot.owns(k, user_id)) {
+            continue;
+        }
+        table.integer(sqlite3_column_int64(stmt, 0));
+        table.integer(user_id);
+        for (int column = 2; column < 7; ++column) {
+            if (sqlite3_column_type(stmt, column) == SQLITE_NULL) {
+                table.null();
+            }
+            else if (column == 3 || column == 6) {
+                table.money(sqlite3_column_int64(stmt, column));
+            }
+            else {
+                // Указатель на текст действует до следующего шага курсора
+                const unsigned char* text = sqlite3_column_text(stmt, column);
+                table.text(text, sqlite3_column_bytes(stmt, column));
+            }
+        }
+        if (!table.end()) {
+            return export_failed("Ошибка записи файла выгрузки", nullptr);
+        }
+    }
+    if (rc != SQLITE_DONE) {
+        return export_failed("Ошибка чтения журнала", shard);
+    }
+    return true;
+}
+
+static bool export_user_rows(sqlite3* shard, size_t k, const ShardSnapshot& snapshot,
+    const ExportRequest& request, ExportTable& table) {
+    CachedStatement stmt(shard, request.user_id > 0
+        ? "SELECT id, first_name, last_name, cash, status FROM users WHERE id = ?;"
+        : "SELECT id, first_name, last_name, cash, status FROM users ORDER BY id;");
+    if (!stmt) {
+        return export_failed("Ошибка подготовки запроса", shard);
+    }
+    if (request.user_id > 0) {
+        sqlite3_bind_int(stmt, 1, request.user_id);
+    }
+
+    int rc;
+    while ((rc = timed_step(stmt)) == SQLITE_ROW) {
+        int user_id = sqlite3_column_int(stmt, 0);
+        if (!snapshot.owns(k, user_id)) {
+            continue;
+        }
+        table.integer(user_id);
+        table.text(sqlite3_column_text(stmt, 1), sqlite3_column_bytes(stmt, 1));
+        table.text(sqlite3_column_text(stmt, 2), sqlite3_column_bytes(stmt, 2));
+        table.money(sqlite3_column_int64(stmt, 3));
+        AccountStatus status = column_status(stmt, 4);
+        if (status == AccountStatus::Active) {
+            table.null();
+        }
+        else {
+            const char* name = status_name(status);
+            table.text(name, std::strlen(name));
+        }
+        if (!table.end()) {
+            return export_failed("Ошибка записи файла выгрузки", nullptr);
+        }
+    }
+    if (rc != SQLITE_DONE) {
+        return export_failed("Ошибка чтения счетов", shard);
+    }
+    return true;
+}
+
+// Выгружает строки всех сегментов с одного снимка. Файл пишется под
+// временным именем и переименовывается в конце, поэтому загрузчик хранилища
+// не увидит недописанную выгрузку.
+bool export_rows(sqlite3* db, const ExportRequest& request, ExportStats& stats) {
+    auto started = std::chrono::steady_clock::now();
+    bool to_stdout = request.path == "-";
+    std::string temp_path = request.path + ".tmp";
+    std::ofstream file;
+    if (!to_stdout) {
+        file.open(temp_path, std::ios::binary | std::ios::trunc);
+        if (!file) {
+            std::cerr << "Невозможно записать файл выгрузки: " << request.path << std::endl;
+            return false;
+        }
+    }
+
+    ExportWriter writer(to_stdout ? std::cout : file);
+    bool ok;
+    {
+        ShardSnapshot snapshot(db);
+        ok = snapshot.started();
+        ExportTable table(writer, request.format,
+            request.users ? EXPORT_USER_COLUMNS : EXPORT_TRANSACTION_COLUMNS, request.users ? 5 : 7);
+        if (ok && !request.users && MappedLedger::of(db) != nullptr) {
+            ok = export_ledger_records(db, request, table);
+        }
+        else {
+            const std::vector<sqlite3*>& shards = snapshot.shards();
+            for (size_t k = 0; ok && k < shards.size(); ++k) {
+                ok = request.users ? export_user_rows(shards[k], k, snapshot, request, table)
+                    : export_transaction_rows(shards[k], k, snapshot, request, table);
+            }
+        }
+        stats.rows = table.rows();
+    }
+    if (!writer.finish() && ok) {
+        ok = export_failed("Ошибка записи файла выгрузки", nullptr);
+    }
+    stats.bytes = writer.bytes();
+
+    if (!to_stdout) {
+        file.close();
+        if (ok && !file) {
+            ok = export_failed("Ошибка записи файла выгрузки", nullptr);
+        }
+        if (!ok) {
+            std::remove(temp_path.c_str());
+            return false;
+        }
+        std::remove(request.path.c_str());
+        if (std::rename(temp_path.c_str(), request.path.c_str()) != 0) {
+            std::cerr << "Невозможно переименовать файл выгрузки в " << request.path << std::endl;
+            return false;
+        }
+    }
+    stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+    return ok;
+}
+
+// ---- Перенос корзин между сегментами ----
+// Корзина переезжает в другой файл, пока сервис продолжает работать:
+//  1. в shard_moves основного файла отмечается начало переноса;
+//  2. счета корзины и их журнал копируются в новый сегмент порциями, каждая
+//     в своей транзакции. Журнал только дописывается, и зафиксированные записи
+//     всегда занимают id подряд, поэтому наибольший id на момент копирования
+//     отделяет скопированное от того, что появится позже;
+//  3. новые записи журнала докопируются, пока их набирается хотя бы порция;
+//  4. на короткой паузе (ShardMap::Pause) докопируется остаток журнала, счета
+//     корзины копируются заново со свежими балансами и статусами, и корзина
+//     закрепляется за новым сегментом;
+//  5. строки корзины удаляются из старого сегмента, запись из shard_moves - тоже.
+// Копии в новом сегменте до переключения и остатки в старом после него
+// не видны: маршрутизатор учитывает строки только сегмента-владельца.
+// После сбоя resume_moves удаляет недокопированное или недоудалённое.
+//
+// Таблицу корзин держит в памяти каждый процесс, поэтому переносить можно
+// только из процесса, который обслуживает клиентов: из меню, командой
+// REBALANCE сервера или --rebalance, пока сервер остановлен.
+
+const int REBALANCE_CHUNK = 1024;
+const int REBALANCE_CATCH_UP_PASSES = 8;
+
+struct RebalanceStatus {
+    int from = 0;
+    int to = 0;
+    int buckets = 0;            // корзин в задании
+    int moved = 0;
+    int current = -1;           // корзина, которая переносится сейчас
+    long long users = 0;        // скопировано счетов
+    long long rows = 0;         // скопировано записей журнала
+    double seconds = 0;
+    double max_pause_ms = 0;    // самая долгая пауза переключения
+    bool running = false;
+    bool failed = false;
+};
+
+// Вызывается после каждой порции; false - прервать перенос
+typedef std::function<bool(const RebalanceStatus&)> RebalanceReport;
+
+std::string describe_rebalance(const RebalanceStatus& status) {
+    std::ostringstream out;
+    out << "сегмент " << status.from << " -> " << status.to
+        << ": корзин " << status.moved << "/" << status.buckets
+        << ", счетов " << status.users << ", записей журнала " << status.rows;
+    if (status.seconds > 0) {
+        out << ", " << static_cast<long long>(status.rows / status.seconds) << " записей/с";
+    }
+    out << ", пауза до " << std::fixed << std::setprecision(1) << status.max_pause_ms << " мс";
+    if (status.failed) {
+        out << ", ошибка";
+    }
+    else if (!status.running && status.buckets > 0) {
+        out << ", завершён";
+    }
+    return out.str();
+}
+
+// Наибольший id среди счетов и владельцев записей журнала сегмента
+static bool max_user_id(sqlite3* db, int& high) {
+    CachedStatement stmt(db,
+        "SELECT max(coalesce((SELECT max(id) FROM users), 0), coalesce((SELECT max(user_id) FROM transactions), 0));");
+    if (!stmt || timed_step(stmt) != SQLITE_ROW) {
+        std::cerr << "Ошибка чтения диапазона id: " << sqlite3_errmsg(db) << std::endl;
+        return false;
+    }
+    high = sqlite3_column_int(stmt, 0);
+    return true;
+}
+
+static bool max_ledger_id(sqlite3* db, long long& high) {
+    CachedStatement stmt(db, "SELECT coalesce(max(id), 0) FROM transactions;");
+    if (!stmt || timed_step(stmt) != SQLITE_ROW) {
+        std::cerr << "Ошибка чтения журнала: " << sqlite3_errmsg(db) << std::endl;
+        return false;
+    }
+    high = sqlite3_column_int64(stmt, 0);
+    return true;
+}
+
+// Вставляет в target запись журнала из первых шести столбцов row. id записи
+// назначает target: в каждом файле своя последовательность.
+static bool insert_ledger_copy(sqlite3* target, sqlite3_stmt* row) {
+    CachedStatement insert(target,
+        "INSERT INTO transactions (user_id, type, amount, timestamp, description, balance_after) VALUES (?, ?, ?, ?, ?, ?);");
+    if (!insert) {
+        std::cerr << "Ошибка подготовки запроса: " << sqlite3_errmsg(target) << std::endl;
+        return false;
+    }
+    for (int column = 0; column < 6; ++column) {
+        sqlite3_bind_value(insert, column + 1, sqlite3_column_value(row, column));
+    }
+    if (timed_step(insert) != SQLITE_DONE) {
+        std::cerr << "Ошибка копирования записи журнала: " << sqlite3_errmsg(target) << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Удаляет счета корзины и их журнал из сегмента порциями по REBALANCE_CHUNK счетов
+static bool purge_bucket(sqlite3* db, int bucket) {
+    int high = 0;
+    if (!max_user_id(db, high)) {
+        return false;
+    }
+    for (int user_id = bucket + 1; user_id <= high;) {
+        SqlTransaction txn(db);
+        CachedStatement ledger(db, "DELETE FROM transactions WHERE user_id = ?;");
+        CachedStatement users(db, "DELETE FROM users WHERE id = ?;");
+        if (!txn.started() || !ledger || !users) {
+            std::cerr << "Ошибка подготовки запроса: " << sqlite3_errmsg(db) << std::endl;
+            return false;
+        }
+        for (int n = 0; n < REBALANCE_CHUNK && user_id <= high; ++n, user_id += SHARD_BUCKETS) {
+            sqlite3_bind_int(ledger, 1, user_id);
+            sqlite3_bind_int(users, 1, user_id);
+            if (timed_step(ledger) != SQLITE_DONE || timed_step(users) != SQLITE_DONE) {
+                std::cerr << "Ошибка удаления счёта " << user_id << ": " << sqlite3_errmsg(db) << std::endl;
+                return false;
+            }
+            sqlite3_reset(ledger);
+            sqlite3_reset(users);
+        }
+        if (!txn.commit()) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Завершает переносы, прерванные сбоем или ошибкой: до переключения копии
+// удаляются из нового сегмента, после - остатки из старого
+bool resume_moves(sqlite3* db) {
+    ShardRouter* router = ShardRouter::of(db);
+    if (router == nullptr) {
+        return true;
+    }
+    sqlite3* directory = router->connection(0);
+
+    struct Move {
+        int bucket;
+        int stale;      // сегмент, из которого нужно удалить строки корзины
+    };
+    std::vector<Move> moves;
+    {
+        CachedStatement stmt(directory,
+            "SELECT bucket, CASE WHEN switched THEN from_shard ELSE to_shard END FROM shard_moves ORDER BY bucket;");
+        if (!stmt) {
+            std::cerr << "Ошибка подготовки запроса: " << sqlite3_errmsg(directory) << std::endl;
+            return false;
+        }
+        while (timed_step(stmt) == SQLITE_ROW) {
+            moves.push_back({ sqlite3_column_int(stmt, 0), sqlite3_column_int(stmt, 1) });
+        }
+    }
+
+    for (const Move& move : moves) {
+        if (move.stale < 0 || move.stale >= static_cast<int>(router->size())
+            || router->buckets().owner(move.bucket) == move.stale) {
+            std::cerr << "Запись о переносе корзины " << move.bucket << " не согласуется с таблицей корзин" << std::endl;
+            return false;
+        }
+        if (!purge_bucket(router->connection(move.stale), move.bucket)) {
+            return false;
+        }
+        CachedStatement done(directory, "DELETE FROM shard_moves WHERE bucket = ?;");
+        if (!done) {
+            std::cerr << "Ошибка подготовки запроса: " << sqlite3_errmsg(directory) << std::endl;
+            return false;
+        }
+        sqlite3_bind_int(done, 1, move.bucket);
+        if (timed_step(done) != SQLITE_DONE) {
+            std::cerr << "Ошибка записи о переносе: " << sqlite3_errmsg(directory) << std::endl;
+            return false;
+        }
+        std::clog << "Корзина " << move.bucket << ": прерванный перенос завершён" << std::endl;
+    }
+    return true;
 }
 
-void user_menu(sqlite3* db, int user_id) {
-    std::string choice;
-
-    do {
-        system("cls");
-        std::cout << "----- Меню пользователя -----" << std::endl;
-        std::cout << "1 - Показать баланс" << std::endl;
-        std::cout << "2 - Пополнение баланса через банкомат" << std::endl;
-        std::cout << "3 - Перевод пользователю" << std::endl;
-        std::cout << "4 - Показать транзакции" << std::endl;
-        std::cout << "5 - Выйти" << std::endl;
-        std::cout << ">> ";
-        std::cin >> choice;
+class BucketMover {
+private:
+    ShardRouter& router;
+    sqlite3* source;
+    sqlite3* target;
+    RebalanceStatus& status;
+    const RebalanceReport& report;
+    std::chrono::steady_clock::time_point started = std::chrono::steady_clock::now();
+    std::chrono::steady_clock::time_point logged = started;
+
+    // Ход переноса пишется в журнал не чаще раза в секунду и после каждой корзины
+    bool publish(bool milestone = false) {
+        auto now = std::chrono::steady_clock::now();
+        status.seconds = std::chrono::duration<double>(now - started).count();
+        if (milestone || now - logged >= std::chrono::seconds(1)) {
+            std::clog << "Перенос корзин: " << describe_rebalance(status) << std::endl;
+            logged = now;
+        }
+        return !report || report(status);
+    }
 
-        if (choice == "1") {
-            show_balance(db, user_id);
+    bool begin(int bucket) {
+        CachedStatement stmt(router.connection(0),
+            "INSERT INTO shard_moves (bucket, from_shard, to_shard) VALUES (?, ?, ?);");
+        if (!stmt) {
+            std::cerr << "Ошибка подготовки запроса: " << sqlite3_errmsg(router.connection(0)) << std::endl;
+            return false;
         }
-        else if (choice == "2") {
-            deposit_balance(db, user_id);
+        sqlite3_bind_int(stmt, 1, bucket);
+        sqlite3_bind_int(stmt, 2, status.from);
+        sqlite3_bind_int(stmt, 3, status.to);
+        if (timed_step(stmt) != SQLITE_DONE) {
+            std::cerr << "Ошибка записи о переносе: " << sqlite3_errmsg(router.connection(0)) << std::endl;
+            return false;
         }
-        else if (choice == "3") {
-            const char* statusSQL = "SELECT status FROM users WHERE id = ?;";
-            sqlite3_stmt* stmt;
-            if (sqlite3_prepare_v2(db, statusSQL, -1, &stmt, nullptr) == SQLITE_OK) {
-                sqlite3_bind_int(stmt, 1, user_id);
-                if (sqlite3_step(stmt) == SQLITE_ROW) {
-                    const unsigned char* status_text = sqlite3_column_text(stmt, 0);
-                    std::string status = (status_text != nullptr) ? reinterpret_cast<const char*>(status_text) : "";
-
-                    if (status == "deleted" || status == "credited") {
-                        std::cout << "Вы не можете совершать переводы. У вас задолженость.\n";
-                        system("pause");
+        return true;
+    }
+
+    // Копирует счета корзины; если ledger_high >= 0 - вместе с их журналом
+    // до записи ledger_high. restricted получает счета со статусом.
+    bool copy_accounts(int bucket, long long ledger_high, std::vector<int>* restricted) {
+        int high = 0;
+        if (!max_user_id(source, high)) {
+            return false;
+        }
+        for (int user_id = bucket + 1; user_id <= high;) {
+            {
+                SqlTransaction txn(target);
+                CachedStatement account(source,
+                    "SELECT id, first_name, last_name, password, cash, status FROM users WHERE id = ?;");
+                CachedStatement insert(target,
+                    "INSERT OR REPLACE INTO users (id, first_name, last_name, password, cash, status) VALUES (?, ?, ?, ?, ?, ?);");
+                CachedStatement history(source,
+                    "SELECT user_id, type, amount, timestamp, description, balance_after FROM transactions "
+                    "WHERE user_id = ? AND id <= ? ORDER BY timestamp, id;");
+                if (!txn.started() || !account || !insert || !history) {
+                    std::cerr << "Ошибка подготовки запроса переноса: " << sqlite3_errmsg(source) << std::endl;
+                    return false;
+                }
+
+                // Счёт копируется целиком с историей, порция закрывается на границе счёта
+                long long copied = 0;
+                for (; copied < REBALANCE_CHUNK && user_id <= high; user_id += SHARD_BUCKETS) {
+                    sqlite3_bind_int(account, 1, user_id);
+                    if (timed_step(account) != SQLITE_ROW) {
+                        sqlite3_reset(account);
+                        continue;
                     }
-                    else {
-                        transfer_to_user(db, user_id);
+                    for (int column = 0; column < 6; ++column) {
+                        sqlite3_bind_value(insert, column + 1, sqlite3_column_value(account, column));
+                    }
+                    if (restricted != nullptr && column_status(account, 5) != AccountStatus::Active) {
+                        restricted->push_back(user_id);
+                    }
+                    sqlite3_reset(account);
+                    if (timed_step(insert) != SQLITE_DONE) {
+                        std::cerr << "Ошибка копирования счёта " << user_id << ": " << sqlite3_errmsg(target) << std::endl;
+                        return false;
+                    }
+                    sqlite3_reset(insert);
+                    ++copied;
+                    if (ledger_high < 0) {
+                        continue;
+                    }
+                    ++status.users;
+
+                    sqlite3_bind_int(history, 1, user_id);
+                    sqlite3_bind_int64(history, 2, ledger_high);
+                    int rc;
+                    while ((rc = timed_step(history)) == SQLITE_ROW) {
+                        if (!insert_ledger_copy(target, history)) {
+                            return false;
+                        }
+                        ++copied;
+                        ++status.rows;
+                    }
+                    sqlite3_reset(history);
+                    if (rc != SQLITE_DONE) {
+                        std::cerr << "Ошибка чтения журнала счёта " << user_id << ": " << sqlite3_errmsg(source) << std::endl;
+                        return false;
                     }
                 }
-                sqlite3_finalize(stmt);
+                if (!txn.commit()) {
+                    return false;
+                }
+            }
+            if (!publish()) {
+                return false;
             }
         }
-        else if (choice == "4") {
-            display_user_transactions(db, user_id);
+        return true;
+    }
+
+    // Докопирует записи корзины с id в (low, high]; count - сколько их было
+    bool copy_ledger(int bucket, long long low, long long high, long long& count) {
+        count = 0;
+        while (low < high) {
+            {
+                SqlTransaction txn(target);
+                CachedStatement delta(source,
+                    "SELECT user_id, type, amount, timestamp, description, balance_after, id FROM transactions "
+                    "WHERE id > ? AND id <= ? AND (user_id - 1) % ? = ? ORDER BY id LIMIT ?;");
+                if (!txn.started() || !delta) {
+                    std::cerr << "Ошибка подготовки запроса переноса: " << sqlite3_errmsg(source) << std::endl;
+                    return false;
+                }
+                sqlite3_bind_int64(delta, 1, low);
+                sqlite3_bind_int64(delta, 2, high);
+                sqlite3_bind_int(delta, 3, SHARD_BUCKETS);
+                sqlite3_bind_int(delta, 4, bucket);
+                sqlite3_bind_int(delta, 5, REBALANCE_CHUNK);
+
+                int fetched = 0;
+                int rc;
+                while ((rc = timed_step(delta)) == SQLITE_ROW) {
+                    if (!insert_ledger_copy(target, delta)) {
+                        return false;
+                    }
+                    low = sqlite3_column_int64(delta, 6);
+                    ++fetched;
+                }
+                if (rc != SQLITE_DONE || !txn.commit()) {
+                    std::cerr << "Ошибка докопирования журнала: " << sqlite3_errmsg(source) << std::endl;
+                    return false;
+                }
+                count += fetched;
+                status.rows += fetched;
+                if (fetched < REBALANCE_CHUNK) {
+                    break;
+                }
+            }
+            if (!publish()) {
+                return false;
+            }
         }
-        else if (choice != "5") {
-            std::cout << "Неверный синтаксис, попробуйте еще раз." << std::endl;
-            system("pause");
+        return true;
+    }
+
+    // Ключи уже зачисленных межсегментных переводов на счета корзины, строки
+    // которых ещё ждут в transfer_outbox: без них повторная доставка в новый
+    // сегмент зачислила бы перевод второй раз
+    bool copy_inbox(int bucket) {
+        for (size_t k = 0; k < router.size(); ++k) {
+            sqlite3* outbox_db = router.connection(k);
+            CachedStatement pending(outbox_db,
+                "SELECT id FROM transfer_outbox WHERE (recipient_id - 1) % ? = ?;");
+            CachedStatement delivered(source,
+                "SELECT 1 FROM transfer_inbox WHERE source_shard = ? AND transfer_id = ?;");
+            CachedStatement insert(target,
+                "INSERT OR IGNORE INTO transfer_inbox (source_shard, transfer_id) VALUES (?, ?);");
+            if (!pending || !delivered || !insert) {
+                std::cerr << "Ошибка подготовки запроса переноса: " << sqlite3_errmsg(outbox_db) << std::endl;
+                return false;
+            }
+            sqlite3_bind_int(pending, 1, SHARD_BUCKETS);
+            sqlite3_bind_int(pending, 2, bucket);
+            while (timed_step(pending) == SQLITE_ROW) {
+                long long transfer_id = sqlite3_column_int64(pending, 0);
+                sqlite3_bind_int(delivered, 1, static_cast<int>(k));
+                sqlite3_bind_int64(delivered, 2, transfer_id);
+                bool found = timed_step(delivered) == SQLITE_ROW;
+                sqlite3_reset(delivered);
+                if (!found) {
+                    continue;
+                }
+                sqlite3_bind_int(insert, 1, static_cast<int>(k));
+                sqlite3_bind_int64(insert, 2, transfer_id);
+                if (timed_step(insert) != SQLITE_DONE) {
+                    std::cerr << "Ошибка копирования входящего перевода: " << sqlite3_errmsg(target) << std::endl;
+                    return false;
+                }
+                sqlite3_reset(insert);
+            }
         }
-    } while (choice != "5");
-}
+        return true;
+    }
 
-void login_user(sqlite3* db) {
-    std::string first_name, last_name, password;
+    bool switch_bucket(int bucket) {
+        sqlite3* directory = router.connection(0);
+        SqlTransaction txn(directory);
+        CachedStatement owner(directory, "UPDATE shard_buckets SET shard = ? WHERE bucket = ?;");
+        CachedStatement move(directory, "UPDATE shard_moves SET switched = 1 WHERE bucket = ?;");
+        if (!txn.started() || !owner || !move) {
+            std::cerr << "Ошибка подготовки запроса: " << sqlite3_errmsg(directory) << std::endl;
+            return false;
+        }
+        sqlite3_bind_int(owner, 1, status.to);
+        sqlite3_bind_int(owner, 2, bucket);
+        sqlite3_bind_int(move, 1, bucket);
+        if (timed_step(owner) != SQLITE_DONE || timed_step(move) != SQLITE_DONE || !txn.commit()) {
+            std::cerr << "Ошибка переключения корзины " << bucket << ": " << sqlite3_errmsg(directory) << std::endl;
+            return false;
+        }
+        return true;
+    }
 
-    std::cout << "Введите имя: ";
-    std::cin >> first_name;
-    first_name = normalize_name(first_name);
+    bool finish(int bucket) {
+        CachedStatement done(router.connection(0), "DELETE FROM shard_moves WHERE bucket = ?;");
+        if (!done) {
+            std::cerr << "Ошибка подготовки запроса: " << sqlite3_errmsg(router.connection(0)) << std::endl;
+            return false;
+        }
+        sqlite3_bind_int(done, 1, bucket);
+        return timed_step(done) == SQLITE_DONE;
+    }
 
-    std::cout << "Введите фамилию: ";
-    std::cin >> last_name;
-    last_name = normalize_name(last_name);
+public:
+    BucketMover(ShardRouter& shard_router, RebalanceStatus& progress, const RebalanceReport& callback)
+        : router(shard_router), source(shard_router.connection(progress.from)),
+          target(shard_router.connection(progress.to)), status(progress), report(callback) {}
+
+    bool move(int bucket) {
+        status.current = bucket;
+        long long copied_to = 0;
+        if (!begin(bucket) || !max_ledger_id(source, copied_to) || !copy_accounts(bucket, copied_to, nullptr)) {
+            return false;
+        }
 
-    std::cout << "Введите пароль: ";
-    std::cin >> password;
-    std::string hashed_password = hash_password(password);
+        for (int pass = 0; pass < REBALANCE_CATCH_UP_PASSES; ++pass) {
+            long long high = 0, count = 0;
+            if (!max_ledger_id(source, high) || !copy_ledger(bucket, copied_to, high, count)) {
+                return false;
+            }
+            copied_to = high;
+            if (count < REBALANCE_CHUNK) {
+                break;
+            }
+        }
+
+        {
+            ShardMap::Pause pause(router.buckets());
+            auto paused = std::chrono::steady_clock::now();
+            std::vector<int> restricted;
+            long long high = 0, count = 0;
+            if (!max_ledger_id(source, high) || !copy_ledger(bucket, copied_to, high, count)
+                || !copy_accounts(bucket, -1, &restricted) || !copy_inbox(bucket) || !switch_bucket(bucket)) {
+                return false;
+            }
+            router.buckets().assign(bucket, status.to);
+            AccountCache::of(source).replace_bucket(bucket, std::vector<int>());
+            AccountCache::of(target).replace_bucket(bucket, restricted);
+            double pause_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - paused).count();
+            status.max_pause_ms = std::max(status.max_pause_ms, pause_ms);
+        }
+
+        if (!purge_bucket(source, bucket) || !finish(bucket)) {
+            return false;
+        }
+        ++status.moved;
+        return publish(true);
+    }
+};
+
+// Переносит count корзин сегмента from в сегмент to; count <= 0 - половину
+// корзин from, чтобы разделить нагруженный сегмент на два
+bool rebalance_shards(sqlite3* db, int from, int to, int count, RebalanceStatus& status,
+    const RebalanceReport& report = RebalanceReport()) {
+    ShardRouter* router = ShardRouter::of(db);
+    if (router == nullptr) {
+        std::cerr << "Перенос возможен только при shards > 1 в bankdb.conf" << std::endl;
+        return false;
+    }
+    int shards = static_cast<int>(router->size());
+    if (from < 0 || from >= shards || to < 0 || to >= shards || from == to) {
+        std::cerr << "Неверные номера сегментов: " << from << " -> " << to << " (сегментов " << shards << ")" << std::endl;
+        return false;
+    }
+
+    static std::mutex running;
+    std::unique_lock<std::mutex> exclusive(running, std::try_to_lock);
+    if (!exclusive.owns_lock()) {
+        std::cerr << "Перенос корзин уже выполняется" << std::endl;
+        return false;
+    }
+    if (!resume_moves(db)) {
+        return false;
+    }
+
+    std::vector<int> buckets;
+    for (int bucket = 0; bucket < SHARD_BUCKETS; ++bucket) {
+        if (router->buckets().owner(bucket) == from) {
+            buckets.push_back(bucket);
+        }
+    }
+    size_t wanted = (count > 0) ? static_cast<size_t>(count) : buckets.size() / 2;
+    if (wanted < buckets.size()) {
+        buckets.erase(buckets.begin(), buckets.end() - wanted);
+    }
 
-    const char* loginSQL = "SELECT id, status FROM users WHERE first_name = ? AND last_name = ? AND password = ?;";
-    sqlite3_stmt* stmt;
+    status = RebalanceStatus();
+    status.from = from;
+    status.to = to;
+    status.buckets = static_cast<int>(buckets.size());
+    status.running = true;
 
-    if (sqlite3_prepare_v2(db, loginSQL, -1, &stmt, nullptr) != SQLITE_OK) {
-        std::cerr << "Ошибка подготовки запроса входа: " << sqlite3_errmsg(db) << std::endl;
+    BucketMover mover(*router, status, report);
+    for (int bucket : buckets) {
+        if (!mover.move(bucket)) {
+            status.failed = true;
+            break;
+        }
+    }
+    status.running = false;
+    status.current = -1;
+    if (report) {
+        report(status);
+    }
+    return !status.failed;
+}
+
+void rebalance_menu(sqlite3* db) {
+    int from = 0, to = 0, count = 0;
+    std::cout << "Из сегмента: ";
+    std::cin >> from;
+    std::cout << "В сегмент: ";
+    std::cin >> to;
+    std::cout << "Сколько корзин перенести (0 - половину): ";
+    std::cin >> count;
+    if (!std::cin) {
         return;
     }
 
-    sqlite3_bind_text(stmt, 1, first_name.c_str(), -1, SQLITE_STATIC);
-    sqlite3_bind_text(stmt, 2, last_name.c_str(), -1, SQLITE_STATIC);
-    sqlite3_bind_text(stmt, 3, hashed_password.c_str(), -1, SQLITE_STATIC);
+    RebalanceStatus status;
+    bool ok = rebalance_shards(db, from, to, count, status);
+    std::cout << (ok ? "Перенос выполнен: " : "Перенос не выполнен: ") << describe_rebalance(status) << "\n";
+}
 
-    if (sqlite3_step(stmt) == SQLITE_ROW) {
-        int user_id = sqlite3_column_int(stmt, 0);
-        const unsigned char* status_text = sqlite3_column_text(stmt, 1);
+void admin_menu(sqlite3* db) {
+    TransactionManager tm(db);
+    std::string y;
+    do {
+        clear_screen();
+        std::cout << "-----------------Меню администратора-----------------\n";
+        std::cout << "0 - Создать пользователя\n";
+        std::cout << "1 - Увеличение баланса\n";
+        std::cout << "2 - Добавление статуса пользователю\n";
+        std::cout << "3 - Вывод всех пользователей\n";
+        std::cout << "4 - Просмотреть все транзакции\n";
+        std::cout << "5 - Назад\n";
+        std::cout << "6 - Статистика кэшей\n";
+        std::cout << "7 - Статистика операций\n";
+        std::cout << "8 - Сверка балансов с журналом\n";
+        std::cout << "9 - Перенос корзин между сегментами\n";
+        std::cout << ">> ";
+        std::cin >> y;
+
+        if (y == "0") {
+            register_user(db, true);
+        }
+        else if (y == "1") {
+            input_user(db);
+            increase_balance(db);
+        }
+        else if (y == "2") {
+            input_user(db);
+            create_status(db);
+        }
+        else if (y == "3") {
+            input_user(db);
+        }
+        else if (y == "4") {
+            tm.get_all_transactions();
+        }
+        else if (y == "6") {
+            show_statement_cache_stats(db);
+            show_account_cache_stats(db);
+        }
+        else if (y == "7") {
+            std::cout << "\n=== Задержки операций ===\n" << Metrics::report();
+        }
+        else if (y == "8") {
+            reconcile_menu(db);
+        }
+        else if (y == "9") {
+            rebalance_menu(db);
+        }
+        else if (y != "5") {
+            std::cout << "Неверный синтаксис, попробуйте еще раз.\n";
+        }
+
+        pause_screen();
+        clear_screen();
+    } while (y != "5");
+}
+
+void menu(sqlite3* db) {
+    std::string y;
+    do {
+        clear_screen();
+        std::cout << "-----------------меню управления-----------------\n";
+        std::cout << "0 - админское управление\n";
+        std::cout << "1 - регистрация нового пользователя\n";
+        std::cout << "2 - вход в аккаунт\n";
+        std::cout << "3 - выход\n";
+        std::cout << ">> ";
+        std::cin >> y;
+
+        if (y == "0") {
+            std::string admin_pass;
+            std::cout << "Введите пароль >> ";
+            std::cin >> y;
+
+            std::string hash = hash_password(y);
+
+            if (hash == ADMIN_PASSWORD_HASH)
+                admin_menu(db);
+            else
+                std::cout << "Нет прав\n";
+        }
+        else if (y == "1") {
+            register_user(db, false);
+        }
+        else if (y == "2") {
+            login_user(db);
+        }
+        else if (y != "3") {
+            std::cout << "Неверный ввод, попробуйте еще раз.\n";
+        }
+
+        pause_screen();
+        clear_screen();
+    } while (y != "3");
+}
+
+// ---- Серверный режим: те же операции по сокету для многих клиентов ----
+//
+// Протокол строковый: одна команда на строку, слова через пробел, ответ
+// начинается с "OK" или "ERR <код>". Списки выдаются строками "ROW" с полями
+// через табуляцию и завершаются строкой "END"; NEXT и PREV листают последний список.
+//
+//   LOGIN <имя> <фамилия> <пароль>   BALANCE   DEPOSIT <сумма>
+//   TRANSFER <имя> <фамилия> <сумма> HISTORY   NEXT   PREV   LOGOUT   QUIT
+//   REGISTER <имя> <фамилия> <пароль>          ADMIN <пароль>
+//   администратор: USERS  TRANSACTIONS  CREATE <имя> <фамилия> <пароль> <сумма>
+//                  INCREASE <id> <сумма>  STATUS <id> deleted|banned|credited|none
+//                  REBALANCE <из сегмента> <в сегмент> [корзин] - запуск переноса
+//                  REBALANCE - ход последнего переноса
+
+struct ServerSession {
+    int fd;
+    size_t worker;
+    std::string input;              // поля input и reading меняет только цикл событий
+    bool reading = true;
+
+    std::mutex output_mutex;
+    std::string output;
+    bool close_after_flush = false;     // QUIT или клиент закрыл свою сторону
+    std::atomic<int> pending_jobs{ 0 };
+
+    // Состояние ниже меняет только поток-обработчик этой сессии
+    Session account;                // user_id < 0 - вход не выполнен
+    bool admin = false;
+    std::unique_ptr<LedgerCursor> ledger;
+    std::unique_ptr<UserCursor> users;
+
+    ServerSession(int socket_fd, size_t worker_index) : fd(socket_fd), worker(worker_index) {}
+};
+
+static std::vector<std::string> split_words(const std::string& line) {
+    std::vector<std::string> words;
+    std::istringstream in(line);
+    std::string word;
+    while (in >> word) {
+        words.push_back(word);
+    }
+    return words;
+}
+
+static std::string format_ledger_page(const std::vector<LedgerRow>& page) {
+    std::ostringstream out;
+    for (const LedgerRow& row : page) {
+        out << "ROW\t" << row.id << "\t" << row.user_id << "\t" << row.type << "\t" << format_money(row.amount)
+            << "\t" << row.timestamp << "\t" << row.description << "\n";
+    }
+    out << "END\n";
+    return out.str();
+}
+
+static std::string format_user_page(const std::vector<UserRow>& page) {
+    std::ostringstream out;
+    for (const UserRow& user : page) {
+        out << "ROW\t" << user.id << "\t" << user.first_name << "\t" << user.last_name
+            << "\t" << format_money(user.cash) << "\t" << status_name(user.status) << "\n";
+    }
+    out << "END\n";
+    return out.str();
+}
+
+// Перенос корзин по команде REBALANCE идёт в фоне, чтобы не занимать
+// обработчик. У потока переноса своё соединение и свой маршрутизатор;
+// таблица корзин у них общая с обработчиками (ShardMap).
+class RebalanceJob {
+private:
+    std::mutex mutex;
+    std::thread thread;
+    RebalanceStatus status;
+    std::atomic<bool> stopping{ false };
+    std::string db_path;
+    ConnectionProfile profile;
+
+    void run(int from, int to, int count) {
+        sqlite3* db = nullptr;
+        bool ok = sqlite3_open(db_path.c_str(), &db) == SQLITE_OK && apply_connection_profile(db, profile, false);
+        if (ok) {
+            StatementCache statements(db);
+            ShardRouter router(db, db_path, profile);
+            RebalanceStatus progress;
+            ok = router.started() && rebalance_shards(db, from, to, count, progress, [this](const RebalanceStatus& current) {
+                std::lock_guard<std::mutex> lock(mutex);
+                status = current;
+                return !stopping;
+            });
+        }
+        else {
+            std::cerr << "Невозможно открыть БД для переноса: " << sqlite3_errmsg(db) << std::endl;
+        }
+        sqlite3_close(db);
+
+        std::lock_guard<std::mutex> lock(mutex);
+        status.running = false;
+        status.failed = status.failed || !ok;
+    }
+
+public:
+    static RebalanceJob& instance() {
+        static RebalanceJob job;
+        return job;
+    }
+
+    void configure(const std::string& path, const ConnectionProfile& conn_profile) {
+        std::lock_guard<std::mutex> lock(mutex);
+        db_path = path;
+        profile = conn_profile;
+    }
+
+    // false - перенос уже идёт
+    bool start(int from, int to, int count) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (status.running) {
+            return false;
+        }
+        if (thread.joinable()) {
+            thread.join();
+        }
+        status = RebalanceStatus();
+        status.from = from;
+        status.to = to;
+        status.running = true;
+        thread = std::thread(&RebalanceJob::run, this, from, to, count);
+        return true;
+    }
+
+    RebalanceStatus snapshot() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return status;
+    }
+
+    // При остановке сервера перенос прерывается после текущей порции;
+    // недоделанная корзина дочищается при следующем запуске
+    void stop() {
+        stopping = true;
+        std::thread finished;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            finished.swap(thread);
+        }
+        if (finished.joinable()) {
+            finished.join();
+        }
+    }
+};
+
+std::string handle_request(sqlite3* db, ServerSession& session, const std::string& line) {
+    std::vector<std::string> args = split_words(line);
+    if (args.empty()) {
+        return "ERR empty_command\n";
+    }
+    std::string command = args[0];
+    std::transform(command.begin(), command.end(), command.begin(), ::toupper);
+
+    if (command == "PING") {
+        return "OK\n";
+    }
+    if (command == "QUIT") {
+        std::lock_guard<std::mutex> lock(session.output_mutex);
+        session.close_after_flush = true;
+        return "OK bye\n";
+    }
+    if (command == "LOGIN" && args.size() == 4) {
+        int user_id = -1;
+        switch (authenticate_user(db, normalize_name(args[1]), normalize_name(args[2]), args[3], user_id)) {
+        case LoginResult::Ok:
+            if (!open_session(db, user_id, session.account)) return "ERR internal\n";
+            session.ledger.reset();
+            session.users.reset();
+            return "OK " + std::to_string(user_id) + "\n";
+        case LoginResult::Deleted: return "ERR account_deleted\n";
+        case LoginResult::Banned: return "ERR account_banned\n";
+        case LoginResult::WrongCredentials: return "ERR wrong_credentials\n";
+        case LoginResult::Error: return "ERR internal\n";
+        }
+    }
+    if (command == "REGISTER" && args.size() == 4) {
+        return create_user(db, args[1], args[2], args[3], 0) ? "OK\n" : "ERR internal\n";
+    }
+    if (command == "ADMIN" && args.size() == 2) {
+        if (hash_password(args[1]) != ADMIN_PASSWORD_HASH) {
+            return "ERR access_denied\n";
+        }
+        session.admin = true;
+        return "OK\n";
+    }
+    if (command == "LOGOUT") {
+        session.account = Session();
+        session.admin = false;
+        session.ledger.reset();
+        session.users.reset();
+        return "OK\n";
+    }
+    if (command == "NEXT" || command == "PREV") {
+        bool forward = command == "NEXT";
+        if (session.ledger) {
+            return format_ledger_page(forward ? session.ledger->next() : session.ledger->previous());
+        }
+        if (session.users) {
+            return format_user_page(forward ? session.users->next() : session.users->previous());
+        }
+        return "ERR no_listing\n";
+    }
+
+    if (session.account.user_id >= 0) {
+        Money amount;
+        if (command == "BALANCE") {
+            Money balance;
+            if (!get_balance(db, session.account.user_id, balance)) return "ERR internal\n";
+            return "OK " + format_money(balance) + "\n";
+        }
+        if (command == "DEPOSIT" && args.size() == 2) {
+            if (!parse_money(args[1], amount)) return "ERR bad_amount\n";
+            return perform_deposit(db, session.account.user_id, amount) ? "OK\n" : "ERR internal\n";
+        }
+        if (command == "TRANSFER" && args.size() == 4) {
+            if (!parse_money(args[3], amount)) return "ERR bad_amount\n";
+            if (transfer_eligibility(db, session.account.user_id) != TransferEligibility::Allowed) return "ERR transfers_blocked\n";
+            switch (perform_transfer(db, session.account, normalize_name(args[1]), normalize_name(args[2]), amount)) {
+            case TransferResult::Ok: return "OK\n";
+            case TransferResult::InsufficientFunds: return "ERR insufficient_funds\n";
+            case TransferResult::RecipientNotFound: return "ERR recipient_not_found\n";
+            case TransferResult::RecipientDeleted: return "ERR recipient_deleted\n";
+            case TransferResult::RecipientBanned: return "ERR recipient_banned\n";
+            case TransferResult::Error: return "ERR internal\n";
+            }
+        }
+        if (command == "HISTORY") {
+            session.users.reset();
+            session.ledger.reset(new LedgerCursor(db, PAGE_SIZE, session.account.user_id));
+            return format_ledger_page(session.ledger->first());
+        }
+    }
+
+    if (session.admin) {
+        Money amount;
+        if (command == "USERS") {
+            session.ledger.reset();
+            session.users.reset(new UserCursor(db, PAGE_SIZE));
+            return format_user_page(session.users->first());
+        }
+        if (command == "TRANSACTIONS") {
+            session.users.reset();
+            session.ledger.reset(new LedgerCursor(db, PAGE_SIZE));
+            return format_ledger_page(session.ledger->first());
+        }
+        if (command == "CREATE" && args.size() == 5) {
+            if (!parse_money(args[4], amount, true)) return "ERR bad_amount\n";
+            return create_user(db, args[1], args[2], args[3], amount) ? "OK\n" : "ERR internal\n";
+        }
+        if (command == "INCREASE" && args.size() == 3) {
+            int user_id = 0;
+            if (!parse_int(args[1], user_id, 1, std::numeric_limits<int>::max())) return "ERR bad_argument\n";
+            if (!parse_money(args[2], amount)) return "ERR bad_amount\n";
+            switch (admin_increase_balance(db, user_id, amount)) {
+            case AdminResult::Ok: return "OK\n";
+            case AdminResult::NotFound: return "ERR not_found\n";
+            case AdminResult::Deleted: return "ERR account_deleted\n";
+            case AdminResult::Banned: return "ERR account_banned\n";
+            case AdminResult::Error: return "ERR internal\n";
+            }
+        }
+        if (command == "STATUS" && args.size() == 3) {
+            int user_id = 0;
+            AccountStatus status;
+            if (!parse_int(args[1], user_id, 1, std::numeric_limits<int>::max())) return "ERR bad_argument\n";
+            if (!parse_status(args[2], status)) return "ERR bad_status\n";
+            switch (set_user_status(db, user_id, status)) {
+            case AdminResult::Ok: return "OK\n";
+            case AdminResult::NotFound: return "ERR not_found\n";
+            default: return "ERR internal\n";
+            }
+        }
+        if (command == "REBALANCE" && args.size() == 1) {
+            return "OK " + describe_rebalance(RebalanceJob::instance().snapshot()) + "\n";
+        }
+        if (command == "REBALANCE" && (args.size() == 3 || args.size() == 4)) {
+            if (ShardRouter::of(db) == nullptr) return "ERR not_sharded\n";
+            int from = 0, to = 0, count = 0;
+            if (!parse_int(args[1], from, 0, std::numeric_limits<int>::max()) || !parse_int(args[2], to, 0, std::numeric_limits<int>::max())
+                || (args.size() == 4 && !parse_int(args[3], count, 0, std::numeric_limits<int>::max()))) {
+                return "ERR bad_argument\n";
+            }
+            if (!RebalanceJob::instance().start(from, to, count)) {
+                return "ERR rebalance_running\n";
+            }
+            return "OK\n";
+        }
+    }
+
+    return "ERR unknown_command\n";
+}
+
+#ifdef __linux__
+
+// Пул обработчиков: у каждого своё соединение с БД и свой кэш запросов.
+// Все запросы одной сессии идут в один и тот же обработчик, поэтому
+// выполняются по порядку, а курсоры сессии привязаны к одному соединению.
+class BankServer {
+private:
+    struct Job {
+        std::shared_ptr<ServerSession> session;
+        std::string line;
+    };
+
+    struct Worker {
+        std::thread thread;
+        std::mutex mutex;
+        std::condition_variable ready;
+        std::deque<Job> jobs;
+        std::promise<bool> opened;      // соединение обработчика открыто и настроено
+    };
+
+    std::string db_path;
+    ConnectionProfile profile;
+    int listen_fd = -1;
+    int epoll_fd = -1;
+    int wake_fd = -1;
+    bool stopping = false;
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::unordered_map<int, std::shared_ptr<ServerSession>> sessions;
+    size_t next_worker = 0;
+
+    std::mutex flush_mutex;
+    std::vector<std::shared_ptr<ServerSession>> flush_queue;
+
+    std::thread retry_thread;
+    std::mutex retry_mutex;
+    std::condition_variable retry_wake;
+    bool retry_stopping = false;
+
+    static const size_t MAX_LINE = 4096;
+
+    static int& signal_fd() {
+        static int fd = -1;
+        return fd;
+    }
+
+    static volatile sig_atomic_t& stop_requested() {
+        static volatile sig_atomic_t flag = 0;
+        return flag;
+    }
+
+    static void on_signal(int) {
+        stop_requested() = 1;
+        uint64_t one = 1;
+        if (signal_fd() >= 0) {
+            ssize_t ignored = write(signal_fd(), &one, sizeof(one));
+            (void)ignored;
+        }
+    }
+
+    void wake() {
+        uint64_t one = 1;
+        ssize_t ignored = write(wake_fd, &one, sizeof(one));
+        (void)ignored;
+    }
 
-        if (status_text != nullptr && std::string(reinterpret_cast<const char*>(status_text)) == "deleted") {
-            std::cout << "Вход невозможен: аккаунт помечен как удалённый.\n";
+    // Обработчик без соединения не берёт запросы: run() узнаёт об этом
+    // через worker.opened и не запускает сервер
+    void worker_loop(Worker& worker) {
+        sqlite3* db = nullptr;
+        if (sqlite3_open(db_path.c_str(), &db) != SQLITE_OK || !apply_connection_profile(db, profile, false)) {
+            std::cerr << "Невозможно открыть БД в обработчике: " << sqlite3_errmsg(db) << std::endl;
+            sqlite3_close(db);
+            worker.opened.set_value(false);
             return;
         }
-        if (status_text != nullptr && std::string(reinterpret_cast<const char*>(status_text)) == "banned") {
-            std::cout << "Вход невозможен: аккаунт помечен как заблокированный.\n";
-            return;
+        {
+            StatementCache statements(db);
+            std::unique_ptr<ShardRouter> router;
+            if (profile.shards > 1) {
+                router.reset(new ShardRouter(db, db_path, profile));
+            }
+            bool ready = !router || router->started();
+            worker.opened.set_value(ready);
+            while (ready) {
+                Job job;
+                {
+                    std::unique_lock<std::mutex> lock(worker.mutex);
+                    worker.ready.wait(lock, [&] { return stopping || !worker.jobs.empty(); });
+                    if (worker.jobs.empty()) {
+                        break;
+                    }
+                    job = std::move(worker.jobs.front());
+                    worker.jobs.pop_front();
+                }
+
+                std::string response = handle_request(db, *job.session, job.line);
+                {
+                    std::lock_guard<std::mutex> lock(job.session->output_mutex);
+                    job.session->output += response;
+                    --job.session->pending_jobs;
+                }
+                {
+                    std::lock_guard<std::mutex> lock(flush_mutex);
+                    flush_queue.push_back(job.session);
+                }
+                wake();
+            }
         }
-        else {
-            std::cout << "Успешный вход! Добро пожаловать, " << first_name << "!" << std::endl;
-            sqlite3_finalize(stmt);
-            system("pause");
-            user_menu(db, user_id);
+        sqlite3_close(db);
+    }
+
+    // Межсегментные переводы, не зачисленные сразу, доставляются повторно,
+    // не дожидаясь перезапуска сервера
+    void retry_loop() {
+        sqlite3* db = nullptr;
+        if (sqlite3_open(db_path.c_str(), &db) != SQLITE_OK || !apply_connection_profile(db, profile, false)) {
+            std::cerr << "Невозможно открыть БД для доставки переводов: " << sqlite3_errmsg(db) << std::endl;
+            sqlite3_close(db);
             return;
         }
+        {
+            StatementCache statements(db);
+            ShardRouter router(db, db_path, profile);
+            std::unique_lock<std::mutex> lock(retry_mutex);
+            while (router.started() && !retry_wake.wait_for(lock, std::chrono::seconds(TRANSFER_RETRY_SECONDS),
+                    [this] { return retry_stopping; })) {
+                lock.unlock();
+                retry_transfers(db);
+                lock.lock();
+            }
+        }
+        sqlite3_close(db);
     }
-    else {
-        std::cout << "Неверные данные! Попробуйте ещё раз." << std::endl;
-    }
-
-    sqlite3_finalize(stmt);
-    system("pause");
-}
 
-void increase_balance(sqlite3* db) {
-    int user_id;
-    double amount;
-
-    std::cout << "Введите ID пользователя, которому хотите увеличить баланс: ";
-    std::cin >> user_id;
+    void dispatch(const std::shared_ptr<ServerSession>& session, std::string line) {
+        Worker& worker = *workers[session->worker];
+        ++session->pending_jobs;
+        {
+            std::lock_guard<std::mutex> lock(worker.mutex);
+            worker.jobs.push_back({ session, std::move(line) });
+        }
+        worker.ready.notify_one();
+    }
 
-    std::cout << "Введите сумму увеличения: ";
-    std::cin >> amount;
+    void close_session(int fd) {
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+        close(fd);
+        sessions.erase(fd);
+    }
 
-    const char* checkSQL = "SELECT cash, status FROM users WHERE id = ?;";
-    sqlite3_stmt* checkStmt;
+    void accept_clients() {
+        while (true) {
+            int fd = accept4(listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd < 0) {
+                return;
+            }
+            auto session = std::make_shared<ServerSession>(fd, next_worker++ % workers.size());
+            sessions[fd] = session;
 
-    if (sqlite3_prepare_v2(db, checkSQL, -1, &checkStmt, nullptr) != SQLITE_OK) {
-        std::cerr << "Ошибка подготовки запроса: " << sqlite3_errmsg(db) << std::endl;
-        return;
+            epoll_event ev{};
+            ev.events = EPOLLIN;
+            ev.data.fd = fd;
+            epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+        }
     }
 
-    sqlite3_bind_int(checkStmt, 1, user_id);
+    void read_client(int fd) {
+        auto it = sessions.find(fd);
+        if (it == sessions.end()) return;
+        std::shared_ptr<ServerSession> session = it->second;
+
+        char buffer[4096];
+        bool peer_closed = false;
+        while (true) {
+            ssize_t n = recv(fd, buffer, sizeof(buffer), 0);
+            if (n > 0) {
+                session->input.append(buffer, static_cast<size_t>(n));
+                continue;
+            }
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                break;
+            }
+            if (n < 0) {
+                close_session(fd);
+                return;
+            }
+            peer_closed = true;
+            break;
+        }
 
-    if (sqlite3_step(checkStmt) == SQLITE_ROW) {
-        double current_cash = sqlite3_column_double(checkStmt, 0);
-        const unsigned char* status_text = sqlite3_column_text(checkStmt, 1);
-        std::string status = (status_text != nullptr) ? reinterpret_cast<const char*>(status_text) : "";
+        size_t start = 0;
+        size_t end;
+        while ((end = session->input.find('\n', start)) != std::string::npos) {
+            std::string line = session->input.substr(start, end - start);
+            if (!line.empty() && line.back() == '\r') line.pop_back();
+            dispatch(session, std::move(line));
+            start = end + 1;
+        }
+        session->input.erase(0, start);
+        if (session->input.size() > MAX_LINE) {
+            close_session(fd);
+            return;
+        }
 
-        sqlite3_finalize(checkStmt);
+        // Клиент дописал запросы и закрыл свою сторону: отвечаем на уже принятые и закрываем
+        if (peer_closed) {
+            session->reading = false;
+            {
+                std::lock_guard<std::mutex> lock(session->output_mutex);
+                session->close_after_flush = true;
+            }
+            flush_client(session);
+        }
+    }
 
-        if (status == "deleted") {
-            std::cout << "Невозможно изменить баланс — пользователь удалён.\n";
-            system("pause");
-            return;
+    // Отправляет накопленный ответ; остаток ждёт EPOLLOUT
+    void flush_client(const std::shared_ptr<ServerSession>& session) {
+        auto it = sessions.find(session->fd);
+        if (it == sessions.end() || it->second != session) return;
+
+        bool close_now = false;
+        bool pending = false;
+        {
+            std::lock_guard<std::mutex> lock(session->output_mutex);
+            while (!session->output.empty()) {
+                ssize_t n = send(session->fd, session->output.data(), session->output.size(), MSG_NOSIGNAL);
+                if (n > 0) {
+                    session->output.erase(0, static_cast<size_t>(n));
+                }
+                else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                    break;
+                }
+                else {
+                    close_now = true;
+                    break;
+                }
+            }
+            pending = !session->output.empty();
+            close_now = close_now || (!pending && session->close_after_flush && session->pending_jobs == 0);
         }
 
-        if (status == "banned") {
-            std::cout << "Невозможно изменить баланс — пользователь удалён.\n";
-            system("pause");
+        if (close_now) {
+            close_session(session->fd);
             return;
         }
 
-        double new_cash = current_cash + amount;
-
-        const char* updateSQL = "UPDATE users SET cash = ? WHERE id = ?;";
-        sqlite3_stmt* updateStmt;
+        epoll_event ev{};
+        ev.events = (session->reading ? static_cast<uint32_t>(EPOLLIN) : 0u) | (pending ? static_cast<uint32_t>(EPOLLOUT) : 0u);
+        ev.data.fd = session->fd;
+        epoll_ctl(epoll_fd, EPOLL_CTL_MOD, session->fd, &ev);
+    }
 
-        if (sqlite3_prepare_v2(db, updateSQL, -1, &updateStmt, nullptr) != SQLITE_OK) {
-            std::cerr << "Ошибка подготовки UPDATE-запроса: " << sqlite3_errmsg(db) << std::endl;
-            return;
+    void stop_workers() {
+        for (auto& worker : workers) {
+            {
+                std::lock_guard<std::mutex> lock(worker->mutex);
+                stopping = true;
+            }
+            worker->ready.notify_all();
+        }
+        for (auto& worker : workers) {
+            if (worker->thread.joinable()) {
+                worker->thread.join();
+            }
         }
+    }
 
-        sqlite3_bind_double(updateStmt, 1, new_cash);
-        sqlite3_bind_int(updateStmt, 2, user_id);
+    bool listen_on(const std::string& endpoint) {
+        if (endpoint.compare(0, 5, "unix:") == 0) {
+            std::string path = endpoint.substr(5);
+            sockaddr_un addr{};
+            if (path.empty() || path.size() >= sizeof(addr.sun_path)) return false;
+            addr.sun_family = AF_UNIX;
+            std::copy(path.begin(), path.end(), addr.sun_path);
+            // Удаляется только сокет, оставшийся от прошлого запуска: опечатка
+            // в пути не должна стоить файла БД
+            struct stat info;
+            if (lstat(path.c_str(), &info) == 0) {
+                if (!S_ISSOCK(info.st_mode)) {
+                    std::cerr << "Файл " << path << " уже существует и не является сокетом" << std::endl;
+                    errno = EEXIST;
+                    return false;
+                }
+                unlink(path.c_str());
+            }
 
-        if (sqlite3_step(updateStmt) == SQLITE_DONE) {
-            std::cout << "Баланс успешно обновлён." << std::endl;
-            TransactionManager trx(db);
-            trx.add_transaction(user_id, "admin_increase", amount, "Увеличение баланса администратором");
+            listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+            if (listen_fd < 0 || bind(listen_fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) return false;
         }
         else {
-            std::cerr << "Ошибка обновления баланса: " << sqlite3_errmsg(db) << std::endl;
+            // tcp:<адрес>:<порт> или просто <адрес>:<порт>
+            std::string address = endpoint.compare(0, 4, "tcp:") == 0 ? endpoint.substr(4) : endpoint;
+            size_t colon = address.rfind(':');
+            if (colon == std::string::npos) return false;
+
+            int port = 0;
+            if (!parse_int(address.substr(colon + 1), port, 1, 65535)) {
+                std::cerr << "Неверный номер порта: " << address.substr(colon + 1) << std::endl;
+                errno = EINVAL;
+                return false;
+            }
+            sockaddr_in addr{};
+            addr.sin_family = AF_INET;
+            addr.sin_port = htons(static_cast<uint16_t>(port));
+            if (inet_pton(AF_INET, address.substr(0, colon).c_str(), &addr.sin_addr) != 1) return false;
+
+            listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+            if (listen_fd < 0) return false;
+            int yes = 1;
+            setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+            if (bind(listen_fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) return false;
         }
-
-        sqlite3_finalize(updateStmt);
+        return listen(listen_fd, SOMAXCONN) == 0;
     }
-    else {
-        std::cerr << "Пользователь с таким ID не найден." << std::endl;
-        sqlite3_finalize(checkStmt);
-    }
-}
 
-void create_status(sqlite3* db) {
-    int id;
-    std::cout << "Введите ID пользователя, которому хотите добавить статус: ";
-    std::cin >> id;
+public:
+    BankServer(const std::string& path, const ConnectionProfile& conn_profile)
+        : db_path(path), profile(conn_profile) {}
 
-    std::string status;
-    std::string choice;
+    ~BankServer() {
+        if (listen_fd >= 0) close(listen_fd);
+        if (epoll_fd >= 0) close(epoll_fd);
+        if (wake_fd >= 0) close(wake_fd);
+    }
 
-    while (choice != "1" && choice != "2" && choice != "3" && choice != "4" && choice != "5") {
-        system("cls");
-        std::cout << "----- Статус пользователя -----" << std::endl;
-        std::cout << "1 - deleted" << std::endl;
-        std::cout << "2 - banned" << std::endl;
-        std::cout << "3 - credited" << std::endl;
-        std::cout << "4 - Очистить статус (null)" << std::endl;
-        std::cout << "5 - Отмена" << std::endl;
-        std::cout << ">> ";
-        std::cin >> choice;
+    // Пишется во временный файл и переименовывается, чтобы читатель не увидел половину отчёта
+    void write_stats() {
+        std::string temp = profile.stats_file + ".tmp";
+        {
+            std::ofstream out(temp);
+            if (!out) return;
+            std::time_t now = std::time(nullptr);
+            char stamp[32];
+            std::strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", std::localtime(&now));
+            out << "# " << stamp << ", сессий: " << sessions.size() << "\n" << Metrics::report();
+        }
+        std::rename(temp.c_str(), profile.stats_file.c_str());
+    }
 
-        if (choice == "1") {
-            status = "deleted";
+    int run(const std::string& endpoint, size_t worker_count) {
+        if (!listen_on(endpoint)) {
+            std::cerr << "Невозможно открыть сокет " << endpoint << ": " << strerror(errno) << std::endl;
+            return 1;
         }
-        else if (choice == "2") {
-            status = "banned";
+        epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+        epoll_event ev{};
+        ev.events = EPOLLIN;
+        ev.data.fd = listen_fd;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev);
+        ev.data.fd = wake_fd;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &ev);
+
+        signal_fd() = wake_fd;
+        signal(SIGINT, on_signal);
+        signal(SIGTERM, on_signal);
+        signal(SIGPIPE, SIG_IGN);
+
+        for (size_t i = 0; i < worker_count; ++i) {
+            workers.emplace_back(new Worker());
         }
-        else if (choice == "3") {
-            status = "credited";
+        std::vector<std::future<bool>> ready;
+        for (auto& worker : workers) {
+            Worker* w = worker.get();
+            ready.push_back(w->opened.get_future());
+            w->thread = std::thread([this, w] { worker_loop(*w); });
         }
-        else if (choice == "4") {
-            status = "";
+        bool opened = true;
+        for (std::future<bool>& worker_ready : ready) {
+            opened = worker_ready.get() && opened;
         }
-        else if (choice == "5") {
-            return;
+        if (!opened) {
+            std::cerr << "Сервер не запущен: не все обработчики открыли БД" << std::endl;
+            stop_workers();
+            signal_fd() = -1;
+            return 1;
         }
-        else {
-            std::cout << "Неверный выбор, попробуйте снова." << std::endl;
-            system("pause");
+        if (profile.shards > 1) {
+            retry_thread = std::thread(&BankServer::retry_loop, this);
         }
-    }
 
-    const char* updateStatusSQL = "UPDATE users SET status = ? WHERE id = ?;";
-    sqlite3_stmt* stmt;
+        std::clog << "Сервер слушает " << endpoint << ", обработчиков: " << worker_count << std::endl;
+
+        std::vector<epoll_event> events(256);
+        bool interrupted = false;
+        auto stats_period = std::chrono::seconds(profile.stats_interval);
+        auto next_stats = std::chrono::steady_clock::now() + stats_period;
+        while (!interrupted) {
+            int timeout = -1;
+            if (profile.stats_interval > 0) {
+                auto left = std::chrono::duration_cast<std::chrono::milliseconds>(next_stats - std::chrono::steady_clock::now());
+                timeout = left.count() > 0 ? static_cast<int>(left.count()) : 0;
+            }
+            int n = epoll_wait(epoll_fd, events.data(), static_cast<int>(events.size()), timeout);
+            if (profile.stats_interval > 0 && std::chrono::steady_clock::now() >= next_stats) {
+                write_stats();
+                next_stats = std::chrono::steady_clock::now() + stats_period;
+            }
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                break;
+            }
 
-    if (sqlite3_prepare_v2(db, updateStatusSQL, -1, &stmt, nullptr) != SQLITE_OK) {
-        std::cerr << "Ошибка подготовки запроса: " << sqlite3_errmsg(db) << std::endl;
-        return;
-    }
+            for (int i = 0; i < n; ++i) {
+                int fd = events[i].data.fd;
+                if (fd == listen_fd) {
+                    accept_clients();
+                }
+                else if (fd == wake_fd) {
+                    uint64_t count;
+                    ssize_t ignored = read(wake_fd, &count, sizeof(count));
+                    (void)ignored;
+
+                    std::vector<std::shared_ptr<ServerSession>> ready;
+                    {
+                        std::lock_guard<std::mutex> lock(flush_mutex);
+                        ready.swap(flush_queue);
+                    }
+                    if (stop_requested()) {
+                        interrupted = true;
+                    }
+                    for (auto& session : ready) {
+                        flush_client(session);
+                    }
+                }
+                else if (events[i].events & (EPOLLHUP | EPOLLERR)) {
+                    close_session(fd);
+                }
+                else {
+                    if (events[i].events & EPOLLIN) {
+                        read_client(fd);
+                    }
+                    auto it = sessions.find(fd);
+                    if (it != sessions.end() && (events[i].events & EPOLLOUT)) {
+                        flush_client(it->second);
+                    }
+                }
+            }
+        }
 
-    if (status.empty()) {
-        sqlite3_bind_null(stmt, 1);
-    }
-    else {
-        sqlite3_bind_text(stmt, 1, status.c_str(), -1, SQLITE_STATIC);
+        std::clog << "Остановка сервера" << std::endl;
+        if (profile.stats_interval > 0) {
+            write_stats();
+        }
+        stop_workers();
+        if (retry_thread.joinable()) {
+            {
+                std::lock_guard<std::mutex> lock(retry_mutex);
+                retry_stopping = true;
+            }
+            retry_wake.notify_all();
+            retry_thread.join();
+        }
+        for (auto& entry : sessions) {
+            close(entry.first);
+        }
+        sessions.clear();
+        signal_fd() = -1;
+        return 0;
     }
+};
+
+int run_server(const ConnectionProfile& profile, const std::string& endpoint, size_t workers) {
+    BankServer server(DB_PATH, profile);
+    RebalanceJob::instance().configure(DB_PATH, profile);
+    int rc = server.run(endpoint, workers);
+    RebalanceJob::instance().stop();
+    return rc;
+}
 
-    sqlite3_bind_int(stmt, 2, id);
+#else
 
-    if (sqlite3_step(stmt) == SQLITE_DONE) {
-        std::string displayStatus = status.empty() ? "NULL" : "\"" + status + "\"";
-        std::cout << "Статус пользователя с ID " << id << " успешно обновлён на " << displayStatus << ".\n";
+int run_server(const ConnectionProfile&, const std::string&, size_t) {
+    std::cerr << "Серверный режим доступен только в Linux (epoll)." << std::endl;
+    return 1;
+}
+
+#endif
+
+// Миграции схемы и проверка индексов перед работой с БД
+bool init_schema(sqlite3* db) {
+    if (!migrate_schema(db)) {
+        return false;
     }
-    else {
-        std::cerr << "Ошибка при обновлении статуса: " << sqlite3_errmsg(db) << std::endl;
+
+    if (!verify_lookup_plans(db)) {
+        std::cerr << "Частые запросы не используют индексы, запуск остановлен\n";
+        return false;
     }
 
-    sqlite3_finalize(stmt);
+    return AccountCache::of(db).load_restrictions(db);
 }
 
-void input_user(sqlite3* db) {
-    const char* selectSQL = "SELECT id, first_name, last_name, password, cash, status FROM users;";
-    sqlite3_stmt* stmt;
-
-    if (sqlite3_prepare_v2(db, selectSQL, -1, &stmt, nullptr) == SQLITE_OK) {
-        std::cout << "\nСписок пользователей:\n";
-        std::cout << "------------------------\n";
-        while (sqlite3_step(stmt) == SQLITE_ROW) {
-            int id = sqlite3_column_int(stmt, 0);
-            std::string f_name = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 1));
-            std::string l_name = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 2));
-            std::string passw = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 3));
-            double user_cash = sqlite3_column_double(stmt, 4);
-
-            const unsigned char* status_text = sqlite3_column_text(stmt, 5);
-            std::string status = (status_text != nullptr) ? reinterpret_cast<const char*>(status_text) : "NULL";
-
-            std::cout << "ID: " << id
-                << " | Имя: " << f_name
-                << " | Фамилия: " << l_name
-                << " | Пароль: " << passw
-                << " | Баланс: " << user_cash << " руб."
-                << " | Статус: " << status << std::endl;
-        }
-        std::cout << "------------------------" << std::endl;
-        sqlite3_finalize(stmt);
+// При ledger_store = mmap открывает бинарный журнал; он должен жить, пока
+// работают соединения с БД. Журнал, уже перенесённый в файлы, таблица
+// transactions не заменит, поэтому с ledger_store = sqlite запуск останавливается.
+bool open_ledger_store(sqlite3* db, const ConnectionProfile& profile, std::unique_ptr<MappedLedger>& ledger) {
+    if (profile.ledger_store != "mmap") {
+        long long records = 0;
+        if (MappedLedger::committed(db, records) && records > 0) {
+            std::cerr << "Журнал хранится в бинарных файлах (" << records
+                << " записей), укажите в bankdb.conf ledger_store = mmap" << std::endl;
+            return false;
+        }
+        return true;
     }
-    else {
-        std::cerr << "Ошибка SELECT-запроса: " << sqlite3_errmsg(db) << std::endl;
+    if (profile.shards > 1) {
+        std::cerr << "ledger_store = mmap поддерживается только при shards = 1" << std::endl;
+        return false;
     }
+    ledger.reset(new MappedLedger(db, profile));
+    return ledger->started();
 }
 
-void register_user(sqlite3* db, bool money) {
-    std::string first_name, last_name, password;
-    float cash;
+// ---- Нагрузочный тест ----
+// ConsoleApplication1 --bench [пользователей] [транзакций] [операций] [отчёт.json]
+// Заполняет отдельную БД синтетическими данными и прогоняет операции банка
+// через те же функции, что меню и сервер. Результаты пишутся в JSON.
 
-    std::cout << "Введите имя пользователя: ";
-    std::cin >> first_name;
-    first_name = normalize_name(first_name);
+const char* const BENCH_DB_PATH = "bankdb_bench.db";
+const int BENCH_BATCH = 100;
 
-    std::cout << "Введите фамилию пользователя: ";
-    std::cin >> last_name;
-    last_name = normalize_name(last_name);
+static std::string bench_last_name(int user_id) {
+    return normalize_name("u" + std::to_string(user_id));
+}
 
-    std::cout << "Введите пароль пользователя: ";
-    std::cin >> password;
+static std::string bench_password(int user_id) {
+    return "pw" + std::to_string(user_id);
+}
 
-    if (money) {
-        std::cout << "Введите размер денежных средств (в рублях): ";
-        std::cin >> cash;
+static long long count_rows(sqlite3* db, const char* table) {
+    std::string sql = std::string("SELECT count(*) FROM ") + table + ";";
+    sqlite3_stmt* stmt = nullptr;
+    long long rows = -1;
+    if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) == SQLITE_OK && timed_step(stmt) == SQLITE_ROW) {
+        rows = sqlite3_column_int64(stmt, 0);
     }
-    else
-        cash = 0;
+    sqlite3_finalize(stmt);
+    return rows;
+}
 
-    std::string hashed_password = hash_password(password);
-    User newUser(first_name, last_name, hashed_password, cash);
+// Записи журнала в таблице и в бинарных файлах; до миграции 8 файлов нет
+static long long ledger_rows(sqlite3* db) {
+    long long records = 0;
+    MappedLedger::committed(db, records);
+    return count_rows(db, "transactions") + records;
+}
 
-    if (newUser.saveToDB(db)) {
-        std::cout << "Пользователь успешно добавлен." << std::endl;
+// Пользователи "Bench U<id>" с паролем "pw<id>" и журнал со случайными
+// суммами; время записей равномерно растёт до текущего момента.
+static bool generate_bench_data(sqlite3* db, int users, long long transactions) {
+    const long long commit_every = 100000;
+    std::mt19937_64 rng(42);
+    std::uniform_int_distribution<int> pick_user(1, users);
+    std::uniform_int_distribution<long long> pick_amount(1, 100000);
+    const char* types[] = { "deposit", "transfer_out", "transfer_in", "admin_increase" };
+
+    if (sqlite3_exec(db, "BEGIN;", nullptr, nullptr, nullptr) != SQLITE_OK) {
+        return false;
     }
-    else {
-        std::cerr << "Ошибка при добавлении пользователя." << std::endl;
+
+    sqlite3_stmt* user_stmt = nullptr;
+    sqlite3_prepare_v2(db, "INSERT INTO users (id, first_name, last_name, password, cash) VALUES (?, 'Bench', ?, ?, ?);",
+        -1, &user_stmt, nullptr);
+    for (int id = 1; id <= users && user_stmt != nullptr; ++id) {
+        std::string last_name = bench_last_name(id);
+        std::string password = hash_password(bench_password(id));
+        sqlite3_bind_int(user_stmt, 1, id);
+        sqlite3_bind_text(user_stmt, 2, last_name.c_str(), -1, SQLITE_TRANSIENT);
+        sqlite3_bind_text(user_stmt, 3, password.c_str(), -1, SQLITE_TRANSIENT);
+        sqlite3_bind_int64(user_stmt, 4, 100000000LL);
+        if (timed_step(user_stmt) != SQLITE_DONE) {
+            std::cerr << "Ошибка вставки пользователя: " << sqlite3_errmsg(db) << std::endl;
+            sqlite3_finalize(user_stmt);
+            return false;
+        }
+        sqlite3_reset(user_stmt);
+    }
+    sqlite3_finalize(user_stmt);
+
+    sqlite3_stmt* stmt = nullptr;
+    if (sqlite3_prepare_v2(db, "INSERT INTO transactions (user_id, type, amount, timestamp, description) VALUES (?, ?, ?, ?, '');",
+        -1, &stmt, nullptr) != SQLITE_OK) {
+        std::cerr << "Ошибка подготовки запроса: " << sqlite3_errmsg(db) << std::endl;
+        sqlite3_finalize(stmt);
+        return false;
     }
 
-    system("pause");
-    system("cls");
+    // Журнал растянут на год, каждой записи - своя секунда или общая с соседями
+    const long long span = 365LL * 24 * 3600;
+    std::time_t start = std::time(nullptr) - static_cast<std::time_t>(span);
+    char timestamp[32];
+    bool ok = true;
+    for (long long i = 0; i < transactions && ok; ++i) {
+        std::time_t at = start + static_cast<std::time_t>(i * span / transactions);
+        std::strftime(timestamp, sizeof(timestamp), "%Y-%m-%d %H:%M:%S", std::gmtime(&at));
+
+        sqlite3_bind_int(stmt, 1, pick_user(rng));
+        sqlite3_bind_text(stmt, 2, types[i % 4], -1, SQLITE_STATIC);
+        sqlite3_bind_int64(stmt, 3, pick_amount(rng));
+        sqlite3_bind_text(stmt, 4, timestamp, -1, SQLITE_TRANSIENT);
+        ok = timed_step(stmt) == SQLITE_DONE;
+        sqlite3_reset(stmt);
+
+        if (ok && (i + 1) % commit_every == 0) {
+            ok = sqlite3_exec(db, "COMMIT; BEGIN;", nullptr, nullptr, nullptr) == SQLITE_OK;
+            if ((i + 1) % (commit_every * 10) == 0) {
+                std::clog << "Сгенерировано транзакций: " << (i + 1) << " из " << transactions << std::endl;
+            }
+        }
+    }
+    if (!ok) {
+        std::cerr << "Ошибка вставки транзакции: " << sqlite3_errmsg(db) << std::endl;
+    }
+    sqlite3_finalize(stmt);
+    return sqlite3_exec(db, ok ? "COMMIT;" : "ROLLBACK;", nullptr, nullptr, nullptr) == SQLITE_OK && ok;
 }
 
-void admin_menu(sqlite3* db) {
-    TransactionManager tm(db);
-    std::string y;
-    do {
-        system("cls");
-        std::cout << "-----------------Меню администратора-----------------" << std::endl;
-        std::cout << "0 - Создать пользователя" << std::endl;
-        std::cout << "1 - Увеличение баланса" << std::endl;
-        std::cout << "2 - Добавление статуса пользователю" << std::endl;
-        std::cout << "3 - Вывод всех пользователей" << std::endl;
-        std::cout << "4 - Просмотреть все транзакции" << std::endl;
-        std::cout << "5 - Назад" << std::endl;
-        std::cout << ">> ";
-        std::cin >> y;
+struct BenchResult {
+    std::string name;
+    std::vector<double> micros;
+    double seconds = 0;
+    size_t failures = 0;
+};
 
-        if (y == "0") {
-            register_user(db, true);
-        }
-        else if (y == "1") {
-            input_user(db);
-            increase_balance(db);
-        }
-        else if (y == "2") {
-            input_user(db);
-            create_status(db);
-        }
-        else if (y == "3") {
-            input_user(db);
-        }
-        else if (y == "4") {
-            tm.get_all_transactions();
-        }
-        else if (y != "5") {
-            std::cout << "Неверный синтаксис, попробуйте еще раз." << std::endl;
+// Прогоняет операцию count раз; op возвращает false при ошибке
+template <typename Operation>
+BenchResult run_bench_operation(const std::string& name, int count, Operation op) {
+    BenchResult result;
+    result.name = name;
+    result.micros.reserve(count);
+    auto started = std::chrono::steady_clock::now();
+    for (int i = 0; i < count; ++i) {
+        auto before = std::chrono::steady_clock::now();
+        if (!op(i)) {
+            ++result.failures;
         }
+        auto after = std::chrono::steady_clock::now();
+        result.micros.push_back(std::chrono::duration<double, std::micro>(after - before).count());
+    }
+    result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+    std::sort(result.micros.begin(), result.micros.end());
+    return result;
+}
 
-        system("pause");
-        system("cls");
-    } while (y != "5");
+static double percentile(const std::vector<double>& sorted, double q) {
+    if (sorted.empty()) return 0;
+    size_t idx = static_cast<size_t>(q * sorted.size());
+    return sorted[idx < sorted.size() ? idx : sorted.size() - 1];
 }
 
-void menu(sqlite3* db) {
-    std::string y;
-    do {
-        system("cls");
-        std::cout << "-----------------меню управления-----------------" << std::endl;
-        std::cout << "0 - админское управление" << std::endl;
-        std::cout << "1 - регистрация нового пользователя" << std::endl;
-        std::cout << "2 - вход в аккаунт" << std::endl;
-        std::cout << "3 - выход" << std::endl;
-        std::cout << ">> ";
-        std::cin >> y;
+static bool write_bench_report(const std::string& path, sqlite3* db, int users, int operations,
+    const std::vector<BenchResult>& results) {
+    std::ofstream out(path);
+    if (!out) {
+        std::cerr << "Невозможно записать отчёт: " << path << std::endl;
+        return false;
+    }
 
-        if (y == "0") {
-            std::string admin_pass;
-            std::cout << "Введите пароль >> ";
-            std::cin >> y;
+    out << std::fixed << std::setprecision(2);
+    out << "{\n";
+    out << "  \"sqlite_version\": \"" << sqlite3_libversion() << "\",\n";
+    out << "  \"users\": " << users << ",\n";
+    out << "  \"transactions\": " << ledger_rows(db) << ",\n";
+    out << "  \"operations_per_kind\": " << operations << ",\n";
+    out << "  \"results\": [\n";
+    for (size_t i = 0; i < results.size(); ++i) {
+        const BenchResult& r = results[i];
+        out << "    { \"operation\": \"" << r.name << "\""
+            << ", \"count\": " << r.micros.size()
+            << ", \"failures\": " << r.failures
+            << ", \"ops_per_sec\": " << (r.seconds > 0 ? r.micros.size() / r.seconds : 0)
+            << ", \"p50_us\": " << percentile(r.micros, 0.50)
+            << ", \"p99_us\": " << percentile(r.micros, 0.99)
+            << ", \"p999_us\": " << percentile(r.micros, 0.999)
+            << " }" << (i + 1 < results.size() ? "," : "") << "\n";
+    }
+    out << "  ]\n";
+    out << "}\n";
+    return static_cast<bool>(out);
+}
 
-            std::string hash = hash_password(y);
-            std::string correct_hash = "8174a05d4e26d063122d119197d3d157b486fb810746504acead103820e36e61";
+int run_benchmark(const ConnectionProfile& profile, int users, long long transactions, int operations,
+    const std::string& report_path) {
+    sqlite3* db = nullptr;
+    if (sqlite3_open(BENCH_DB_PATH, &db) != SQLITE_OK || !apply_connection_profile(db, profile)) {
+        std::cerr << "Невозможно открыть БД теста: " << sqlite3_errmsg(db) << std::endl;
+        sqlite3_close(db);
+        return 1;
+    }
 
-            if (hash == correct_hash)
-                admin_menu(db);
-            else
-                std::cout << "Нет прав\n";
+    // Готовая БД переиспользуется, если в ней столько же пользователей и не меньше транзакций.
+    // Журнал из бинарных файлов в таблицу не возвращается, такая БД генерируется заново.
+    long long logged = 0;
+    MappedLedger::committed(db, logged);
+    bool reuse = count_rows(db, "users") == users && ledger_rows(db) >= transactions
+        && (profile.ledger_store == "mmap" || logged == 0);
+    if (!reuse) {
+        sqlite3_close(db);
+        for (const char* suffix : { "", "-wal", "-shm" }) {
+            std::remove((std::string(BENCH_DB_PATH) + suffix).c_str());
         }
-        else if (y == "1") {
-            register_user(db, false);
+        MappedLedger::remove_files(BENCH_DB_PATH);
+        sqlite3_open(BENCH_DB_PATH, &db);
+        apply_connection_profile(db, profile, false);
+
+        TransactionManager tm(db);
+        auto started = std::chrono::steady_clock::now();
+        if (!User::create_table(db) || !tm.create_table() || !generate_bench_data(db, users, transactions)) {
+            sqlite3_close(db);
+            return 1;
         }
-        else if (y == "2") {
-            login_user(db);
+        std::clog << "Данные сгенерированы за "
+            << std::chrono::duration_cast<std::chrono::seconds>(std::chrono::steady_clock::now() - started).count()
+            << " с" << std::endl;
+    }
+
+    // В режиме mmap сгенерированная таблица переносится в бинарный журнал
+    std::unique_ptr<MappedLedger> ledger;
+    if (!init_schema(db) || !open_ledger_store(db, profile, ledger)) {
+        sqlite3_close(db);
+        return 1;
+    }
+
+    std::vector<BenchResult> results;
+    {
+        StatementCache statements(db);
+        std::unique_ptr<LedgerWriter> writer;
+        if (profile.group_commit) {
+            writer.reset(new LedgerWriter(BENCH_DB_PATH, profile));
         }
-        else if (y != "3") {
-            std::cout << "Неверный ввод, попробуйте еще раз." << std::endl;
+
+        std::mt19937 rng(7);
+        std::uniform_int_distribution<int> pick_user(1, users);
+        std::vector<int> ids(operations);
+        for (int& id : ids) {
+            id = pick_user(rng);
         }
 
-        system("pause");
-        system("cls");
-    } while (y != "3");
+        results.push_back(run_bench_operation("login_user", operations, [&](int i) {
+            int user_id = -1;
+            Session session;
+            return authenticate_user(db, "Bench", bench_last_name(ids[i]), bench_password(ids[i]), user_id) == LoginResult::Ok
+                && open_session(db, user_id, session);
+        }));
+        results.push_back(run_bench_operation("show_balance", operations, [&](int i) {
+            Money balance;
+            return get_balance(db, ids[i], balance);
+        }));
+        results.push_back(run_bench_operation("deposit_balance", operations, [&](int i) {
+            return perform_deposit(db, ids[i], 100);
+        }));
+        results.push_back(run_bench_operation("transfer_to_user", operations, [&](int i) {
+            Session sender;
+            int recipient = ids[(i + 1) % operations];
+            return open_session(db, ids[i], sender)
+                && perform_transfer(db, sender, "Bench", bench_last_name(recipient), 1) == TransferResult::Ok;
+        }));
+        results.push_back(run_bench_operation("display_user_transactions", operations, [&](int i) {
+            LedgerCursor cursor(db, PAGE_SIZE, ids[i]);
+            cursor.first();
+            return true;
+        }));
+
+        // Листание общего журнала страница за страницей, как в меню администратора
+        LedgerCursor ledger(db, PAGE_SIZE);
+        bool fresh = true;
+        results.push_back(run_bench_operation("get_all_transactions", operations, [&](int) {
+            std::vector<LedgerRow> page = fresh ? ledger.first() : ledger.next();
+            fresh = page.empty();
+            return !page.empty();
+        }));
+
+        // Пакетная запись журнала, как у ночных расчётов: BENCH_BATCH зачислений
+        // одной транзакцией
+        TransactionManager tm(db);
+        std::vector<LedgerEntry> batch(BENCH_BATCH);
+        results.push_back(run_bench_operation("add_transactions_x" + std::to_string(BENCH_BATCH),
+            std::max(1, operations / 10), [&](int i) {
+            AccountWrite accounts(db);
+            for (int k = 0; k < BENCH_BATCH; ++k) {
+                batch[k] = { ids[(i * BENCH_BATCH + k) % operations], "deposit", 1, "Пакетное зачисление" };
+                batch[k].credit = true;
+                accounts.cash(batch[k].user_id, 1);
+            }
+            BatchResult result = tm.add_transactions(batch, true);
+            if (result.committed) accounts.commit();
+            return result.committed && result.failures.empty();
+        }));
+    }
+
+    std::cout << "Операция                    оп/с        p50 мкс     p99 мкс     p999 мкс\n";
+    for (const BenchResult& r : results) {
+        std::ostringstream line;
+        line << std::fixed << std::setprecision(1) << std::left << std::setw(28) << r.name
+            << std::setw(12) << (r.seconds > 0 ? r.micros.size() / r.seconds : 0)
+            << std::setw(12) << percentile(r.micros, 0.50)
+            << std::setw(12) << percentile(r.micros, 0.99)
+            << percentile(r.micros, 0.999);
+        if (r.failures > 0) line << "  ошибок: " << r.failures;
+        std::cout << line.str() << "\n";
+    }
+
+    bool written = write_bench_report(report_path, db, users, operations, results);
+    ledger.reset();
+    sqlite3_close(db);
+    if (written) {
+        std::cout << "Отчёт записан в " << report_path << "\n";
+    }
+    return written ? 0 : 1;
 }
 
-int main() {
+int main(int argc, char* argv[]) {
+#ifdef _WIN32
     SetConsoleCP(1251);
     SetConsoleOutputCP(1251);
+#endif
     setlocale(LC_ALL, "Russian");
+    Metrics::started();
+
+    // ConsoleApplication1 --server <unix:путь | tcp:адрес:порт> [число обработчиков]
+    // ConsoleApplication1 --batch - меню без пауз и очистки экрана, для сценариев
+    // ConsoleApplication1 --reconcile [потоков] - сверка балансов с журналом;
+    //   код выхода 0 - расхождений нет, 2 - найдены расхождения
+    // ConsoleApplication1 --rebalance <из сегмента> <в сегмент> [корзин] - перенос
+    //   корзин счетов между сегментами (по умолчанию - половины корзин сегмента)
+    // ConsoleApplication1 --export-columns [файл] - снимок журнала по столбцам для аналитики
+    // ConsoleApplication1 --ledger-report <файл> [с YYYY-MM-DD] [по YYYY-MM-DD] [счёт] - суммы
+    //   по типам записей из снимка
+    // ConsoleApplication1 --export <transactions | users> <csv | json> [файл | -] [--user счёт]
+    //   [--type тип] [--from YYYY-MM-DD] [--to YYYY-MM-DD] - выгрузка для хранилища данных
+    bool server_mode = argc >= 3 && std::string(argv[1]) == "--server";
+    init_terminal(argc >= 2 && std::string(argv[1]) == "--batch");
+
+    if (argc >= 2 && std::string(argv[1]) == "--bench") {
+        int users = (argc >= 3) ? std::atoi(argv[2]) : 10000;
+        long long transactions = (argc >= 4) ? std::atoll(argv[3]) : 1000000;
+        int operations = (argc >= 5) ? std::atoi(argv[4]) : 10000;
+        std::string report = (argc >= 6) ? argv[5] : "bench.json";
+        if (users < 2 || transactions < 0 || operations < 1) {
+            std::cerr << "Использование: --bench [пользователей >= 2] [транзакций] [операций] [отчёт.json]" << std::endl;
+            return 1;
+        }
+        return run_benchmark(load_connection_profile("bankdb.conf"), users, transactions, operations, report);
+    }
+
+    if (argc >= 3 && std::string(argv[1]) == "--ledger-report") {
+        return run_ledger_report(argv[2], (argc >= 4) ? argv[3] : "", (argc >= 5) ? argv[4] : "",
+            (argc >= 6) ? std::atoi(argv[5]) : 0);
+    }
 
     sqlite3* db;
-    int rc = sqlite3_open("bankdb.db", &db);
+    int rc = sqlite3_open(DB_PATH, &db);
     if (rc) {
         std::cerr << "Невозможно открыть БД: " << sqlite3_errmsg(db) << std::endl;
         return 1;
     }
 
-    if (!User::create_table(db)) {
-        std::cerr << "Ошибка инициализации таблицы пользователей\n";
+    ConnectionProfile profile = load_connection_profile("bankdb.conf");
+    if (!apply_connection_profile(db, profile)) {
         return 1;
     }
 
-    TransactionManager tm(db);
-    if (!tm.create_table()) {
-        std::cerr << "Ошибка инициализации таблицы транзакций\n";
+    std::unique_ptr<MappedLedger> ledger;
+    if (!init_schema(db) || !ShardRouter::init_directory(db, profile.shards) || !open_ledger_store(db, profile, ledger)) {
         return 1;
     }
 
-    const char* alterSQL = "ALTER TABLE users ADD COLUMN status TEXT DEFAULT NULL;";
-    char* errMsg = nullptr;
-    if (sqlite3_exec(db, alterSQL, nullptr, nullptr, &errMsg) != SQLITE_OK) {
-        // Игнорируем ошибку, если колонка уже есть
-        if (std::string(errMsg).find("duplicate column name") == std::string::npos) {
-            std::cerr << "Ошибка при добавлении столбца status: " << errMsg << std::endl;
+    // Сегменты для меню и сверки; обработчики сервера открывают свои
+    std::unique_ptr<ShardRouter> router;
+    if (profile.shards > 1) {
+        router.reset(new ShardRouter(db, DB_PATH, profile));
+        bool ready = router->started();
+        for (size_t k = 1; ready && k < router->size(); ++k) {
+            ready = init_schema(router->connection(k));
+        }
+        if (!ready || !resume_transfers(db) || !resume_moves(db)) {
+            return 1;
+        }
+    }
+
+    if (argc >= 4 && std::string(argv[1]) == "--rebalance") {
+        RebalanceStatus status;
+        bool ok = rebalance_shards(db, std::atoi(argv[2]), std::atoi(argv[3]), (argc >= 5) ? std::atoi(argv[4]) : 0, status);
+        router.reset();
+        sqlite3_close(db);
+        return ok ? 0 : 1;
+    }
+
+    if (argc >= 2 && std::string(argv[1]) == "--reconcile") {
+        int threads = (argc >= 3) ? std::atoi(argv[2]) : static_cast<int>(std::thread::hardware_concurrency());
+        ReconcileReport report;
+        rc = 1;
+        if (reconcile_ledger(db, threads > 0 ? static_cast<unsigned>(threads) : 1, report)) {
+            print_reconcile_report(report);
+            rc = report.mismatches.empty() ? 0 : 2;
+        }
+        router.reset();
+        sqlite3_close(db);
+        return rc;
+    }
+
+    if (argc >= 2 && std::string(argv[1]) == "--export-columns") {
+        std::string path = (argc >= 3) ? argv[2] : "bankdb-ledger.cols";
+        ColumnExportStats stats;
+        bool ok = export_ledger_columns(db, path, stats);
+        if (ok) {
+            std::cout << "Выгружено записей: " << stats.rows << ", блоков: " << stats.blocks
+                << ", размер: " << stats.bytes << " байт ("
+                << std::fixed << std::setprecision(1) << (stats.rows > 0 ? static_cast<double>(stats.bytes) / stats.rows : 0)
+                << " на запись), время: " << std::setprecision(2) << stats.seconds << " с, файл: " << path << "\n";
+        }
+        router.reset();
+        sqlite3_close(db);
+        return ok ? 0 : 1;
+    }
+
+    if (argc >= 2 && std::string(argv[1]) == "--export") {
+        ExportRequest request;
+        ExportStats stats;
+        bool ok = parse_export_request(argc, argv, request) && export_rows(db, request, stats);
+        if (ok) {
+            // Выгрузка может идти в стандартный вывод, поэтому итог - в журнал
+            std::clog << "Выгружено строк: " << stats.rows << ", размер: " << stats.bytes << " байт, время: "
+                << std::fixed << std::setprecision(2) << stats.seconds << " с"
+                << (request.path == "-" ? std::string() : ", файл: " + request.path) << std::endl;
+        }
+        router.reset();
+        sqlite3_close(db);
+        return ok ? 0 : 1;
+    }
+
+    {
+        // Кэш должен финализировать запросы до закрытия соединения
+        StatementCache statements(db);
+        std::vector<std::unique_ptr<LedgerWriter>> writers;
+        if (profile.group_commit) {
+            for (int k = 0; k < profile.shards; ++k) {
+                writers.emplace_back(new LedgerWriter(shard_path(DB_PATH, k), profile));
+            }
+        }
+
+        if (server_mode) {
+            size_t workers = (argc >= 4) ? static_cast<size_t>(std::atoi(argv[3])) : std::thread::hardware_concurrency();
+            rc = run_server(profile, argv[2], workers > 0 ? workers : 1);
+        }
+        else {
+            menu(db);
         }
-        sqlite3_free(errMsg);
     }
-    menu(db);
 
+    router.reset();
     sqlite3_close(db);
-    return 0;
+    return rc;
 }